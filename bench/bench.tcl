@@ -0,0 +1,301 @@
+# bench.tcl --
+#
+#	db_bench style workloads, each run twice: directly on the
+#	leveldb::DB by "leveldb bench" (c++), and through the Tcl commands
+#	(tcl). The difference is the cost of the binding.
+#
+#	Usage: tclsh bench.tcl ?-num N? ?-value_size N? ?-batch {N ...}?
+#	           ?-threads {N ...}? ?-tests {TEST ...}? ?-path DIR?
+#	           ?-load SCRIPT?
+#
+#	Latency percentiles of the tcl path come from "DB_HANDLE stats", so
+#	they are measured inside the commands and are shown as "-" when the
+#	statistics are compiled out. Each of -threads readers does -num
+#	lookups; the tcl readers need the Thread package.
+#------------------------------------------------------------------------------
+
+array set opts {
+    -num        100000
+    -value_size 100
+    -batch      {10 100 1000}
+    -threads    {2 4}
+    -tests      {fillseq fillrandom overwrite fillbatch readrandom readmissing
+                 readseq readreverse readthreads}
+    -path       ./leveldbbench
+    -load       {}
+}
+foreach {name value} $argv {
+    if {![info exists opts($name)]} {
+        puts stderr "unknown option: $name"
+        exit 1
+    }
+    set opts($name) $value
+}
+
+if {$opts(-load) ne ""} {
+    eval $opts(-load)
+} else {
+    lappend auto_path .
+}
+package require leveldb
+
+set num $opts(-num)
+set path $opts(-path)
+expr {srand(301)}
+set value ""
+for {set i 0} {$i < $opts(-value_size)} {incr i} {
+    append value [format %c [expr {32 + int(rand() * 95)}]]
+}
+
+proc reopen {{fresh 0}} {
+    global dbi path
+    if {[info exists dbi]} {
+        $dbi close
+    }
+    if {$fresh} {
+        catch {leveldb destroy $path}
+    }
+    set dbi [leveldb open -path $path -create_if_missing 1]
+}
+
+# The latency of the tcl path, from the statistics of the commands.
+proc latency {stats op} {
+    if {$stats eq "" || [dict get $stats $op count] == 0} {
+        return {- - -}
+    }
+    set op [dict get $stats $op]
+    return [list [dict get $op p50] [dict get $op p99] [dict get $op p999]]
+}
+
+proc stats {} {
+    global dbi
+    if {[catch {$dbi stats -reset} stats]} {
+        return ""
+    }
+    return $stats
+}
+
+proc report {name path ops bytes usec latency {base ""}} {
+    set seconds [expr {max($usec, 1) / 1e6}]
+    set rate [expr {$ops / $seconds}]
+    set line [format "%-16s %-4s %12.1f %9.1f" $name $path $rate \
+                  [expr {$bytes / 1048576.0 / $seconds}]]
+    foreach p $latency {
+        if {$p eq "-"} {
+            append line [format " %9s" -]
+        } else {
+            append line [format " %9.2f" $p]
+        }
+    }
+    if {$base ne ""} {
+        append line [format " %7.1f%%" [expr {100.0 * $rate / $base}]]
+    }
+    puts $line
+    return $rate
+}
+
+proc run_cxx {name test args} {
+    global dbi num opts
+    set result [leveldb bench $dbi $test -num $num \
+                    -value_size $opts(-value_size) {*}$args]
+    set usec [expr {[dict get $result seconds] * 1e6}]
+    set bytes [expr {[dict get $result mb_per_sec] * 1048576.0 \
+                         * [dict get $result seconds]}]
+    return [report $name c++ [dict get $result ops] $bytes $usec \
+                [list [dict get $result p50] [dict get $result p99] \
+                     [dict get $result p999]]]
+}
+
+proc fill {dbi num value batch random} {
+    for {set i 0} {$i < $num} {incr i $batch} {
+        if {$batch > 1} {
+            set bat [$dbi batch]
+        }
+        for {set n 0} {$n < $batch && $i + $n < $num} {incr n} {
+            if {$random} {
+                set key [format %016d [expr {int(rand() * $num)}]]
+            } else {
+                set key [format %016d [expr {$i + $n}]]
+            }
+            if {$batch > 1} {
+                $bat put $key $value
+            } else {
+                $dbi put $key $value
+            }
+        }
+        if {$batch > 1} {
+            $dbi write $bat
+            $bat close
+        }
+    }
+    return [expr {$num * (16 + [string length $value])}]
+}
+
+proc read_random {dbi num suffix} {
+    set bytes 0
+    for {set i 0} {$i < $num} {incr i} {
+        set key [format %016d%s [expr {int(rand() * $num)}] $suffix]
+        if {![catch {$dbi get $key} value]} {
+            incr bytes [expr {[string length $key] + [string length $value]}]
+        }
+    }
+    return $bytes
+}
+
+proc read_seq {dbi num reverse} {
+    set bytes 0
+    set it [$dbi iterator]
+    if {$reverse} {
+        $it seektolast
+        set step prev
+    } else {
+        $it seektofirst
+        set step next
+    }
+    for {set i 0} {$i < $num && [$it valid]} {incr i} {
+        incr bytes [expr {[string length [$it key]] + [string length [$it value]]}]
+        $it $step
+    }
+    $it close
+    return $bytes
+}
+
+proc run_tcl {name op ops script base} {
+    global dbi
+    stats
+    set bytes 0
+    set usec [lindex [time {set bytes [uplevel #0 $script]}] 0]
+    report $name tcl $ops $bytes $usec [latency [stats] $op] $base
+}
+
+proc run_fill {name test batch random} {
+    global dbi num
+    if {$test ne "overwrite"} {
+        reopen 1
+    }
+    set base [run_cxx $name $test -batch $batch]
+    if {$test ne "overwrite"} {
+        reopen 1
+    }
+    run_tcl $name [expr {$batch > 1 ? "write" : "put"}] $num \
+        [list fill $dbi $num $::value $batch $random] $base
+}
+
+proc run_threads {name threads} {
+    global dbi num path opts
+    set base [run_cxx $name readrandom -threads $threads]
+    if {[catch {package require Thread}]} {
+        puts [format "%-16s %-4s %s" $name tcl "skipped, needs the Thread package"]
+        return
+    }
+
+    set load $opts(-load)
+    if {$load eq ""} {
+        set load [list set auto_path $::auto_path]
+    }
+    set tids {}
+    for {set t 0} {$t < $threads} {incr t} {
+        set tid [thread::create]
+        thread::send $tid $load
+        thread::send $tid [list package require leveldb]
+        thread::send $tid "set dbi \[leveldb open -path [list $path]\]"
+        thread::send $tid [list proc read_random [info args read_random] [info body read_random]]
+        thread::send $tid "expr {srand([expr {$t + 1000}])}"
+        lappend tids $tid
+    }
+
+    set start [clock microseconds]
+    foreach tid $tids {
+        thread::send -async $tid "read_random \$dbi $num {}" ::bytes($tid)
+    }
+    while {[array size ::bytes] < $threads} {
+        vwait ::bytes
+    }
+    set usec [expr {[clock microseconds] - $start}]
+
+    set bytes 0
+    set latency {- - -}
+    foreach tid $tids {
+        incr bytes $::bytes($tid)
+        if {![catch {thread::send $tid {$dbi stats}} stats]} {
+            # the slowest reader
+            set latency [lmap a $latency b [latency $stats get] {
+                expr {$a eq "-" ? $b : max($a, $b)}
+            }]
+        }
+        thread::send $tid {$dbi close}
+        thread::release $tid
+    }
+    unset ::bytes
+    report $name tcl [expr {$num * $threads}] $bytes $usec $latency $base
+}
+
+puts [format "leveldb %s, tcl %s: %d keys, 16 byte keys, %d byte values" \
+          [leveldb version] [info patchlevel] $num $opts(-value_size)]
+puts [format "%-16s %-4s %12s %9s %9s %9s %9s %8s" \
+          test path ops/sec MB/s p50(us) p99(us) p999(us) tcl/c++]
+
+set filled 0
+foreach test $opts(-tests) {
+    switch -- $test {
+        fillseq {
+            run_fill fillseq fillseq 1 0
+        }
+        fillrandom {
+            run_fill fillrandom fillrandom 1 1
+        }
+        overwrite {
+            if {![info exists dbi]} {
+                reopen 1
+                leveldb bench $dbi fillrandom -num $num
+            }
+            run_fill overwrite overwrite 1 1
+        }
+        fillbatch {
+            foreach batch $opts(-batch) {
+                run_fill fillbatch/$batch fillseq $batch 0
+            }
+        }
+        readrandom - readmissing - readseq - readreverse - readthreads {
+            if {!$filled} {
+                reopen 1
+                leveldb bench $dbi fillseq -num $num -value_size $opts(-value_size)
+                reopen
+                set filled 1
+            }
+            switch -- $test {
+                readrandom {
+                    set base [run_cxx readrandom readrandom]
+                    run_tcl readrandom get $num [list read_random $dbi $num {}] $base
+                }
+                readmissing {
+                    set base [run_cxx readmissing readmissing]
+                    run_tcl readmissing get $num [list read_random $dbi $num .] $base
+                }
+                readseq {
+                    set base [run_cxx readseq readseq]
+                    run_tcl readseq iterator $num [list read_seq $dbi $num 0] $base
+                }
+                readreverse {
+                    set base [run_cxx readreverse readreverse]
+                    run_tcl readreverse iterator $num [list read_seq $dbi $num 1] $base
+                }
+                readthreads {
+                    foreach threads $opts(-threads) {
+                        run_threads readrandom/${threads}t $threads
+                    }
+                }
+            }
+        }
+        default {
+            puts stderr "unknown test: $test"
+            exit 1
+        }
+    }
+    if {$test in {fillseq fillrandom overwrite fillbatch}} {
+        set filled 0
+    }
+}
+
+$dbi close
+leveldb destroy $path
@@ -0,0 +1,54 @@
+# dispatch.tcl --
+#
+#	Measure the per call overhead of DB_HANDLE commands.
+#
+#	Usage: tclsh dispatch.tcl ?count?
+#------------------------------------------------------------------------------
+
+lappend auto_path .
+package require leveldb
+
+set count [expr {[llength $argv] > 0 ? [lindex $argv 0] : 200000}]
+set path "./leveldbbench"
+
+catch {leveldb destroy $path}
+set dbi [leveldb open -path $path -create_if_missing 1]
+
+proc measure {name count script} {
+    set usec [lindex [time $script 1] 0]
+    puts [format "%-24s %10.3f usec/op" $name [expr {double($usec) / $count}]]
+}
+
+proc bench_put {dbi count} {
+    for {set i 0} {$i < $count} {incr i} {
+        $dbi put "key$i" "value"
+    }
+}
+
+proc bench_get {dbi count} {
+    for {set i 0} {$i < $count} {incr i} {
+        $dbi get "key$i"
+    }
+}
+
+proc bench_get_snapshot {dbi snapshot count} {
+    for {set i 0} {$i < $count} {incr i} {
+        $dbi get "key$i" -snapshot $snapshot
+    }
+}
+
+proc bench_property {dbi count} {
+    for {set i 0} {$i < $count} {incr i} {
+        $dbi getProperty "leveldb.num-files-at-level0"
+    }
+}
+
+measure put $count [list bench_put $dbi $count]
+set snapshot [$dbi snapshot]
+measure get $count [list bench_get $dbi $count]
+measure "get -snapshot" $count [list bench_get_snapshot $dbi $snapshot $count]
+measure getProperty $count [list bench_property $dbi $count]
+
+$snapshot close -db $dbi
+$dbi close
+leveldb destroy $path
@@ -5,9 +5,25 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cerrno>
+#include <cctype>
+#include <cmath>
 #include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <chrono>
+#include <algorithm>
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
+#include <leveldb/filter_policy.h>
+#include <leveldb/cache.h>
+#include <leveldb/comparator.h>
+#include <leveldb/env.h>
+#ifndef LEVELDB_NO_MEMENV
+#include <leveldb/helpers/memenv.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -36,310 +52,4993 @@ typedef struct ThreadSpecificData {
   int itr_count;
   int bat_count;
   int sst_count;
+  int cache_count;
 } ThreadSpecificData;
 
 static Tcl_ThreadDataKey dataKey;
 
 TCL_DECLARE_MUTEX(myMutex);
+TCL_DECLARE_MUTEX(registryMutex);
 
 
-void LEVELDB_Thread_Exit(ClientData clientdata)
+static ThreadSpecificData *LEVELDB_GetThreadData(void)
 {
   ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
       Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
 
-  if(tsdPtr->leveldb_hashtblPtr) {
-    Tcl_DeleteHashTable(tsdPtr->leveldb_hashtblPtr);
-    ckfree(tsdPtr->leveldb_hashtblPtr);
+  if (tsdPtr->initialized == 0) {
+    tsdPtr->initialized = 1;
+    tsdPtr->leveldb_hashtblPtr = (Tcl_HashTable *) ckalloc(sizeof(Tcl_HashTable));
+    Tcl_InitHashTable(tsdPtr->leveldb_hashtblPtr, TCL_STRING_KEYS);
   }
+
+  return tsdPtr;
 }
 
 
-static int LEVELDB_SST(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv){
-  int choice;
-  const leveldb::Snapshot* shot;
+/*
+ * Every handle command gets its info struct as ClientData, so calling a
+ * handle does no lookup at all. The per thread hash table maps handle
+ * names to LevelHandle, and is only used to resolve handles passed as
+ * arguments (-snapshot, write, -block_cache, -db). Those arguments are
+ * cached in the Tcl_Obj through levelHandleType.
+ *
+ * A LevelHandle is reference counted by the command and by every
+ * Tcl_Obj that caches it. When the command is deleted clientData is set
+ * to NULL, so a cached Tcl_Obj never points to a freed info struct.
+ */
+enum LevelHandleKind {
+  LEVEL_HANDLE_DBI,
+  LEVEL_HANDLE_ITR,
+  LEVEL_HANDLE_BAT,
+  LEVEL_HANDLE_SST,
+  LEVEL_HANDLE_CACHE,
+};
+
+static const char *LevelHandleNames[] = {
+  "db",
+  "iterator",
+  "batch",
+  "snapshot",
+  "cache",
+};
+
+typedef struct LevelHandle {
+  void *clientData;               /* info struct, NULL once deleted */
+  int kind;                       /* enum LevelHandleKind */
+  int refCount;
+  Tcl_Command token;
   Tcl_HashEntry *hashEntryPtr;
-  char *sstHandle;
+} LevelHandle;
 
-  ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
-      Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
 
-  if (tsdPtr->initialized == 0) {
-    tsdPtr->initialized = 1;
-    tsdPtr->leveldb_hashtblPtr = (Tcl_HashTable *) ckalloc(sizeof(Tcl_HashTable));
-    Tcl_InitHashTable(tsdPtr->leveldb_hashtblPtr, TCL_STRING_KEYS);
-  }
-  static const char *SST_strs[] = {
-    "close",
-    0
-  };
+/*
+ * A block cache created by "leveldb cache create". It is reference
+ * counted: the CACHE_HANDLE holds one reference and every database
+ * opened with -block_cache holds another, so the cache is deleted only
+ * after the handle is closed and the last database using it is closed.
+ */
+typedef struct LevelCacheInfo {
+  leveldb::Cache *cache;
+  Tcl_WideInt capacity;
+  int refCount;
+  LevelHandle *handle;
+} LevelCacheInfo;
 
-  enum SST_enum {
-    SST_CLOSE,
-  };
 
-  if( objc < 2 ){
-    Tcl_WrongNumArgs(interp, 1, objv, "SUBCOMMAND ...");
-    return TCL_ERROR;
-  }
+/*
+ * leveldb allows only one leveldb::DB per directory in a process, and a
+ * leveldb::DB is safe for concurrent use. So every DB_HANDLE, in any
+ * thread, opened with the same canonical path attaches to one shared
+ * LevelSharedDB, registered in levelSharedDBs. Objects passed to
+ * leveldb::Options are owned here and freed after the leveldb::DB is
+ * deleted, when the last handle detaches.
+ *
+ * levelSharedDBs and refCount are guarded by registryMutex.
+ */
+typedef struct LevelCommitWriter LevelCommitWriter;
+class LevelIOEnv;
+
+typedef struct LevelSharedDB {
+  std::string path;
+  leveldb::DB *db;
+  const leveldb::FilterPolicy *filter_policy;
+  const leveldb::Comparator *comparator;
+  LevelCacheInfo *cache_info;
+  int inmemory;                   /* in an Env of levelMemEnvs */
+  LevelIOEnv *io_env;             /* -io_stats, NULL if not enabled */
+  int refCount;
+
+  /* group commit of synced writes, see LEVELDB_Write */
+  int group_commit_us;            /* window, 0 if disabled */
+  Tcl_Mutex commitMutex;
+  Tcl_Condition commitCond;       /* a writer is done or may lead */
+  Tcl_Condition windowCond;       /* never notified, times the window */
+  std::vector<LevelCommitWriter *> pending;
+  int leader;                     /* a group is being collected or written */
+} LevelSharedDB;
+
+static std::map<std::string, LevelSharedDB *> levelSharedDBs;
 
-  if( Tcl_GetIndexFromObj(interp, objv[1], SST_strs, "option", 0, &choice) ){
-    return TCL_ERROR;
-  }
 
-  /*
-   * Get the leveldb::Snapshot value
-   */
-  sstHandle = Tcl_GetStringFromObj(objv[0], 0);
-  hashEntryPtr = Tcl_FindHashEntry( tsdPtr->leveldb_hashtblPtr, sstHandle );
-  if( !hashEntryPtr ) {
-    if( interp ) {
-        Tcl_Obj *resultObj = Tcl_GetObjResult( interp );
+/*
+ * The Envs of "leveldb open -inmemory 1", by name. A memory Env holds the
+ * files of its database, so it is kept after the database is closed and
+ * a later open of the same name, from any thread, finds the data again.
+ * "leveldb destroy -inmemory 1" frees it. An in-memory database is
+ * registered in levelSharedDBs under LEVELDB_MEMENV_PREFIX and its name,
+ * which no normalized path starts with. Guarded by registryMutex.
+ *
+ * Build with -DLEVELDB_NO_MEMENV for a leveldb without helpers/memenv.
+ */
+#define LEVELDB_MEMENV_PREFIX "inmemory:"
 
-        Tcl_AppendStringsToObj( resultObj, "invalid snapshot handle ", sstHandle, (char *)NULL );
-    }
+#ifndef LEVELDB_NO_MEMENV
+static std::map<std::string, leveldb::Env *> levelMemEnvs;
+#endif
 
-    return TCL_ERROR;
+
+/*
+ * Operation statistics of a DB_HANDLE, shown by "DB_HANDLE stats". Each
+ * operation has a count, the bytes of keys and values it read or wrote,
+ * and a histogram of its latency in nanoseconds, with four buckets per
+ * power of two. A handle is used by one thread only, so no locking is
+ * needed; -async results are recorded when the callback is queued.
+ *
+ * Build with -DLEVELDB_NO_STATS to compile the instrumentation out.
+ */
+enum LevelStatOp {
+  LEVEL_STAT_GET,
+  LEVEL_STAT_PUT,
+  LEVEL_STAT_DELETE,
+  LEVEL_STAT_WRITE,
+  LEVEL_STAT_MGET,
+  LEVEL_STAT_MPUT,
+  LEVEL_STAT_MDELETE,
+  LEVEL_STAT_SCAN,
+  LEVEL_STAT_ITERATOR,
+  LEVEL_STAT_BATCH,
+  LEVEL_STAT_OPS
+};
+
+static const char *LevelStatNames[] = {
+  "get",
+  "put",
+  "delete",
+  "write",
+  "mget",
+  "mput",
+  "mdelete",
+  "scan",
+  "iterator",
+  "batch",
+};
+
+#define LEVELDB_STAT_BUCKETS 256
+
+typedef struct LevelOpStats {
+  Tcl_WideInt count;
+  Tcl_WideInt bytes;
+  Tcl_WideInt max_ns;
+  Tcl_WideInt buckets[LEVELDB_STAT_BUCKETS];
+} LevelOpStats;
+
+typedef struct LevelStats {
+  LevelOpStats ops[LEVEL_STAT_OPS];
+  int refCount;                   /* the DB_HANDLE and its batches */
+} LevelStats;
+
+#ifndef LEVELDB_NO_STATS
+typedef std::chrono::steady_clock::time_point LevelStatTime;
+
+#define LEVELDB_STAT_BEGIN(t)   LevelStatTime t = std::chrono::steady_clock::now()
+#define LEVELDB_STAT_END(stats, op, t, nbytes) \
+    LEVELDB_StatRecord(stats, op, std::chrono::duration_cast<std::chrono::nanoseconds>( \
+        std::chrono::steady_clock::now() - (t)).count(), nbytes)
+#else
+#define LEVELDB_STAT_BEGIN(t)
+#define LEVELDB_STAT_END(stats, op, t, nbytes)
+#endif
+
+
+static LevelStats *LEVELDB_NewStats(void)
+{
+#ifndef LEVELDB_NO_STATS
+  LevelStats *stats = new LevelStats;
+
+  memset(stats->ops, 0, sizeof(stats->ops));
+  stats->refCount = 1;
+
+  return stats;
+#else
+  return NULL;
+#endif
+}
+
+
+static void LEVELDB_ReleaseStats(LevelStats *stats)
+{
+  if( stats && --stats->refCount == 0 ) {
+    delete stats;
   }
+}
 
-  shot = (leveldb::Snapshot *)(uintptr_t)Tcl_GetHashValue( hashEntryPtr );
 
-  switch( (enum SST_enum)choice ){
+static int LEVELDB_StatBucket(Tcl_WideInt ns)
+{
+  uint64_t v = (uint64_t) (ns < 0 ? 0 : ns);
+  int msb = 0;
 
-    case SST_CLOSE: {
-      leveldb::DB* db;
-      const char *dbiHandle = NULL;
-      Tcl_Size len = 0;
-      char *zArg;
-      int i = 0;
-      Tcl_HashEntry *dbHashEntryPtr;
+  if( v < 4 ) {
+    return (int) v;
+  }
 
-      if( objc != 4 ){
-        Tcl_WrongNumArgs(interp, 2, objv, "-db DB_HANDLE ");
-        return TCL_ERROR;
-      }
+  while( (v >> (msb + 1)) != 0 ) {
+    msb++;
+  }
 
-      for(i=2; i+1<objc; i+=2){
-        zArg = Tcl_GetStringFromObj(objv[i], 0);
+  return 4 * (msb - 1) + (int) ((v >> (msb - 2)) & 3);
+}
 
-        if( strcmp(zArg, "-db")==0 ){
-            dbiHandle = Tcl_GetStringFromObj(objv[i+1], &len);
-            if(!dbiHandle || len < 1) {
-                return TCL_ERROR;
-            }
-        } else{
-           Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
-           return TCL_ERROR;
-        }
-      }
 
-      /*
-       * Get the leveldb::DB value
-       */
+/*
+ * The upper bound of a bucket, in nanoseconds.
+ */
+static Tcl_WideInt LEVELDB_StatBucketLimit(int bucket)
+{
+  int msb;
 
-      if(!dbiHandle) {
-        if( interp ) {
-            Tcl_Obj *resultObj = Tcl_GetObjResult( interp );
+  if( bucket < 4 ) {
+    return bucket;
+  }
 
-            Tcl_AppendStringsToObj( resultObj, "invalid db handle (null) ", dbiHandle, (char *)NULL );
-        }
+  msb = bucket / 4 + 1;
+  return (Tcl_WideInt) (((uint64_t) (5 + bucket % 4) << (msb - 2)) - 1);
+}
 
-        return TCL_ERROR;
-      }
 
-      dbHashEntryPtr = Tcl_FindHashEntry( tsdPtr->leveldb_hashtblPtr, dbiHandle );
-      if( !dbHashEntryPtr ) {
-        if( interp ) {
-            Tcl_Obj *resultObj = Tcl_GetObjResult( interp );
+static void LEVELDB_OpStatRecord(LevelOpStats *opStats, Tcl_WideInt ns,
+                                 Tcl_WideInt nbytes)
+{
+  opStats->count++;
+  opStats->bytes += nbytes;
+  opStats->buckets[LEVELDB_StatBucket(ns)]++;
+  if( ns > opStats->max_ns ) {
+    opStats->max_ns = ns;
+  }
+}
 
-            Tcl_AppendStringsToObj( resultObj, "invalid db handle ", dbiHandle, (char *)NULL );
-        }
 
-        return TCL_ERROR;
-      }
+static void LEVELDB_StatRecord(LevelStats *stats, int op, Tcl_WideInt ns,
+                               Tcl_WideInt nbytes)
+{
+  if( stats ) {
+    LEVELDB_OpStatRecord(&stats->ops[op], ns, nbytes);
+  }
+}
 
-      db = (leveldb::DB *)(uintptr_t)Tcl_GetHashValue( dbHashEntryPtr );
-      db->ReleaseSnapshot(shot);
 
-      Tcl_MutexLock(&myMutex);
-      if( hashEntryPtr )  Tcl_DeleteHashEntry(hashEntryPtr);
-      Tcl_MutexUnlock(&myMutex);
+/*
+ * Latency in microseconds below which the fraction q of the operations
+ * completed.
+ */
+static double LEVELDB_StatPercentile(const LevelOpStats *opStats, double q)
+{
+  Tcl_WideInt rank = (Tcl_WideInt) (q * (double) opStats->count);
+  Tcl_WideInt seen = 0;
+  Tcl_WideInt limit;
+  int i;
 
-      Tcl_DeleteCommand(interp, sstHandle);
-      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+  if( opStats->count == 0 ) {
+    return 0.0;
+  }
 
+  for(i = 0; i < LEVELDB_STAT_BUCKETS; i++) {
+    seen += opStats->buckets[i];
+    if( seen > rank ) {
       break;
     }
   }
 
-  return TCL_OK;
+  limit = LEVELDB_StatBucketLimit(i < LEVELDB_STAT_BUCKETS ? i : LEVELDB_STAT_BUCKETS - 1);
+  if( limit > opStats->max_ns ) {
+    limit = opStats->max_ns;
+  }
+
+  return (double) limit / 1000.0;
 }
 
 
-static int LEVELDB_BAT(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv){
-  int choice;
-  leveldb::WriteBatch* batch;
-  Tcl_HashEntry *hashEntryPtr;
-  char *batHandle;
+static Tcl_Obj *LEVELDB_StatsObj(const LevelStats *stats)
+{
+  Tcl_Obj *resultObj = Tcl_NewListObj(0, NULL);
+  int op;
+
+  for(op = 0; op < LEVEL_STAT_OPS; op++) {
+    const LevelOpStats *opStats = &stats->ops[op];
+    Tcl_Obj *opObj = Tcl_NewListObj(0, NULL);
+
+    Tcl_ListObjAppendElement(NULL, opObj, Tcl_NewStringObj("count", -1));
+    Tcl_ListObjAppendElement(NULL, opObj, Tcl_NewWideIntObj(opStats->count));
+    Tcl_ListObjAppendElement(NULL, opObj, Tcl_NewStringObj("bytes", -1));
+    Tcl_ListObjAppendElement(NULL, opObj, Tcl_NewWideIntObj(opStats->bytes));
+    Tcl_ListObjAppendElement(NULL, opObj, Tcl_NewStringObj("p50", -1));
+    Tcl_ListObjAppendElement(NULL, opObj, Tcl_NewDoubleObj(LEVELDB_StatPercentile(opStats, 0.5)));
+    Tcl_ListObjAppendElement(NULL, opObj, Tcl_NewStringObj("p99", -1));
+    Tcl_ListObjAppendElement(NULL, opObj, Tcl_NewDoubleObj(LEVELDB_StatPercentile(opStats, 0.99)));
+    Tcl_ListObjAppendElement(NULL, opObj, Tcl_NewStringObj("p999", -1));
+    Tcl_ListObjAppendElement(NULL, opObj, Tcl_NewDoubleObj(LEVELDB_StatPercentile(opStats, 0.999)));
+    Tcl_ListObjAppendElement(NULL, opObj, Tcl_NewStringObj("max", -1));
+    Tcl_ListObjAppendElement(NULL, opObj, Tcl_NewDoubleObj((double) opStats->max_ns / 1000.0));
+
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj(LevelStatNames[op], -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, opObj);
+  }
 
-  ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
-      Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+  return resultObj;
+}
 
-  if (tsdPtr->initialized == 0) {
-    tsdPtr->initialized = 1;
-    tsdPtr->leveldb_hashtblPtr = (Tcl_HashTable *) ckalloc(sizeof(Tcl_HashTable));
-    Tcl_InitHashTable(tsdPtr->leveldb_hashtblPtr, TCL_STRING_KEYS);
+
+/*
+ * I/O statistics of a database opened with -io_stats, shown by
+ * "DB_HANDLE iostats". LevelIOEnv wraps the Env of the database and
+ * wraps every file it opens, so the reads, writes and syncs of leveldb
+ * (including its background compactions) are counted by file class.
+ * Sequential reads go through SequentialFile, which leveldb uses for
+ * the log and MANIFEST on recovery; all table reads, by lookups,
+ * iterators and compaction inputs alike, are random reads through
+ * RandomAccessFile. The counters are shared by all handles of the database and
+ * updated from leveldb threads, so they are guarded by a mutex.
+ */
+enum LevelIOClass {
+  LEVEL_IO_LOG,
+  LEVEL_IO_TABLE,
+  LEVEL_IO_MANIFEST,
+  LEVEL_IO_OTHER,
+  LEVEL_IO_CLASSES
+};
+
+static const char *LevelIOClassNames[] = {
+  "log",
+  "table",
+  "manifest",
+  "other",
+};
+
+typedef struct LevelIOStats {
+  Tcl_WideInt opens;
+  Tcl_WideInt seq_reads;
+  Tcl_WideInt seq_read_bytes;
+  Tcl_WideInt random_reads;
+  Tcl_WideInt random_read_bytes;
+  Tcl_WideInt writes;
+  Tcl_WideInt write_bytes;
+  LevelOpStats syncs;             /* latency of Sync, bytes unused */
+} LevelIOStats;
+
+
+static int LEVELDB_IOClass(const std::string &fname)
+{
+  size_t slash = fname.rfind('/');
+  std::string name = fname.substr(slash == std::string::npos ? 0 : slash + 1);
+  size_t dot = name.rfind('.');
+  std::string suffix = dot == std::string::npos ? "" : name.substr(dot);
+
+  if( suffix == ".log" ) {
+    return LEVEL_IO_LOG;
+  }
+  if( suffix == ".ldb" || suffix == ".sst" ) {
+    return LEVEL_IO_TABLE;
+  }
+  if( name.compare(0, 9, "MANIFEST-") == 0 ) {
+    return LEVEL_IO_MANIFEST;
   }
-  static const char *BAT_strs[] = {
-    "put",
-    "delete",
-    "close",
-    0
-  };
 
-  enum BAT_enum {
-    BAT_PUT,
-    BAT_DELETE,
-    BAT_CLOSE,
-  };
+  return LEVEL_IO_OTHER;
+}
 
-  if( objc < 2 ){
-    Tcl_WrongNumArgs(interp, 1, objv, "SUBCOMMAND ...");
-    return TCL_ERROR;
+
+class LevelIOEnv : public leveldb::EnvWrapper {
+ public:
+  LevelIOEnv(leveldb::Env *target) : leveldb::EnvWrapper(target), mutex_(NULL) {
+    memset(stats_, 0, sizeof(stats_));
   }
 
-  if( Tcl_GetIndexFromObj(interp, objv[1], BAT_strs, "option", 0, &choice) ){
-    return TCL_ERROR;
+  ~LevelIOEnv() {
+    Tcl_MutexFinalize(&mutex_);
+  }
+
+  leveldb::Status NewSequentialFile(const std::string& fname,
+                                    leveldb::SequentialFile** result);
+  leveldb::Status NewRandomAccessFile(const std::string& fname,
+                                      leveldb::RandomAccessFile** result);
+  leveldb::Status NewWritableFile(const std::string& fname,
+                                  leveldb::WritableFile** result);
+  leveldb::Status NewAppendableFile(const std::string& fname,
+                                    leveldb::WritableFile** result);
+
+  void Read(int ioClass, int random, size_t nbytes) {
+    Tcl_MutexLock(&mutex_);
+    if( random ) {
+      stats_[ioClass].random_reads++;
+      stats_[ioClass].random_read_bytes += nbytes;
+    } else {
+      stats_[ioClass].seq_reads++;
+      stats_[ioClass].seq_read_bytes += nbytes;
+    }
+    Tcl_MutexUnlock(&mutex_);
+  }
+
+  void Write(int ioClass, size_t nbytes) {
+    Tcl_MutexLock(&mutex_);
+    stats_[ioClass].writes++;
+    stats_[ioClass].write_bytes += nbytes;
+    Tcl_MutexUnlock(&mutex_);
+  }
+
+  void Sync(int ioClass, Tcl_WideInt ns) {
+    Tcl_MutexLock(&mutex_);
+    LEVELDB_OpStatRecord(&stats_[ioClass].syncs, ns, 0);
+    Tcl_MutexUnlock(&mutex_);
   }
 
   /*
-   * Get the leveldb::WriteBatch value
+   * Copy the counters to stats, then clear them if reset is set.
    */
-  batHandle = Tcl_GetStringFromObj(objv[0], 0);
-  hashEntryPtr = Tcl_FindHashEntry( tsdPtr->leveldb_hashtblPtr, batHandle );
-  if( !hashEntryPtr ) {
-    if( interp ) {
-        Tcl_Obj *resultObj = Tcl_GetObjResult( interp );
-
-        Tcl_AppendStringsToObj( resultObj, "invalid batch handle ", batHandle, (char *)NULL );
+  void Get(LevelIOStats *stats, int reset) {
+    Tcl_MutexLock(&mutex_);
+    memcpy(stats, stats_, sizeof(stats_));
+    if( reset ) {
+      memset(stats_, 0, sizeof(stats_));
     }
+    Tcl_MutexUnlock(&mutex_);
+  }
 
-    return TCL_ERROR;
+ private:
+  void Open(int ioClass) {
+    Tcl_MutexLock(&mutex_);
+    stats_[ioClass].opens++;
+    Tcl_MutexUnlock(&mutex_);
   }
 
-  batch = (leveldb::WriteBatch *)(uintptr_t)Tcl_GetHashValue( hashEntryPtr );
+  Tcl_Mutex mutex_;
+  LevelIOStats stats_[LEVEL_IO_CLASSES];
+};
 
-  switch( (enum BAT_enum)choice ){
 
-    case BAT_PUT: {
-      const char *key = NULL;
-      const char *data = NULL;
-      Tcl_Size key_len = 0;
-      Tcl_Size data_len = 0;
-      leveldb::Slice key2;
-      leveldb::Slice value2;
+class LevelIOSequentialFile : public leveldb::SequentialFile {
+ public:
+  LevelIOSequentialFile(leveldb::SequentialFile *target, LevelIOEnv *env, int ioClass)
+      : target_(target), env_(env), class_(ioClass) {}
 
-      if( objc != 4 ) {
-        Tcl_WrongNumArgs(interp, 2, objv, "key data ");
-        return TCL_ERROR;
-      }
+  ~LevelIOSequentialFile() {
+    delete target_;
+  }
 
-      key = Tcl_GetStringFromObj(objv[2], &key_len);
-      if( !key || key_len < 1 ){
-         Tcl_AppendResult(interp, "Error: key is an empty key ", (char*)0);
-         return TCL_ERROR;
-      }
+  leveldb::Status Read(size_t n, leveldb::Slice* result, char* scratch) {
+    leveldb::Status status = target_->Read(n, result, scratch);
 
-      data = Tcl_GetStringFromObj(objv[3], &data_len);
-      if( !data || data_len < 1 ){
-         Tcl_AppendResult(interp, "Error: data is an empty value ", (char*)0);
-         return TCL_ERROR;
-      }
+    if( status.ok() ) {
+      env_->Read(class_, 0, result->size());
+    }
+    return status;
+  }
 
-      key2 = leveldb::Slice(key, key_len);
-      value2 = leveldb::Slice(data, data_len);
-      batch->Put(key2, value2);
-      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+  leveldb::Status Skip(uint64_t n) {
+    return target_->Skip(n);
+  }
 
-      break;
-    }
+ private:
+  leveldb::SequentialFile *target_;
+  LevelIOEnv *env_;
+  int class_;
+};
 
-    case BAT_DELETE: {
-      const char *key = NULL;
-      Tcl_Size key_len = 0;
-      leveldb::Slice key2;
 
-      if( objc  !=  3 ) {
-        Tcl_WrongNumArgs(interp, 2, objv, "key ");
-        return TCL_ERROR;
-      }
+class LevelIORandomAccessFile : public leveldb::RandomAccessFile {
+ public:
+  LevelIORandomAccessFile(leveldb::RandomAccessFile *target, LevelIOEnv *env, int ioClass)
+      : target_(target), env_(env), class_(ioClass) {}
 
-      key = Tcl_GetStringFromObj(objv[2], &key_len);
-      if( !key || key_len < 1 ){
-         Tcl_AppendResult(interp, "Error: key is an empty key ", (char*)0);
-         return TCL_ERROR;
-      }
+  ~LevelIORandomAccessFile() {
+    delete target_;
+  }
 
-      key2 = leveldb::Slice(key, key_len);
-      batch->Delete(key2);
-      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+  leveldb::Status Read(uint64_t offset, size_t n, leveldb::Slice* result,
+                       char* scratch) const {
+    leveldb::Status status = target_->Read(offset, n, result, scratch);
 
-      break;
+    if( status.ok() ) {
+      env_->Read(class_, 1, result->size());
     }
+    return status;
+  }
 
-    case BAT_CLOSE: {
-      if( objc != 2 ){
-        Tcl_WrongNumArgs(interp, 2, objv, 0);
-        return TCL_ERROR;
-      }
+ private:
+  leveldb::RandomAccessFile *target_;
+  LevelIOEnv *env_;
+  int class_;
+};
 
-      delete batch;
 
-      Tcl_MutexLock(&myMutex);
-      if( hashEntryPtr )  Tcl_DeleteHashEntry(hashEntryPtr);
-      Tcl_MutexUnlock(&myMutex);
+class LevelIOWritableFile : public leveldb::WritableFile {
+ public:
+  LevelIOWritableFile(leveldb::WritableFile *target, LevelIOEnv *env, int ioClass)
+      : target_(target), env_(env), class_(ioClass) {}
 
-      Tcl_DeleteCommand(interp, batHandle);
-      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+  ~LevelIOWritableFile() {
+    delete target_;
+  }
 
-      break;
+  leveldb::Status Append(const leveldb::Slice& data) {
+    leveldb::Status status = target_->Append(data);
+
+    if( status.ok() ) {
+      env_->Write(class_, data.size());
     }
+    return status;
   }
 
-  return TCL_OK;
-}
-
+  leveldb::Status Close() {
+    return target_->Close();
+  }
 
-static int LEVELDB_ITR(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv){
-  int choice;
-  leveldb::Iterator* it;
-  Tcl_HashEntry *hashEntryPtr;
-  char *itrHandle;
+  leveldb::Status Flush() {
+    return target_->Flush();
+  }
 
-  ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
-      Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+  leveldb::Status Sync() {
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    leveldb::Status status = target_->Sync();
 
-  if (tsdPtr->initialized == 0) {
-    tsdPtr->initialized = 1;
-    tsdPtr->leveldb_hashtblPtr = (Tcl_HashTable *) ckalloc(sizeof(Tcl_HashTable));
-    Tcl_InitHashTable(tsdPtr->leveldb_hashtblPtr, TCL_STRING_KEYS);
+    env_->Sync(class_, std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - t0).count());
+    return status;
   }
 
-  static const char *ITR_strs[] = {
-    "seektofirst",
-    "seektolast",
-    "seek",
-    "valid",
-    "next",
-    "prev",
-    "key",
-    "value",
-    "close",
-    0
-  };
+ private:
+  leveldb::WritableFile *target_;
+  LevelIOEnv *env_;
+  int class_;
+};
 
-  enum ITR_enum {
-    ITR_SEEKTOFIRST,
+
+leveldb::Status LevelIOEnv::NewSequentialFile(const std::string& fname,
+                                              leveldb::SequentialFile** result)
+{
+  int ioClass = LEVELDB_IOClass(fname);
+  leveldb::Status status = target()->NewSequentialFile(fname, result);
+
+  if( status.ok() ) {
+    Open(ioClass);
+    *result = new LevelIOSequentialFile(*result, this, ioClass);
+  }
+  return status;
+}
+
+
+leveldb::Status LevelIOEnv::NewRandomAccessFile(const std::string& fname,
+                                                leveldb::RandomAccessFile** result)
+{
+  int ioClass = LEVELDB_IOClass(fname);
+  leveldb::Status status = target()->NewRandomAccessFile(fname, result);
+
+  if( status.ok() ) {
+    Open(ioClass);
+    *result = new LevelIORandomAccessFile(*result, this, ioClass);
+  }
+  return status;
+}
+
+
+leveldb::Status LevelIOEnv::NewWritableFile(const std::string& fname,
+                                            leveldb::WritableFile** result)
+{
+  int ioClass = LEVELDB_IOClass(fname);
+  leveldb::Status status = target()->NewWritableFile(fname, result);
+
+  if( status.ok() ) {
+    Open(ioClass);
+    *result = new LevelIOWritableFile(*result, this, ioClass);
+  }
+  return status;
+}
+
+
+leveldb::Status LevelIOEnv::NewAppendableFile(const std::string& fname,
+                                              leveldb::WritableFile** result)
+{
+  int ioClass = LEVELDB_IOClass(fname);
+  leveldb::Status status = target()->NewAppendableFile(fname, result);
+
+  if( status.ok() ) {
+    Open(ioClass);
+    *result = new LevelIOWritableFile(*result, this, ioClass);
+  }
+  return status;
+}
+
+
+static Tcl_Obj *LEVELDB_IOStatsObj(const LevelIOStats *stats)
+{
+  Tcl_Obj *resultObj = Tcl_NewListObj(0, NULL);
+  int c;
+
+  for(c = 0; c < LEVEL_IO_CLASSES; c++) {
+    const LevelIOStats *ioStats = &stats[c];
+    Tcl_Obj *classObj = Tcl_NewListObj(0, NULL);
+
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewStringObj("opens", -1));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewWideIntObj(ioStats->opens));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewStringObj("seq_reads", -1));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewWideIntObj(ioStats->seq_reads));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewStringObj("seq_read_bytes", -1));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewWideIntObj(ioStats->seq_read_bytes));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewStringObj("random_reads", -1));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewWideIntObj(ioStats->random_reads));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewStringObj("random_read_bytes", -1));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewWideIntObj(ioStats->random_read_bytes));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewStringObj("writes", -1));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewWideIntObj(ioStats->writes));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewStringObj("write_bytes", -1));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewWideIntObj(ioStats->write_bytes));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewStringObj("syncs", -1));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewWideIntObj(ioStats->syncs.count));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewStringObj("sync_p50", -1));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewDoubleObj(LEVELDB_StatPercentile(&ioStats->syncs, 0.5)));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewStringObj("sync_p99", -1));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewDoubleObj(LEVELDB_StatPercentile(&ioStats->syncs, 0.99)));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewStringObj("sync_max", -1));
+    Tcl_ListObjAppendElement(NULL, classObj, Tcl_NewDoubleObj((double) ioStats->syncs.max_ns / 1000.0));
+
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj(LevelIOClassNames[c], -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, classObj);
+  }
+
+  return resultObj;
+}
+
+
+/*
+ * Per database handle data, the ClientData of a DB_HANDLE. Iterators
+ * and snapshots keep a reference, so the handle detaches from the
+ * shared database only after the last of them is closed.
+ */
+typedef struct LevelDBInfo {
+  leveldb::DB *db;
+  LevelSharedDB *shared;
+  LevelStats *stats;              /* NULL with LEVELDB_NO_STATS */
+  int refCount;
+  int busy;                       /* running foreach loops */
+  int binary;                     /* default -encoding is binary */
+  LevelHandle *handle;
+} LevelDBInfo;
+
+
+/*
+ * ClientData of IT_HANDLE, BAT_HANDLE and SNAPSHOT_HANDLE. The encoding
+ * is taken from the database (or the -encoding option) when the handle
+ * is created.
+ */
+typedef struct LevelItrInfo {
+  leveldb::Iterator *it;
+  int binary;
+  LevelDBInfo *dbInfo;
+  LevelHandle *handle;
+} LevelItrInfo;
+
+typedef struct LevelBatInfo {
+  leveldb::WriteBatch *batch;
+  int binary;
+  int count;                      /* puts and deletes in the batch */
+  LevelDBInfo *dbInfo;            /* bound by -autoflush, or NULL */
+  LevelStats *stats;              /* of the database that created it */
+  size_t autoflush;
+  int sync;
+  LevelHandle *handle;
+} LevelBatInfo;
+
+typedef struct LevelSstInfo {
+  const leveldb::Snapshot *shot;
+  LevelDBInfo *dbInfo;
+  LevelHandle *handle;
+} LevelSstInfo;
+
+
+static void LevelHandleFreeIntRep(Tcl_Obj *objPtr);
+static void LevelHandleDupIntRep(Tcl_Obj *srcPtr, Tcl_Obj *dupPtr);
+
+static const Tcl_ObjType levelHandleType = {
+  "leveldb-handle",
+  LevelHandleFreeIntRep,
+  LevelHandleDupIntRep,
+  NULL,
+  NULL
+};
+
+
+static void LEVELDB_ReleaseHandle(LevelHandle *handle)
+{
+  if(--handle->refCount == 0) {
+    ckfree(handle);
+  }
+}
+
+
+static void LevelHandleFreeIntRep(Tcl_Obj *objPtr)
+{
+  LEVELDB_ReleaseHandle((LevelHandle *) objPtr->internalRep.twoPtrValue.ptr1);
+  objPtr->typePtr = NULL;
+}
+
+
+static void LevelHandleDupIntRep(Tcl_Obj *srcPtr, Tcl_Obj *dupPtr)
+{
+  LevelHandle *handle = (LevelHandle *) srcPtr->internalRep.twoPtrValue.ptr1;
+
+  handle->refCount++;
+  dupPtr->internalRep.twoPtrValue.ptr1 = handle;
+  dupPtr->internalRep.twoPtrValue.ptr2 = NULL;
+  dupPtr->typePtr = &levelHandleType;
+}
+
+
+/*
+ * Create a handle command named prefix followed by a counter. Its name
+ * is returned in *nameObjPtr.
+ */
+static LevelHandle *LEVELDB_NewHandle(Tcl_Interp *interp, const char *prefix,
+                                      int kind, void *clientData,
+                                      Tcl_ObjCmdProc *proc,
+                                      Tcl_CmdDeleteProc *deleteProc,
+                                      Tcl_Obj **nameObjPtr)
+{
+  ThreadSpecificData *tsdPtr = LEVELDB_GetThreadData();
+  LevelHandle *handle;
+  char handleName[16 + TCL_INTEGER_SPACE];
+  int *counter;
+  int newvalue;
+
+  switch(kind) {
+    case LEVEL_HANDLE_DBI:   counter = &tsdPtr->dbi_count; break;
+    case LEVEL_HANDLE_ITR:   counter = &tsdPtr->itr_count; break;
+    case LEVEL_HANDLE_BAT:   counter = &tsdPtr->bat_count; break;
+    case LEVEL_HANDLE_SST:   counter = &tsdPtr->sst_count; break;
+    default:                 counter = &tsdPtr->cache_count; break;
+  }
+
+  handle = (LevelHandle *) ckalloc(sizeof(LevelHandle));
+  handle->clientData = clientData;
+  handle->kind = kind;
+  handle->refCount = 1;
+
+  Tcl_MutexLock(&myMutex);
+  sprintf( handleName, "%s%d", prefix, (*counter)++ );
+
+  *nameObjPtr = Tcl_NewStringObj( handleName, -1 );
+
+  handle->hashEntryPtr = Tcl_CreateHashEntry(tsdPtr->leveldb_hashtblPtr, handleName, &newvalue);
+  Tcl_SetHashValue(handle->hashEntryPtr, (ClientData)(uintptr_t) handle);
+  Tcl_MutexUnlock(&myMutex);
+
+  handle->token = Tcl_CreateObjCommand(interp, handleName, proc,
+      (ClientData) clientData, deleteProc);
+
+  return handle;
+}
+
+
+/*
+ * Called from the delete proc of a handle command: the handle name can
+ * no longer be resolved, and cached Tcl_Objs see a NULL clientData.
+ */
+static void LEVELDB_ForgetHandle(LevelHandle *handle)
+{
+  Tcl_MutexLock(&myMutex);
+  if( handle->hashEntryPtr )  Tcl_DeleteHashEntry(handle->hashEntryPtr);
+  Tcl_MutexUnlock(&myMutex);
+
+  handle->hashEntryPtr = NULL;
+  handle->clientData = NULL;
+  LEVELDB_ReleaseHandle(handle);
+}
+
+
+/*
+ * Resolve a handle passed as an argument. The result is cached in the
+ * Tcl_Obj, so passing the same value again needs no hash lookup.
+ */
+static void *LEVELDB_GetHandleFromObj(Tcl_Interp *interp, Tcl_Obj *objPtr, int kind)
+{
+  LevelHandle *handle = NULL;
+  Tcl_HashEntry *hashEntryPtr;
+  const char *name;
+
+  if(objPtr->typePtr == &levelHandleType) {
+    handle = (LevelHandle *) objPtr->internalRep.twoPtrValue.ptr1;
+    if(handle->clientData && handle->kind == kind) {
+      return handle->clientData;
+    }
+  }
+
+  name = Tcl_GetStringFromObj(objPtr, 0);
+  hashEntryPtr = Tcl_FindHashEntry( LEVELDB_GetThreadData()->leveldb_hashtblPtr, name );
+  if(hashEntryPtr) {
+    handle = (LevelHandle *)(uintptr_t)Tcl_GetHashValue( hashEntryPtr );
+  }
+
+  if( !hashEntryPtr || handle->kind != kind ) {
+    if( interp ) {
+        Tcl_Obj *resultObj = Tcl_GetObjResult( interp );
+
+        Tcl_AppendStringsToObj( resultObj, "invalid ", LevelHandleNames[kind],
+                                " handle ", name, (char *)NULL );
+    }
+
+    return NULL;
+  }
+
+  if(objPtr->typePtr && objPtr->typePtr->freeIntRepProc) {
+    objPtr->typePtr->freeIntRepProc(objPtr);
+  }
+
+  handle->refCount++;
+  objPtr->internalRep.twoPtrValue.ptr1 = handle;
+  objPtr->internalRep.twoPtrValue.ptr2 = NULL;
+  objPtr->typePtr = &levelHandleType;
+
+  return handle->clientData;
+}
+
+
+/*
+ * Values read with "-encoding string" of at least this size are returned
+ * as levelValueType objects: the internal representation takes over the
+ * std::string filled by leveldb, and the string representation is only
+ * built when a Tcl command asks for it. A value handed back to put is
+ * stored straight from the internal representation and never copied.
+ * Smaller values and byte arrays are copied into a Tcl_Obj at once.
+ */
+#define LEVELDB_VALUE_LAZY_SIZE 1024
+
+static void LevelValueFreeIntRep(Tcl_Obj *objPtr);
+static void LevelValueDupIntRep(Tcl_Obj *srcPtr, Tcl_Obj *dupPtr);
+static void LevelValueUpdateString(Tcl_Obj *objPtr);
+
+static const Tcl_ObjType levelValueType = {
+  "leveldb-value",
+  LevelValueFreeIntRep,
+  LevelValueDupIntRep,
+  LevelValueUpdateString,
+  NULL
+};
+
+
+static void LevelValueFreeIntRep(Tcl_Obj *objPtr)
+{
+  delete (std::string *) objPtr->internalRep.twoPtrValue.ptr1;
+  objPtr->typePtr = NULL;
+}
+
+
+static void LevelValueDupIntRep(Tcl_Obj *srcPtr, Tcl_Obj *dupPtr)
+{
+  std::string *value = (std::string *) srcPtr->internalRep.twoPtrValue.ptr1;
+
+  dupPtr->internalRep.twoPtrValue.ptr1 = new std::string(*value);
+  dupPtr->internalRep.twoPtrValue.ptr2 = NULL;
+  dupPtr->typePtr = &levelValueType;
+}
+
+
+static void LevelValueUpdateString(Tcl_Obj *objPtr)
+{
+  std::string *value = (std::string *) objPtr->internalRep.twoPtrValue.ptr1;
+
+  objPtr->bytes = (char *) ckalloc(value->size() + 1);
+  memcpy(objPtr->bytes, value->data(), value->size());
+  objPtr->bytes[value->size()] = '\0';
+  objPtr->length = (Tcl_Size) value->size();
+}
+
+
+/*
+ * Keys and values are Tcl strings by default, stored as the bytes of
+ * their string representation. With "-encoding binary" they are byte
+ * arrays instead: the stored bytes are exactly the bytes of the value,
+ * and no conversion to or from UTF-8 is done.
+ */
+static const char *LEVELDB_GetBytesFromObj(Tcl_Interp *interp, Tcl_Obj *objPtr,
+                                           Tcl_Size *len, int binary)
+{
+  const char *bytes;
+
+  if(!binary) {
+    if(objPtr->typePtr == &levelValueType) {
+      std::string *value = (std::string *) objPtr->internalRep.twoPtrValue.ptr1;
+
+      *len = (Tcl_Size) value->size();
+      return value->data();
+    }
+    return Tcl_GetStringFromObj(objPtr, len);
+  }
+
+  bytes = (const char *) Tcl_GetByteArrayFromObj(objPtr, len);
+  if(!bytes && interp) {
+    Tcl_AppendResult(interp, "Error: expected a byte sequence", (char*)0);
+  }
+
+  return bytes;
+}
+
+
+static Tcl_Obj *LEVELDB_NewBytesObj(const char *data, size_t len, int binary)
+{
+  if(binary) {
+    return Tcl_NewByteArrayObj((const unsigned char *) data, (Tcl_Size) len);
+  }
+
+  return Tcl_NewStringObj(data, (Tcl_Size) len);
+}
+
+
+/*
+ * Return a value read from the database. The contents of *value are
+ * moved into the new object when it is lazy, leaving *value empty.
+ */
+static Tcl_Obj *LEVELDB_NewValueObj(std::string *value, int binary)
+{
+  Tcl_Obj *objPtr;
+
+  if(binary || value->size() < LEVELDB_VALUE_LAZY_SIZE) {
+    return LEVELDB_NewBytesObj(value->data(), value->size(), binary);
+  }
+
+  objPtr = Tcl_NewObj();
+  Tcl_InvalidateStringRep(objPtr);
+  objPtr->internalRep.twoPtrValue.ptr1 = new std::string;
+  objPtr->internalRep.twoPtrValue.ptr2 = NULL;
+  objPtr->typePtr = &levelValueType;
+  ((std::string *) objPtr->internalRep.twoPtrValue.ptr1)->swap(*value);
+
+  return objPtr;
+}
+
+
+/*
+ * LEVELDB_NewValueObj for a value an iterator points to. Only a value
+ * that becomes lazy is copied into a std::string first.
+ */
+static Tcl_Obj *LEVELDB_NewSliceValueObj(const leveldb::Slice& value, int binary)
+{
+  std::string copy;
+
+  if(binary || value.size() < LEVELDB_VALUE_LAZY_SIZE) {
+    return LEVELDB_NewBytesObj(value.data(), value.size(), binary);
+  }
+
+  copy.assign(value.data(), value.size());
+  return LEVELDB_NewValueObj(&copy, binary);
+}
+
+
+static int LEVELDB_GetEncodingFromObj(Tcl_Interp *interp, Tcl_Obj *objPtr, int *binary)
+{
+  static const char *ENC_strs[] = {
+    "string",
+    "binary",
+    0
+  };
+  int index;
+
+  if( Tcl_GetIndexFromObj(interp, objPtr, ENC_strs, "encoding", 0, &index) ){
+    return TCL_ERROR;
+  }
+
+  *binary = index;
+  return TCL_OK;
+}
+
+
+/*
+ * Key order of a database, for commands that sort keys before reading
+ * them.
+ */
+typedef struct LevelKeyLess {
+  const leveldb::Comparator *comparator;
+
+  LevelKeyLess(const leveldb::Comparator *c) : comparator(c) {}
+
+  bool operator()(const leveldb::Slice& a, const leveldb::Slice& b) const {
+    return comparator->Compare(a, b) < 0;
+  }
+} LevelKeyLess;
+
+
+/*
+ * mget switches from point lookups to one seeking iterator at this
+ * number of keys.
+ */
+#define LEVELDB_MGET_SEEK_THRESHOLD 64
+
+
+/*
+ * A key range given by -start, -end, -prefix and -reverse. start is
+ * inclusive and end is exclusive in the order of the comparator; a
+ * prefix narrows the range further. Keys with a prefix are only
+ * adjacent with the bytewise comparator.
+ */
+typedef struct LevelRange {
+  Tcl_Obj *startObj;
+  Tcl_Obj *endObj;
+  Tcl_Obj *prefixObj;
+  std::string start;
+  std::string end;
+  std::string prefix;
+  bool has_start;
+  bool has_end;
+  bool reverse;
+  const leveldb::Comparator *comparator;
+
+  LevelRange() : startObj(NULL), endObj(NULL), prefixObj(NULL),
+                 has_start(false), has_end(false), reverse(false),
+                 comparator(leveldb::BytewiseComparator()) {}
+} LevelRange;
+
+
+/*
+ * Parse one range option. *handled is set to 1 if zArg is a range
+ * option. The key values are only remembered here and converted by
+ * LEVELDB_RangeSetup, once the -encoding of the command is known.
+ */
+static int LEVELDB_RangeOption(Tcl_Interp *interp, LevelRange *range,
+                               const char *zArg, Tcl_Obj *valueObj,
+                               int *handled)
+{
+  *handled = 1;
+
+  if( strcmp(zArg, "-start")==0 ){
+    range->startObj = valueObj;
+  } else if( strcmp(zArg, "-end")==0 ){
+    range->endObj = valueObj;
+  } else if( strcmp(zArg, "-prefix")==0 ){
+    range->prefixObj = valueObj;
+  } else if( strcmp(zArg, "-reverse")==0 ){
+    int b;
+
+    if( Tcl_GetBooleanFromObj(interp, valueObj, &b) ) {
+      return TCL_ERROR;
+    }
+
+    range->reverse = b ? true : false;
+  } else {
+    *handled = 0;
+  }
+
+  return TCL_OK;
+}
+
+
+static int LEVELDB_RangeSetup(Tcl_Interp *interp, LevelRange *range, int binary,
+                              const leveldb::Comparator *comparator)
+{
+  const char *value = NULL;
+  Tcl_Size len = 0;
+
+  range->comparator = comparator;
+
+  if(range->startObj) {
+    value = LEVELDB_GetBytesFromObj(interp, range->startObj, &len, binary);
+    if(!value) return TCL_ERROR;
+    range->start.assign(value, len);
+    range->has_start = true;
+  }
+
+  if(range->endObj) {
+    value = LEVELDB_GetBytesFromObj(interp, range->endObj, &len, binary);
+    if(!value) return TCL_ERROR;
+    range->end.assign(value, len);
+    range->has_end = true;
+  }
+
+  if(range->prefixObj) {
+    if(comparator != leveldb::BytewiseComparator()) {
+      Tcl_AppendResult(interp, "Error: -prefix needs the bytewise comparator ", (char*)0);
+      return TCL_ERROR;
+    }
+
+    value = LEVELDB_GetBytesFromObj(interp, range->prefixObj, &len, binary);
+    if(!value) return TCL_ERROR;
+    range->prefix.assign(value, len);
+  }
+
+  return TCL_OK;
+}
+
+
+/*
+ * Position the iterator at the first key of the range in scan order.
+ */
+static void LEVELDB_RangeSeek(leveldb::Iterator *it, const LevelRange *range)
+{
+  if(!range->reverse) {
+    if(range->has_start && range->start.compare(range->prefix) > 0) {
+      it->Seek(range->start);
+    } else if(!range->prefix.empty()) {
+      it->Seek(range->prefix);
+    } else {
+      it->SeekToFirst();
+    }
+
+    return;
+  }
+
+  /*
+   * The upper bound for a prefix is the prefix with its last byte below
+   * 0xff incremented. A prefix of only 0xff bytes has no upper bound.
+   */
+  std::string upper;
+  bool has_upper = false;
+
+  if(!range->prefix.empty()) {
+    upper = range->prefix;
+    while(!upper.empty() && (unsigned char) upper[upper.size() - 1] == 0xff) {
+      upper.resize(upper.size() - 1);
+    }
+
+    if(!upper.empty()) {
+      upper[upper.size() - 1]++;
+      has_upper = true;
+    }
+  }
+
+  if(range->has_end && (!has_upper || range->end.compare(upper) < 0)) {
+    upper = range->end;
+    has_upper = true;
+  }
+
+  if(has_upper) {
+    it->Seek(upper);
+    if(it->Valid()) {
+      it->Prev();
+    } else {
+      it->SeekToLast();
+    }
+  } else {
+    it->SeekToLast();
+  }
+}
+
+
+/*
+ * Check that the iterator is still inside the range.
+ */
+static int LEVELDB_RangeValid(leveldb::Iterator *it, const LevelRange *range)
+{
+  if(!it->Valid()) {
+    return 0;
+  }
+
+  leveldb::Slice key = it->key();
+
+  if(!range->prefix.empty() && !key.starts_with(range->prefix)) {
+    return 0;
+  }
+
+  if(range->has_start && range->comparator->Compare(key, range->start) < 0) {
+    return 0;
+  }
+
+  if(range->has_end && range->comparator->Compare(key, range->end) >= 0) {
+    return 0;
+  }
+
+  return 1;
+}
+
+
+static void LEVELDB_RangeStep(leveldb::Iterator *it, const LevelRange *range)
+{
+  if(range->reverse) {
+    it->Prev();
+  } else {
+    it->Next();
+  }
+}
+
+
+/*
+ * Add the key/value pairs of a dict (or a flat key/value list) to a
+ * WriteBatch. A dict is read through its own internal representation,
+ * anything else as a list, so neither is converted to the other type.
+ */
+static int LEVELDB_BatchPutPairs(Tcl_Interp *interp, leveldb::WriteBatch *batch,
+                                 Tcl_Obj *pairsObj, int binary)
+{
+  static const Tcl_ObjType *dictType = NULL;
+  const char *key = NULL;
+  const char *data = NULL;
+  Tcl_Size key_len = 0;
+  Tcl_Size data_len = 0;
+
+  if(!dictType) {
+    dictType = Tcl_GetObjType("dict");
+  }
+
+  if(dictType && pairsObj->typePtr == dictType) {
+    Tcl_DictSearch search;
+    Tcl_Obj *keyObj, *valueObj;
+    int done;
+
+    if( Tcl_DictObjFirst(interp, pairsObj, &search, &keyObj, &valueObj, &done) != TCL_OK ) {
+      return TCL_ERROR;
+    }
+
+    for(; !done; Tcl_DictObjNext(&search, &keyObj, &valueObj, &done)) {
+      key = LEVELDB_GetBytesFromObj(interp, keyObj, &key_len, binary);
+      data = key ? LEVELDB_GetBytesFromObj(interp, valueObj, &data_len, binary) : NULL;
+      if( !key || !data ){
+        Tcl_DictObjDone(&search);
+        return TCL_ERROR;
+      }
+      if( key_len < 1 || data_len < 1 ){
+        Tcl_DictObjDone(&search);
+        Tcl_AppendResult(interp, "Error: key or data is empty ", (char*)0);
+        return TCL_ERROR;
+      }
+
+      batch->Put(leveldb::Slice(key, key_len), leveldb::Slice(data, data_len));
+    }
+
+    return TCL_OK;
+  }
+
+  Tcl_Obj **elemObjs = NULL;
+  Tcl_Size elem_count = 0;
+
+  if( Tcl_ListObjGetElements(interp, pairsObj, &elem_count, &elemObjs) != TCL_OK ) {
+    return TCL_ERROR;
+  }
+
+  if( elem_count & 1 ) {
+    Tcl_AppendResult(interp, "missing value to go with key", (char*)0);
+    return TCL_ERROR;
+  }
+
+  for(Tcl_Size i = 0; i < elem_count; i += 2) {
+    key = LEVELDB_GetBytesFromObj(interp, elemObjs[i], &key_len, binary);
+    data = key ? LEVELDB_GetBytesFromObj(interp, elemObjs[i+1], &data_len, binary) : NULL;
+    if( !key || !data ){
+      return TCL_ERROR;
+    }
+    if( key_len < 1 || data_len < 1 ){
+      Tcl_AppendResult(interp, "Error: key or data is empty ", (char*)0);
+      return TCL_ERROR;
+    }
+
+    batch->Put(leveldb::Slice(key, key_len), leveldb::Slice(data, data_len));
+  }
+
+  return TCL_OK;
+}
+
+
+static void LEVELDB_ReleaseCache(LevelCacheInfo *cacheInfo)
+{
+  int refCount;
+
+  if(!cacheInfo) {
+    return;
+  }
+
+  Tcl_MutexLock(&myMutex);
+  refCount = --cacheInfo->refCount;
+  Tcl_MutexUnlock(&myMutex);
+
+  if(refCount == 0) {
+    delete cacheInfo->cache;
+    delete cacheInfo;
+  }
+}
+
+
+/*
+ * Detach from a shared database. The leveldb::DB is deleted by the last
+ * handle, while registryMutex is held, so that a concurrent open of the
+ * same path does not fail on the LOCK file.
+ */
+static void LEVELDB_DetachDB(LevelSharedDB *shared)
+{
+  Tcl_MutexLock(&registryMutex);
+  if(--shared->refCount == 0) {
+    levelSharedDBs.erase(shared->path);
+
+    delete shared->db;
+    delete shared->io_env;
+    delete shared->filter_policy;
+    LEVELDB_ReleaseCache(shared->cache_info);
+    Tcl_ConditionFinalize(&shared->commitCond);
+    Tcl_ConditionFinalize(&shared->windowCond);
+    Tcl_MutexFinalize(&shared->commitMutex);
+    delete shared;
+  }
+  Tcl_MutexUnlock(&registryMutex);
+}
+
+
+/*
+ * Drop a reference to a database handle. The handle detaches from the
+ * shared database when the handle command and all iterators and
+ * snapshots taken from it are gone.
+ */
+static void LEVELDB_ReleaseDB(LevelDBInfo *dbInfo)
+{
+  if(--dbInfo->refCount > 0) {
+    return;
+  }
+
+  LEVELDB_DetachDB(dbInfo->shared);
+  LEVELDB_ReleaseStats(dbInfo->stats);
+  delete dbInfo;
+}
+
+
+/*
+ * Group commit: with -group_commit_window_us, a synced write waits for
+ * the window to collect synced writes from other threads (or -async
+ * workers), then one of them writes all batches with one synced
+ * DB::Write. Every writer returns after the group is durable, with the
+ * status of that write. Writes without sync are not delayed.
+ */
+struct LevelCommitWriter {
+  leveldb::WriteBatch *batch;
+  leveldb::Status status;
+  int done;
+  int lead;                       /* leads the next group */
+};
+
+static leveldb::Status LEVELDB_Write(LevelSharedDB *shared,
+                                     const leveldb::WriteOptions& options,
+                                     leveldb::WriteBatch *batch)
+{
+  LevelCommitWriter self;
+  std::vector<LevelCommitWriter *> group;
+  leveldb::WriteBatch merged;
+  leveldb::WriteBatch *toWrite;
+  leveldb::Status status;
+  Tcl_Time window;
+  size_t i;
+
+  if( !options.sync || shared->group_commit_us <= 0 ) {
+    return shared->db->Write(options, batch);
+  }
+
+  self.batch = batch;
+  self.done = 0;
+  self.lead = 0;
+
+  Tcl_MutexLock(&shared->commitMutex);
+  shared->pending.push_back(&self);
+
+  if( shared->leader ) {
+    while( !self.done && !self.lead ) {
+      Tcl_ConditionWait(&shared->commitCond, &shared->commitMutex, NULL);
+    }
+
+    if( self.done ) {
+      Tcl_MutexUnlock(&shared->commitMutex);
+      return self.status;
+    }
+  }
+  shared->leader = 1;
+
+  window.sec = shared->group_commit_us / 1000000;
+  window.usec = shared->group_commit_us % 1000000;
+  Tcl_ConditionWait(&shared->windowCond, &shared->commitMutex, &window);
+
+  group.swap(shared->pending);
+  Tcl_MutexUnlock(&shared->commitMutex);
+
+  if( group.size() == 1 ) {
+    toWrite = batch;
+  } else {
+    for(i = 0; i < group.size(); i++) {
+      merged.Append(*group[i]->batch);
+    }
+    toWrite = &merged;
+  }
+  status = shared->db->Write(options, toWrite);
+
+  Tcl_MutexLock(&shared->commitMutex);
+  for(i = 0; i < group.size(); i++) {
+    group[i]->status = status;
+    group[i]->done = 1;
+  }
+
+  /*
+   * Writers that arrived while this group was written wait for a
+   * leader; hand over to the first of them.
+   */
+  if( shared->pending.empty() ) {
+    shared->leader = 0;
+  } else {
+    shared->pending[0]->lead = 1;
+  }
+  Tcl_ConditionNotify(&shared->commitCond);
+  Tcl_MutexUnlock(&shared->commitMutex);
+
+  return status;
+}
+
+
+/*
+ * Write a batch created with -autoflush to its database and clear it,
+ * once its size reaches the threshold.
+ */
+static int LEVELDB_BatchAutoflush(Tcl_Interp *interp, LevelBatInfo *batInfo)
+{
+  leveldb::WriteOptions write_options;
+  leveldb::Status status;
+
+  if( !batInfo->dbInfo || batInfo->batch->ApproximateSize() < batInfo->autoflush ) {
+    return TCL_OK;
+  }
+
+  write_options.sync = batInfo->sync ? true : false;
+  status = LEVELDB_Write(batInfo->dbInfo->shared, write_options, batInfo->batch);
+  if(!status.ok()) {
+    Tcl_AppendResult(interp, "Error: write failed", (char*)0);
+    return TCL_ERROR;
+  }
+
+  batInfo->batch->Clear();
+  batInfo->count = 0;
+
+  return TCL_OK;
+}
+
+
+/*
+ * Resolve a -snapshot value and check that it was taken from dbInfo.
+ */
+static const leveldb::Snapshot *LEVELDB_GetSnapshotFromObj(Tcl_Interp *interp,
+                                                           Tcl_Obj *objPtr,
+                                                           LevelDBInfo *dbInfo)
+{
+  LevelSstInfo *sstInfo;
+
+  sstInfo = (LevelSstInfo *) LEVELDB_GetHandleFromObj(interp, objPtr, LEVEL_HANDLE_SST);
+  if( !sstInfo ) {
+    return NULL;
+  }
+
+  if( sstInfo->dbInfo != dbInfo ) {
+    Tcl_AppendResult(interp, "Error: snapshot does not belong to this db", (char*)0);
+    return NULL;
+  }
+
+  return sstInfo->shot;
+}
+
+
+/*
+ * Delete procs of the handle commands. They run for "HANDLE close" as
+ * well as for "rename HANDLE {}" and interpreter deletion.
+ */
+static void LEVELDB_DBI_Delete(ClientData cd)
+{
+  LevelDBInfo *dbInfo = (LevelDBInfo *) cd;
+
+  LEVELDB_ForgetHandle(dbInfo->handle);
+  LEVELDB_ReleaseDB(dbInfo);
+}
+
+
+static void LEVELDB_ITR_Delete(ClientData cd)
+{
+  LevelItrInfo *itInfo = (LevelItrInfo *) cd;
+
+  delete itInfo->it;
+  LEVELDB_ForgetHandle(itInfo->handle);
+  LEVELDB_ReleaseDB(itInfo->dbInfo);
+  delete itInfo;
+}
+
+
+static void LEVELDB_SST_Delete(ClientData cd)
+{
+  LevelSstInfo *sstInfo = (LevelSstInfo *) cd;
+
+  sstInfo->dbInfo->db->ReleaseSnapshot(sstInfo->shot);
+  LEVELDB_ForgetHandle(sstInfo->handle);
+  LEVELDB_ReleaseDB(sstInfo->dbInfo);
+  delete sstInfo;
+}
+
+
+static void LEVELDB_BAT_Delete(ClientData cd)
+{
+  LevelBatInfo *batInfo = (LevelBatInfo *) cd;
+
+  delete batInfo->batch;
+  LEVELDB_ForgetHandle(batInfo->handle);
+  if( batInfo->dbInfo ) {
+    LEVELDB_ReleaseDB(batInfo->dbInfo);
+  }
+  LEVELDB_ReleaseStats(batInfo->stats);
+  delete batInfo;
+}
+
+
+static void LEVELDB_CACHE_Delete(ClientData cd)
+{
+  LevelCacheInfo *cacheInfo = (LevelCacheInfo *) cd;
+
+  LEVELDB_ForgetHandle(cacheInfo->handle);
+  LEVELDB_ReleaseCache(cacheInfo);
+}
+
+
+/*
+ * Compact the key range [start, end] (NULL for the first or last key)
+ * and return the number of files at each level after the compaction,
+ * as the string representation of a dict {level0 N level1 N ...}. It is
+ * a plain string so that a worker thread can build it.
+ */
+static std::string LEVELDB_CompactRange(leveldb::DB *db, const std::string *start,
+                                        const std::string *end)
+{
+  leveldb::Slice start2;
+  leveldb::Slice end2;
+  std::string files;
+  std::string result;
+  char name[32 + TCL_INTEGER_SPACE];
+  int level;
+
+  if( start ) start2 = *start;
+  if( end ) end2 = *end;
+  db->CompactRange(start ? &start2 : NULL, end ? &end2 : NULL);
+
+  for(level = 0; ; level++) {
+    sprintf(name, "leveldb.num-files-at-level%d", level);
+    if( !db->GetProperty(name, &files) ) {
+      break;
+    }
+
+    if( level > 0 ) result += ' ';
+    sprintf(name, "level%d ", level);
+    result += name;
+    result += files;
+  }
+
+  return result;
+}
+
+
+/*
+ * Split points for "DB_HANDLE splits". A key is mapped to a number from
+ * the 8 bytes that follow the common prefix of the range ends, so the
+ * key space between them can be bisected. DB::GetApproximateSizes looks
+ * the keys up in the index blocks of the tables, so each step costs a
+ * few index lookups and no data block reads.
+ */
+static uint64_t LEVELDB_KeyToNumber(const std::string& key, size_t prefix_len)
+{
+  uint64_t number = 0;
+  size_t i;
+
+  for(i = 0; i < 8; i++) {
+    number <<= 8;
+    if( prefix_len + i < key.size() ) {
+      number |= (unsigned char) key[prefix_len + i];
+    }
+  }
+
+  return number;
+}
+
+
+static std::string LEVELDB_NumberToKey(const std::string& prefix, uint64_t number)
+{
+  std::string key = prefix;
+  int i;
+
+  for(i = 7; i >= 0; i--) {
+    key += (char) ((number >> (i * 8)) & 0xff);
+  }
+
+  return key;
+}
+
+
+static uint64_t LEVELDB_RangeBytes(leveldb::DB *db, const std::string& start,
+                                   const std::string& limit)
+{
+  leveldb::Range range(start, limit);
+  uint64_t size = 0;
+
+  db->GetApproximateSizes(&range, 1, &size);
+  return size;
+}
+
+
+/*
+ * Append to keys at most parts - 1 existing keys of [start, end) that
+ * divide it into parts of about the same size in bytes. Keys are found
+ * by bisection over approximate sizes. If the key order is not
+ * bytewise, keys cannot be bisected; the range is walked once and the
+ * approximate size is checked every LEVELDB_SPLIT_STRIDE keys. Data
+ * still in the memtable has no approximate size; if the whole range is
+ * there, it is walked twice, to sum the bytes and to place the keys.
+ */
+#define LEVELDB_SPLIT_STRIDE 4096
+
+static void LEVELDB_SplitKeys(leveldb::DB *db, const LevelRange *range, int parts,
+                              std::vector<std::string> *keys)
+{
+  leveldb::ReadOptions read_options;
+  leveldb::Iterator *it;
+  std::string first;
+  std::string last;
+  std::string prefix;
+  uint64_t total;
+  size_t prefix_len = 0;
+  int i;
+
+  read_options.fill_cache = false;
+  it = db->NewIterator(read_options);
+
+  if( range->has_start ) {
+    it->Seek(range->start);
+  } else {
+    it->SeekToFirst();
+  }
+  if( !it->Valid() ||
+      (range->has_end && range->comparator->Compare(it->key(), range->end) >= 0) ) {
+    delete it;
+    return;
+  }
+  first = it->key().ToString();
+
+  if( range->has_end ) {
+    last = range->end;
+  } else {
+    it->SeekToLast();
+    last = it->key().ToString();
+  }
+
+  total = LEVELDB_RangeBytes(db, first, last);
+
+  if( total > 0 && range->comparator != leveldb::BytewiseComparator() ) {
+    uint64_t count = 0;
+
+    i = 1;
+    for(it->Seek(first);
+        it->Valid() && (!range->has_end || range->comparator->Compare(it->key(), range->end) < 0);
+        it->Next()) {
+      uint64_t bytes;
+
+      if( ++count % LEVELDB_SPLIT_STRIDE != 0 ) {
+        continue;
+      }
+
+      bytes = LEVELDB_RangeBytes(db, first, it->key().ToString());
+      if( bytes * parts >= total * i ) {
+        keys->push_back(it->key().ToString());
+        while( i < parts && bytes * parts >= total * i ) i++;
+        if( i >= parts ) break;
+      }
+    }
+
+    delete it;
+    return;
+  }
+
+  if( total == 0 ) {
+    uint64_t bytes = 0;
+    uint64_t sum = 0;
+
+    for(it->Seek(first);
+        it->Valid() && (!range->has_end || range->comparator->Compare(it->key(), range->end) < 0);
+        it->Next()) {
+      bytes += it->key().size() + it->value().size();
+    }
+
+    i = 1;
+    for(it->Seek(first);
+        it->Valid() && (!range->has_end || range->comparator->Compare(it->key(), range->end) < 0);
+        it->Next()) {
+      if( sum * parts >= bytes * i && sum > 0 ) {
+        keys->push_back(it->key().ToString());
+        while( i < parts && sum * parts >= bytes * i ) i++;
+        if( i >= parts ) break;
+      }
+      sum += it->key().size() + it->value().size();
+    }
+
+    delete it;
+    return;
+  }
+
+  while( prefix_len < first.size() && prefix_len < last.size() &&
+         first[prefix_len] == last[prefix_len] ) {
+    prefix_len++;
+  }
+  prefix = first.substr(0, prefix_len);
+
+  for(i = 1; i < parts; i++) {
+    uint64_t target = total / parts * i + total % parts * i / parts;
+    uint64_t low = LEVELDB_KeyToNumber(first, prefix_len);
+    uint64_t high = LEVELDB_KeyToNumber(last, prefix_len);
+    std::string key;
+
+    /*
+     * Find the smallest key with at least target bytes before it, and
+     * round it up to the next existing key.
+     */
+    while( low < high ) {
+      uint64_t mid = low + (high - low) / 2;
+
+      if( LEVELDB_RangeBytes(db, first, LEVELDB_NumberToKey(prefix, mid)) >= target ) {
+        high = mid;
+      } else {
+        low = mid + 1;
+      }
+    }
+
+    it->Seek(LEVELDB_NumberToKey(prefix, low));
+    if( !it->Valid() || it->key().compare(last) >= 0 ) {
+      break;
+    }
+
+    key = it->key().ToString();
+    if( key.compare(first) <= 0 || (!keys->empty() && key.compare(keys->back()) <= 0) ) {
+      continue;
+    }
+
+    keys->push_back(key);
+  }
+
+  delete it;
+}
+
+
+/*
+ * Parsed properties for "DB_HANDLE properties". leveldb.stats has one
+ * line per level with files or compactions, sizes rounded to MB, so the
+ * exact level size is summed from leveldb.sstables, which lists each
+ * table as " NUMBER:SIZE['SMALLEST' @ SEQ : TYPE .. 'LARGEST' @ SEQ : TYPE]".
+ * The keys are escaped as \xHH for bytes outside of ' '..'~'.
+ */
+typedef struct LevelLevelProps {
+  Tcl_WideInt files;
+  Tcl_WideInt size;               /* bytes, from leveldb.sstables */
+  Tcl_WideInt size_mb;            /* from leveldb.stats */
+  Tcl_WideInt time_sec;
+  Tcl_WideInt read_mb;
+  Tcl_WideInt write_mb;
+} LevelLevelProps;
+
+static int LEVELDB_HexDigit(char c)
+{
+  if( c >= '0' && c <= '9' ) return c - '0';
+  if( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+  if( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+  return -1;
+}
+
+
+/*
+ * Skip a decimal number at pos, returning false if there is none.
+ */
+static bool LEVELDB_SkipDigits(const std::string& s, size_t *pos)
+{
+  size_t start = *pos;
+
+  while( *pos < s.size() && s[*pos] >= '0' && s[*pos] <= '9' ) {
+    (*pos)++;
+  }
+
+  return *pos > start;
+}
+
+
+/*
+ * Parse "'KEY' @ SEQ : TYPE" at pos, followed by the string tail. The
+ * key may itself contain "' @ ", so each candidate end is checked until
+ * the rest of the entry matches.
+ */
+static bool LEVELDB_ParseDebugKey(const std::string& s, size_t *pos,
+                                  const char *tail, std::string *key)
+{
+  size_t quote;
+  size_t i;
+
+  if( *pos >= s.size() || s[*pos] != '\'' ) {
+    return false;
+  }
+
+  for(quote = s.find("' @ ", *pos + 1); quote != std::string::npos;
+      quote = s.find("' @ ", quote + 1)) {
+    size_t p = quote + 4;
+
+    if( !LEVELDB_SkipDigits(s, &p) || s.compare(p, 3, " : ") != 0 ) {
+      continue;
+    }
+    p += 3;
+    if( !LEVELDB_SkipDigits(s, &p) || s.compare(p, strlen(tail), tail) != 0 ) {
+      continue;
+    }
+
+    key->clear();
+    for(i = *pos + 1; i < quote; i++) {
+      if( s[i] == '\\' && i + 3 < quote && s[i + 1] == 'x' &&
+          LEVELDB_HexDigit(s[i + 2]) >= 0 && LEVELDB_HexDigit(s[i + 3]) >= 0 ) {
+        key->push_back((char) (LEVELDB_HexDigit(s[i + 2]) * 16 + LEVELDB_HexDigit(s[i + 3])));
+        i += 3;
+      } else {
+        key->push_back(s[i]);
+      }
+    }
+
+    *pos = p + strlen(tail);
+    return true;
+  }
+
+  return false;
+}
+
+
+static Tcl_Obj *LEVELDB_PropertiesObj(leveldb::DB *db, int binary)
+{
+  std::vector<LevelLevelProps> levels;
+  Tcl_Obj *resultObj = Tcl_NewListObj(0, NULL);
+  Tcl_Obj *sstObj = Tcl_NewListObj(0, NULL);
+  std::string text;
+  std::string line;
+  char name[32 + TCL_INTEGER_SPACE];
+  size_t start;
+  size_t end;
+  int level;
+
+  for(level = 0; ; level++) {
+    LevelLevelProps props;
+
+    sprintf(name, "leveldb.num-files-at-level%d", level);
+    if( !db->GetProperty(name, &text) ) {
+      break;
+    }
+
+    memset(&props, 0, sizeof(props));
+    props.files = strtoll(text.c_str(), NULL, 10);
+    levels.push_back(props);
+  }
+
+  if( db->GetProperty("leveldb.stats", &text) ) {
+    for(start = 0; start < text.size(); start = end + 1) {
+      int files;
+      double size_mb, time_sec, read_mb, write_mb;
+
+      end = text.find('\n', start);
+      if( end == std::string::npos ) end = text.size();
+      line = text.substr(start, end - start);
+
+      if( sscanf(line.c_str(), "%d %d %lf %lf %lf %lf", &level, &files,
+                 &size_mb, &time_sec, &read_mb, &write_mb) != 6 ||
+          level < 0 || level >= (int) levels.size() ) {
+        continue;
+      }
+
+      levels[level].files = files;
+      levels[level].size_mb = (Tcl_WideInt) size_mb;
+      levels[level].time_sec = (Tcl_WideInt) time_sec;
+      levels[level].read_mb = (Tcl_WideInt) read_mb;
+      levels[level].write_mb = (Tcl_WideInt) write_mb;
+    }
+  }
+
+  if( db->GetProperty("leveldb.sstables", &text) ) {
+    level = -1;
+    for(start = 0; start < text.size(); start = end + 1) {
+      std::string smallest;
+      std::string largest;
+      unsigned long long number;
+      unsigned long long size;
+      size_t pos;
+      Tcl_Obj *tableObj;
+
+      end = text.find('\n', start);
+      if( end == std::string::npos ) end = text.size();
+      line = text.substr(start, end - start);
+
+      if( sscanf(line.c_str(), "--- level %d ---", &level) == 1 ) {
+        continue;
+      }
+
+      pos = line.find('[');
+      if( level < 0 || level >= (int) levels.size() || pos == std::string::npos ||
+          sscanf(line.c_str(), " %llu:%llu[", &number, &size) != 2 ) {
+        continue;
+      }
+
+      pos++;
+      if( !LEVELDB_ParseDebugKey(line, &pos, " .. ", &smallest) ||
+          !LEVELDB_ParseDebugKey(line, &pos, "]", &largest) ) {
+        continue;
+      }
+
+      levels[level].size += (Tcl_WideInt) size;
+
+      tableObj = Tcl_NewListObj(0, NULL);
+      Tcl_ListObjAppendElement(NULL, tableObj, Tcl_NewStringObj("level", -1));
+      Tcl_ListObjAppendElement(NULL, tableObj, Tcl_NewIntObj(level));
+      Tcl_ListObjAppendElement(NULL, tableObj, Tcl_NewStringObj("file", -1));
+      Tcl_ListObjAppendElement(NULL, tableObj, Tcl_NewWideIntObj((Tcl_WideInt) number));
+      Tcl_ListObjAppendElement(NULL, tableObj, Tcl_NewStringObj("size", -1));
+      Tcl_ListObjAppendElement(NULL, tableObj, Tcl_NewWideIntObj((Tcl_WideInt) size));
+      Tcl_ListObjAppendElement(NULL, tableObj, Tcl_NewStringObj("smallest", -1));
+      Tcl_ListObjAppendElement(NULL, tableObj,
+                               LEVELDB_NewBytesObj(smallest.data(), smallest.size(), binary));
+      Tcl_ListObjAppendElement(NULL, tableObj, Tcl_NewStringObj("largest", -1));
+      Tcl_ListObjAppendElement(NULL, tableObj,
+                               LEVELDB_NewBytesObj(largest.data(), largest.size(), binary));
+      Tcl_ListObjAppendElement(NULL, sstObj, tableObj);
+    }
+  }
+
+  for(level = 0; level < (int) levels.size(); level++) {
+    const LevelLevelProps *props = &levels[level];
+    Tcl_Obj *levelObj = Tcl_NewListObj(0, NULL);
+
+    Tcl_ListObjAppendElement(NULL, levelObj, Tcl_NewStringObj("files", -1));
+    Tcl_ListObjAppendElement(NULL, levelObj, Tcl_NewWideIntObj(props->files));
+    Tcl_ListObjAppendElement(NULL, levelObj, Tcl_NewStringObj("size", -1));
+    Tcl_ListObjAppendElement(NULL, levelObj,
+        Tcl_NewWideIntObj(props->size ? props->size : props->size_mb * 1048576));
+    Tcl_ListObjAppendElement(NULL, levelObj, Tcl_NewStringObj("time_sec", -1));
+    Tcl_ListObjAppendElement(NULL, levelObj, Tcl_NewWideIntObj(props->time_sec));
+    Tcl_ListObjAppendElement(NULL, levelObj, Tcl_NewStringObj("read_mb", -1));
+    Tcl_ListObjAppendElement(NULL, levelObj, Tcl_NewWideIntObj(props->read_mb));
+    Tcl_ListObjAppendElement(NULL, levelObj, Tcl_NewStringObj("write_mb", -1));
+    Tcl_ListObjAppendElement(NULL, levelObj, Tcl_NewWideIntObj(props->write_mb));
+
+    sprintf(name, "level%d", level);
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj(name, -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, levelObj);
+  }
+
+  Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("memory_usage", -1));
+  if( db->GetProperty("leveldb.approximate-memory-usage", &text) ) {
+    Tcl_ListObjAppendElement(NULL, resultObj,
+                             Tcl_NewWideIntObj((Tcl_WideInt) strtoll(text.c_str(), NULL, 10)));
+  } else {
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(0));
+  }
+
+  Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("sstables", -1));
+  Tcl_ListObjAppendElement(NULL, resultObj, sstObj);
+
+  return resultObj;
+}
+
+
+/*
+ * -async requests. A job is run by one of at most LEVELDB_ASYNC_THREADS
+ * worker threads, shared by all interpreters of the process. The result
+ * is queued back to the thread of the interpreter as a Tcl event, which
+ * calls the callback with two more arguments: the status ("ok",
+ * "notfound" or "error") and the value of get, or the error message.
+ *
+ * The job holds a reference to the database handle, so the leveldb::DB
+ * stays open until the callback has run.
+ */
+#define LEVELDB_ASYNC_THREADS 4
+
+enum LevelAsyncOp {
+  LEVEL_ASYNC_GET,
+  LEVEL_ASYNC_PUT,
+  LEVEL_ASYNC_DELETE,
+  LEVEL_ASYNC_WRITE,
+  LEVEL_ASYNC_COMPACT,
+};
+
+typedef struct LevelAsyncJob {
+  int op;                         /* enum LevelAsyncOp */
+  LevelDBInfo *dbInfo;
+  leveldb::ReadOptions read_options;
+  leveldb::WriteOptions write_options;
+  std::string key;               /* key, or start of the range */
+  std::string value;              /* data to put, or the value read */
+  std::string end;
+  int has_key;
+  int has_end;
+  Tcl_WideInt elapsed_ns;         /* time taken by the worker */
+  Tcl_WideInt nbytes;
+  leveldb::WriteBatch batch;
+  leveldb::Status status;
+  int binary;
+  Tcl_Interp *interp;
+  Tcl_Obj *callback;
+  Tcl_ThreadId owner;
+} LevelAsyncJob;
+
+typedef struct LevelAsyncEvent {
+  Tcl_Event header;
+  LevelAsyncJob *job;
+} LevelAsyncEvent;
+
+TCL_DECLARE_MUTEX(asyncMutex);
+static Tcl_Condition asyncCond;
+static std::deque<LevelAsyncJob *> asyncQueue;
+static int asyncThreads = 0;      /* worker threads started */
+static int asyncIdle = 0;         /* workers waiting for a job */
+
+
+static int LEVELDB_AsyncEventProc(Tcl_Event *evPtr, int flags)
+{
+  LevelAsyncJob *job = ((LevelAsyncEvent *) evPtr)->job;
+  Tcl_Interp *interp = job->interp;
+  const char *status;
+  Tcl_Obj *cmdObj;
+  int result;
+
+  if( !Tcl_InterpDeleted(interp) ) {
+    cmdObj = Tcl_DuplicateObj(job->callback);
+    Tcl_IncrRefCount(cmdObj);
+
+    if( job->status.ok() ) {
+      status = "ok";
+    } else if( job->status.IsNotFound() ) {
+      status = "notfound";
+    } else {
+      status = "error";
+    }
+    Tcl_ListObjAppendElement(NULL, cmdObj, Tcl_NewStringObj(status, -1));
+
+    if( job->status.ok() ) {
+      Tcl_ListObjAppendElement(NULL, cmdObj,
+          LEVELDB_NewValueObj(&job->value, job->binary));
+    } else {
+      Tcl_ListObjAppendElement(NULL, cmdObj,
+          Tcl_NewStringObj(job->status.ToString().c_str(), -1));
+    }
+
+    result = Tcl_EvalObjEx(interp, cmdObj, TCL_EVAL_GLOBAL);
+    if( result != TCL_OK ) {
+      Tcl_BackgroundException(interp, result);
+    }
+
+    Tcl_DecrRefCount(cmdObj);
+  }
+
+  /*
+   * The statistics belong to the thread of the handle, so the time
+   * measured by the worker is recorded here.
+   */
+  if( job->op != LEVEL_ASYNC_COMPACT && job->status.ok() ) {
+    static const int statOps[] = {
+      LEVEL_STAT_GET, LEVEL_STAT_PUT, LEVEL_STAT_DELETE, LEVEL_STAT_WRITE
+    };
+
+    LEVELDB_StatRecord(job->dbInfo->stats, statOps[job->op], job->elapsed_ns, job->nbytes);
+  }
+
+  Tcl_Release(interp);
+  Tcl_DecrRefCount(job->callback);
+  LEVELDB_ReleaseDB(job->dbInfo);
+  delete job;
+
+  return 1;
+}
+
+
+static Tcl_ThreadCreateType LEVELDB_AsyncWorker(ClientData cd)
+{
+  LevelAsyncJob *job;
+  LevelAsyncEvent *evPtr;
+  leveldb::DB *db;
+  LevelSharedDB *shared;
+
+  for(;;) {
+    Tcl_MutexLock(&asyncMutex);
+    asyncIdle++;
+    while( asyncQueue.empty() ) {
+      Tcl_ConditionWait(&asyncCond, &asyncMutex, NULL);
+    }
+    asyncIdle--;
+    job = asyncQueue.front();
+    asyncQueue.pop_front();
+    Tcl_MutexUnlock(&asyncMutex);
+
+    db = job->dbInfo->db;
+    shared = job->dbInfo->shared;
+    LEVELDB_STAT_BEGIN(t0);
+    switch( job->op ) {
+      case LEVEL_ASYNC_GET:
+        job->status = db->Get(job->read_options, job->key, &job->value);
+        job->nbytes = job->key.size() + job->value.size();
+        break;
+      case LEVEL_ASYNC_PUT:
+        job->nbytes = job->key.size() + job->value.size();
+        job->batch.Put(job->key, job->value);
+        job->status = LEVELDB_Write(shared, job->write_options, &job->batch);
+        job->value.clear();
+        break;
+      case LEVEL_ASYNC_DELETE:
+        job->nbytes = job->key.size();
+        job->batch.Delete(job->key);
+        job->status = LEVELDB_Write(shared, job->write_options, &job->batch);
+        break;
+      case LEVEL_ASYNC_WRITE:
+        job->nbytes = job->batch.ApproximateSize();
+        job->status = LEVELDB_Write(shared, job->write_options, &job->batch);
+        break;
+      case LEVEL_ASYNC_COMPACT:
+        job->value = LEVELDB_CompactRange(db, job->has_key ? &job->key : NULL,
+                                          job->has_end ? &job->end : NULL);
+        break;
+    }
+#ifndef LEVELDB_NO_STATS
+    job->elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - t0).count();
+#endif
+
+    evPtr = (LevelAsyncEvent *) ckalloc(sizeof(LevelAsyncEvent));
+    evPtr->header.proc = LEVELDB_AsyncEventProc;
+    evPtr->job = job;
+    Tcl_ThreadQueueEvent(job->owner, (Tcl_Event *) evPtr, TCL_QUEUE_TAIL);
+    Tcl_ThreadAlert(job->owner);
+  }
+
+  TCL_THREAD_CREATE_RETURN;
+}
+
+
+/*
+ * Queue a job filled in by the caller. A worker is started if none is
+ * idle and the pool is not full.
+ */
+static int LEVELDB_AsyncSubmit(Tcl_Interp *interp, LevelDBInfo *dbInfo,
+                               LevelAsyncJob *job, Tcl_Obj *callback)
+{
+  Tcl_ThreadId id;
+
+  Tcl_MutexLock(&asyncMutex);
+  if( asyncIdle == 0 && asyncThreads < LEVELDB_ASYNC_THREADS ) {
+    if( Tcl_CreateThread(&id, LEVELDB_AsyncWorker, NULL,
+                         TCL_THREAD_STACK_DEFAULT, TCL_THREAD_NOFLAGS) == TCL_OK ) {
+      asyncThreads++;
+    } else if( asyncThreads == 0 ) {
+      Tcl_MutexUnlock(&asyncMutex);
+      delete job;
+
+      Tcl_AppendResult(interp, "Error: cannot create worker thread", (char*)0);
+      return TCL_ERROR;
+    }
+  }
+
+  job->dbInfo = dbInfo;
+  dbInfo->refCount++;
+  job->interp = interp;
+  Tcl_Preserve(interp);
+  job->callback = callback;
+  Tcl_IncrRefCount(callback);
+  job->owner = Tcl_GetCurrentThread();
+  job->elapsed_ns = 0;
+  job->nbytes = 0;
+
+  asyncQueue.push_back(job);
+  Tcl_ConditionNotify(&asyncCond);
+  Tcl_MutexUnlock(&asyncMutex);
+
+  Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+  return TCL_OK;
+}
+
+
+/*
+ * "leveldb bench" runs a db_bench style workload directly on the
+ * leveldb::DB of a handle, as the baseline for the same workload through
+ * the Tcl commands (bench/bench.tcl). Keys are 16 digit numbers below
+ * -num; each of -threads threads does -num operations. Latency is kept
+ * per write call, per lookup or per iterator step.
+ */
+enum LevelBenchTest {
+  LEVEL_BENCH_FILLSEQ,
+  LEVEL_BENCH_FILLRANDOM,
+  LEVEL_BENCH_OVERWRITE,
+  LEVEL_BENCH_READRANDOM,
+  LEVEL_BENCH_READMISSING,
+  LEVEL_BENCH_READSEQ,
+  LEVEL_BENCH_READREVERSE,
+};
+
+static const char *LevelBenchNames[] = {
+  "fillseq",
+  "fillrandom",
+  "overwrite",
+  "readrandom",
+  "readmissing",
+  "readseq",
+  "readreverse",
+  0
+};
+
+typedef struct LevelBench {
+  leveldb::DB *db;
+  int test;                       /* enum LevelBenchTest */
+  Tcl_WideInt num;
+  int value_size;
+  int batch;
+  uint64_t seed;
+  const std::string *values;      /* random data to take values from */
+  Tcl_WideInt ops;
+  Tcl_WideInt found;
+  LevelOpStats stats;
+  std::string error;
+} LevelBench;
+
+static uint64_t LEVELDB_BenchRandom(uint64_t *state)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+
+static void LEVELDB_BenchRun(LevelBench *bench)
+{
+  typedef std::chrono::steady_clock clock;
+  leveldb::ReadOptions read_options;
+  leveldb::WriteOptions write_options;
+  leveldb::WriteBatch batch;
+  leveldb::Status status;
+  leveldb::Iterator *it;
+  clock::time_point t0;
+  std::string value;
+  char key[32];
+  size_t offset = 0;
+  Tcl_WideInt i, n, k;
+  Tcl_WideInt nbytes;
+
+#define LEVELDB_BENCH_NS() \
+    std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - t0).count()
+
+  switch( bench->test ) {
+    case LEVEL_BENCH_FILLSEQ:
+    case LEVEL_BENCH_FILLRANDOM:
+    case LEVEL_BENCH_OVERWRITE:
+      for(i = 0; i < bench->num; i += n) {
+        batch.Clear();
+        nbytes = 0;
+        for(n = 0; n < bench->batch && i + n < bench->num; n++) {
+          k = bench->test == LEVEL_BENCH_FILLSEQ ? i + n :
+              (Tcl_WideInt) (LEVELDB_BenchRandom(&bench->seed) % (uint64_t) bench->num);
+          snprintf(key, sizeof(key), "%016lld", (long long) k);
+          if( offset + bench->value_size > bench->values->size() ) {
+            offset = 0;
+          }
+          batch.Put(leveldb::Slice(key, 16),
+                    leveldb::Slice(bench->values->data() + offset, bench->value_size));
+          offset += bench->value_size;
+          nbytes += 16 + bench->value_size;
+        }
+
+        t0 = clock::now();
+        status = bench->db->Write(write_options, &batch);
+        LEVELDB_OpStatRecord(&bench->stats, LEVELDB_BENCH_NS(), nbytes);
+        if( !status.ok() ) {
+          bench->error = status.ToString();
+          return;
+        }
+        bench->ops += n;
+      }
+      break;
+
+    case LEVEL_BENCH_READRANDOM:
+    case LEVEL_BENCH_READMISSING:
+      for(i = 0; i < bench->num; i++) {
+        k = (Tcl_WideInt) (LEVELDB_BenchRandom(&bench->seed) % (uint64_t) bench->num);
+        snprintf(key, sizeof(key), "%016lld%s", (long long) k,
+                 bench->test == LEVEL_BENCH_READMISSING ? "." : "");
+
+        t0 = clock::now();
+        status = bench->db->Get(read_options, key, &value);
+        if( status.ok() ) {
+          LEVELDB_OpStatRecord(&bench->stats, LEVELDB_BENCH_NS(), strlen(key) + value.size());
+          bench->found++;
+        } else if( status.IsNotFound() ) {
+          LEVELDB_OpStatRecord(&bench->stats, LEVELDB_BENCH_NS(), 0);
+        } else {
+          bench->error = status.ToString();
+          return;
+        }
+        bench->ops++;
+      }
+      break;
+
+    case LEVEL_BENCH_READSEQ:
+    case LEVEL_BENCH_READREVERSE:
+      it = bench->db->NewIterator(read_options);
+      t0 = clock::now();
+      if( bench->test == LEVEL_BENCH_READSEQ ) {
+        it->SeekToFirst();
+      } else {
+        it->SeekToLast();
+      }
+      for(i = 0; i < bench->num && it->Valid(); i++) {
+        nbytes = it->key().size() + it->value().size();
+        if( bench->test == LEVEL_BENCH_READSEQ ) {
+          it->Next();
+        } else {
+          it->Prev();
+        }
+        LEVELDB_OpStatRecord(&bench->stats, LEVELDB_BENCH_NS(), nbytes);
+        bench->found++;
+        bench->ops++;
+        t0 = clock::now();
+      }
+      status = it->status();
+      if( !status.ok() ) {
+        bench->error = status.ToString();
+      }
+      delete it;
+      break;
+  }
+
+#undef LEVELDB_BENCH_NS
+}
+
+
+static Tcl_ThreadCreateType LEVELDB_BenchThread(ClientData cd)
+{
+  LEVELDB_BenchRun((LevelBench *) cd);
+
+  TCL_THREAD_CREATE_RETURN;
+}
+
+
+/*
+ * DB_HANDLE load: the file is read in chunks of about -batch_bytes that
+ * end at a record boundary. Chunks are parsed into WriteBatches by
+ * -threads parser threads (or by the calling thread when it is 1), and
+ * the calling thread writes them in file order, so a later record of a
+ * key wins as if the records were put one by one. With -sort all chunks
+ * are parsed first, and the records are written in the order of the
+ * comparator, keeping the last record of each key.
+ *
+ * tsv: one record per line, key and value separated by a tab; \t, \n,
+ * \r and \\ in them stand for a tab, newline, carriage return and
+ * backslash. binary: a 4 byte big-endian length and the bytes of the
+ * key, then the same for the value. A binary file written by
+ * DB_HANDLE dump starts with LevelDumpMagic and holds the records in
+ * checksummed blocks, see LEVELDB_DumpQueue; chunks then end at a block
+ * boundary and a missing end block is an error.
+ */
+enum LevelLoadFormat {
+  LEVEL_LOAD_TSV,
+  LEVEL_LOAD_BINARY,
+};
+
+static const char *LevelLoadFormats[] = {
+  "tsv",
+  "binary",
+  0
+};
+
+typedef struct LevelLoadChunk {
+  std::string data;
+  Tcl_WideInt offset;             /* of data in the file */
+  leveldb::WriteBatch batch;
+  std::vector<leveldb::Slice> records;  /* key, value, ... with -sort */
+  Tcl_WideInt count;
+  Tcl_WideInt nbytes;
+  std::string error;
+  int ended;                      /* holds the end block of a dump */
+  int done;
+} LevelLoadChunk;
+
+typedef struct LevelLoad {
+  int format;
+  int framed;                     /* a binary dump */
+  int sort;
+  size_t batch_bytes;
+  Tcl_Channel chan;               /* read by the calling thread only */
+  std::string carry;              /* partial record after the last chunk */
+  Tcl_WideInt offset;
+  int eof;
+  Tcl_Mutex mutex;
+  Tcl_Condition cond;
+  std::deque<LevelLoadChunk *> todo;
+  int stop;
+} LevelLoad;
+
+
+static uint32_t LEVELDB_LoadLength(const char *p)
+{
+  const unsigned char *u = (const unsigned char *) p;
+
+  return ((uint32_t) u[0] << 24) | ((uint32_t) u[1] << 16) |
+         ((uint32_t) u[2] << 8) | (uint32_t) u[3];
+}
+
+
+/*
+ * The binary dump format: LevelDumpMagic, then blocks of a 4 byte
+ * big-endian payload length, the CRC-32 of the payload and the payload,
+ * records in the binary load format. An empty block ends the dump.
+ */
+static const char LevelDumpMagic[8] = { 'L', 'D', 'B', 'D', 'U', 'M', 'P', '1' };
+
+
+/*
+ * Size of the binary record at p, or 0 if it does not end before end.
+ */
+static size_t LEVELDB_LoadRecordSize(const char *p, const char *end)
+{
+  size_t avail = end - p;
+  size_t klen, vlen;
+
+  if( avail < 4 ) {
+    return 0;
+  }
+  klen = LEVELDB_LoadLength(p);
+  if( avail - 4 < klen || avail - 4 - klen < 4 ) {
+    return 0;
+  }
+  vlen = LEVELDB_LoadLength(p + 4 + klen);
+  if( avail - 8 - klen < vlen ) {
+    return 0;
+  }
+
+  return 8 + klen + vlen;
+}
+
+
+/*
+ * Size of the dump block at p, or 0 if it does not end before end.
+ */
+static size_t LEVELDB_LoadBlockSize(const char *p, const char *end)
+{
+  size_t avail = end - p;
+  size_t len;
+
+  if( avail < 8 ) {
+    return 0;
+  }
+  len = LEVELDB_LoadLength(p);
+  if( avail - 8 < len ) {
+    return 0;
+  }
+
+  return 8 + len;
+}
+
+
+/*
+ * Read the next chunk into chunk->data. Returns 1 for a chunk, 0 at the
+ * end of the file and -1 on a read error (Tcl_GetErrno). Called by the
+ * thread that opened the channel; the parser threads only see chunks.
+ */
+static int LEVELDB_LoadRead(LevelLoad *load, LevelLoadChunk *chunk)
+{
+  std::string &data = chunk->data;
+  size_t want = load->batch_bytes;
+  size_t cut = 0;
+  size_t old;
+  Tcl_Size n;
+
+  data.swap(load->carry);
+  load->carry.clear();
+  chunk->offset = load->offset;
+
+  for(;;) {
+    while( !load->eof && data.size() < want ) {
+      old = data.size();
+      data.resize(want);
+      n = Tcl_Read(load->chan, &data[old], (Tcl_Size) (want - old));
+      if( n < 0 ) {
+        data.resize(old);
+        return -1;
+      }
+      data.resize(old + n);
+      if( (size_t) n < want - old ) {
+        load->eof = 1;
+      }
+    }
+
+    if( load->eof ) {
+      cut = data.size();
+      break;
+    }
+
+    if( load->format == LEVEL_LOAD_TSV ) {
+      for(cut = data.size(); cut > 0 && data[cut - 1] != '\n'; cut--) {
+      }
+    } else {
+      const char *p = data.data();
+      const char *end = p + data.size();
+      size_t size;
+
+      while( (size = load->framed ? LEVELDB_LoadBlockSize(p, end) :
+                                    LEVELDB_LoadRecordSize(p, end)) > 0 ) {
+        p += size;
+      }
+      cut = p - data.data();
+    }
+
+    if( cut > 0 ) {
+      break;
+    }
+    want *= 2;                    /* a record or block longer than the chunk */
+  }
+
+  load->carry.assign(data, cut, std::string::npos);
+  data.resize(cut);
+  load->offset += cut;
+
+  return data.empty() ? 0 : 1;
+}
+
+
+/*
+ * Undo the tsv escapes in place, returning the new length.
+ */
+static size_t LEVELDB_LoadUnescape(char *p, size_t len)
+{
+  char *end = p + len;
+  char *in = (char *) memchr(p, '\\', len);
+  char *out = in;
+
+  if( !in ) {
+    return len;
+  }
+
+  while( in < end ) {
+    if( *in == '\\' && in + 1 < end ) {
+      switch( in[1] ) {
+        case 't':  *out++ = '\t'; in += 2; continue;
+        case 'n':  *out++ = '\n'; in += 2; continue;
+        case 'r':  *out++ = '\r'; in += 2; continue;
+        case '\\': *out++ = '\\'; in += 2; continue;
+      }
+    }
+    *out++ = *in++;
+  }
+
+  return out - p;
+}
+
+
+static void LEVELDB_LoadAdd(LevelLoad *load, LevelLoadChunk *chunk,
+                            const leveldb::Slice& key, const leveldb::Slice& value)
+{
+  if( load->sort ) {
+    chunk->records.push_back(key);
+    chunk->records.push_back(value);
+  } else {
+    chunk->batch.Put(key, value);
+  }
+  chunk->count++;
+  chunk->nbytes += key.size() + value.size();
+}
+
+
+/*
+ * Add the binary records from p to end. Returns 0 at a truncated record.
+ */
+static int LEVELDB_LoadRecords(LevelLoad *load, LevelLoadChunk *chunk,
+                               const char **pp, const char *end)
+{
+  const char *p = *pp;
+  size_t size, klen;
+
+  for(; p < end; p += size) {
+    size = LEVELDB_LoadRecordSize(p, end);
+    if( size == 0 ) {
+      *pp = p;
+      return 0;
+    }
+    klen = LEVELDB_LoadLength(p);
+    LEVELDB_LoadAdd(load, chunk, leveldb::Slice(p + 4, klen),
+                    leveldb::Slice(p + 8 + klen, size - 8 - klen));
+  }
+
+  return 1;
+}
+
+
+static void LEVELDB_LoadParse(LevelLoad *load, LevelLoadChunk *chunk)
+{
+  char *start = &chunk->data[0];
+  char *end = start + chunk->data.size();
+  char *p = start;
+  char buf[80];
+
+  while( load->framed && p < end ) {
+    size_t size = LEVELDB_LoadBlockSize(p, end);
+    const char *q = p + 8;
+    uint32_t len;
+
+    if( chunk->ended ) {
+      snprintf(buf, sizeof(buf), "data after the end of the dump at offset %lld",
+               (long long) (chunk->offset + (p - start)));
+      chunk->error = buf;
+      return;
+    }
+    if( size == 0 ) {
+      snprintf(buf, sizeof(buf), "truncated block at offset %lld",
+               (long long) (chunk->offset + (p - start)));
+      chunk->error = buf;
+      return;
+    }
+
+    len = (uint32_t) (size - 8);
+    if( Tcl_ZlibCRC32(0, (const unsigned char *) q, len) != LEVELDB_LoadLength(p + 4) ) {
+      snprintf(buf, sizeof(buf), "checksum mismatch in the block at offset %lld",
+               (long long) (chunk->offset + (p - start)));
+      chunk->error = buf;
+      return;
+    }
+    if( !LEVELDB_LoadRecords(load, chunk, &q, p + size) ) {
+      snprintf(buf, sizeof(buf), "bad record in the block at offset %lld",
+               (long long) (chunk->offset + (p - start)));
+      chunk->error = buf;
+      return;
+    }
+    chunk->ended = len == 0;
+    p += size;
+  }
+
+  while( p < end ) {
+    if( load->format == LEVEL_LOAD_TSV ) {
+      char *eol = (char *) memchr(p, '\n', end - p);
+      char *stop, *tab;
+
+      if( !eol ) {
+        eol = end;
+      }
+      stop = eol;
+      if( stop > p && stop[-1] == '\r' ) {
+        stop--;
+      }
+      if( stop > p ) {
+        tab = (char *) memchr(p, '\t', stop - p);
+        if( !tab ) {
+          snprintf(buf, sizeof(buf), "no tab in the record at offset %lld",
+                   (long long) (chunk->offset + (p - start)));
+          chunk->error = buf;
+          return;
+        }
+        if( tab == p || tab + 1 == stop ) {
+          snprintf(buf, sizeof(buf), "empty %s at offset %lld", tab == p ? "key" : "value",
+                   (long long) (chunk->offset + (p - start)));
+          chunk->error = buf;
+          return;
+        }
+        LEVELDB_LoadAdd(load, chunk,
+                        leveldb::Slice(p, LEVELDB_LoadUnescape(p, tab - p)),
+                        leveldb::Slice(tab + 1, LEVELDB_LoadUnescape(tab + 1, stop - tab - 1)));
+      }
+      p = eol + 1;
+    } else {
+      const char *q = p;
+
+      if( !LEVELDB_LoadRecords(load, chunk, &q, end) ) {
+        snprintf(buf, sizeof(buf), "truncated record at offset %lld",
+                 (long long) (chunk->offset + (q - start)));
+        chunk->error = buf;
+      }
+      return;
+    }
+  }
+}
+
+
+static Tcl_ThreadCreateType LEVELDB_LoadThread(ClientData cd)
+{
+  LevelLoad *load = (LevelLoad *) cd;
+  LevelLoadChunk *chunk;
+
+  Tcl_MutexLock(&load->mutex);
+  for(;;) {
+    while( load->todo.empty() && !load->stop ) {
+      Tcl_ConditionWait(&load->cond, &load->mutex, NULL);
+    }
+    if( load->stop ) {
+      break;
+    }
+
+    chunk = load->todo.front();
+    load->todo.pop_front();
+    Tcl_MutexUnlock(&load->mutex);
+
+    LEVELDB_LoadParse(load, chunk);
+
+    Tcl_MutexLock(&load->mutex);
+    chunk->done = 1;
+    Tcl_ConditionNotify(&load->cond);
+  }
+  Tcl_MutexUnlock(&load->mutex);
+
+  TCL_THREAD_CREATE_RETURN;
+}
+
+
+typedef struct LevelLoadLess {
+  const leveldb::Comparator *comparator;
+
+  LevelLoadLess(const leveldb::Comparator *c) : comparator(c) {}
+
+  bool operator()(const std::pair<leveldb::Slice, leveldb::Slice>& a,
+                  const std::pair<leveldb::Slice, leveldb::Slice>& b) const {
+    return comparator->Compare(a.first, b.first) < 0;
+  }
+} LevelLoadLess;
+
+
+static leveldb::Status LEVELDB_LoadWrite(LevelDBInfo *dbInfo,
+                                         const leveldb::WriteOptions& options,
+                                         leveldb::WriteBatch *batch,
+                                         Tcl_WideInt nbytes, Tcl_WideInt *batches)
+{
+  leveldb::Status status;
+  LEVELDB_STAT_BEGIN(t0);
+
+  status = LEVELDB_Write(dbInfo->shared, options, batch);
+  LEVELDB_STAT_END(dbInfo->stats, LEVEL_STAT_WRITE, t0, nbytes);
+  (*batches)++;
+
+  return status;
+}
+
+
+/*
+ * Load the records of load->chan. Returns an error message, empty on
+ * success; the batches written before an error stay in the database.
+ */
+static std::string LEVELDB_Load(LevelDBInfo *dbInfo, LevelLoad *load, int threads,
+                                const leveldb::WriteOptions& options,
+                                Tcl_WideInt *records, Tcl_WideInt *batches)
+{
+  std::deque<LevelLoadChunk *> inflight;
+  std::vector<LevelLoadChunk *> parsed;
+  std::vector<Tcl_ThreadId> ids;
+  LevelLoadChunk *chunk;
+  leveldb::Status status;
+  std::string error;
+  size_t limit = threads > 1 ? 2 * threads : 1;
+  size_t i;
+  int eof = 0;
+  int ended = 0;
+  int r;
+
+  for(i = 0; threads > 1 && i < (size_t) threads; i++) {
+    Tcl_ThreadId id;
+
+    if( Tcl_CreateThread(&id, LEVELDB_LoadThread, load,
+                         TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK ) {
+      error = "cannot create thread";
+      break;
+    }
+    ids.push_back(id);
+  }
+
+  while( error.empty() ) {
+    while( !eof && inflight.size() < limit ) {
+      chunk = new LevelLoadChunk;
+      chunk->count = 0;
+      chunk->nbytes = 0;
+      chunk->ended = 0;
+      chunk->done = 0;
+
+      r = LEVELDB_LoadRead(load, chunk);
+      if( r <= 0 ) {
+        if( r < 0 ) {
+          error = Tcl_ErrnoMsg(Tcl_GetErrno());
+        }
+        delete chunk;
+        eof = 1;
+        break;
+      }
+
+      inflight.push_back(chunk);
+      if( ids.empty() ) {
+        LEVELDB_LoadParse(load, chunk);
+        chunk->done = 1;
+      } else {
+        Tcl_MutexLock(&load->mutex);
+        load->todo.push_back(chunk);
+        Tcl_ConditionNotify(&load->cond);
+        Tcl_MutexUnlock(&load->mutex);
+      }
+    }
+
+    if( !error.empty() || inflight.empty() ) {
+      break;
+    }
+
+    chunk = inflight.front();
+    if( !ids.empty() ) {
+      Tcl_MutexLock(&load->mutex);
+      while( !chunk->done ) {
+        Tcl_ConditionWait(&load->cond, &load->mutex, NULL);
+      }
+      Tcl_MutexUnlock(&load->mutex);
+    }
+    inflight.pop_front();
+
+    if( ended ) {
+      char buf[80];
+
+      snprintf(buf, sizeof(buf), "data after the end of the dump at offset %lld",
+               (long long) chunk->offset);
+      chunk->error = buf;
+    }
+    if( !chunk->error.empty() ) {
+      error = chunk->error;
+      delete chunk;
+      break;
+    }
+
+    ended = chunk->ended;
+    *records += chunk->count;
+    if( load->sort ) {
+      parsed.push_back(chunk);
+      continue;
+    }
+
+    if( chunk->count > 0 ) {
+      status = LEVELDB_LoadWrite(dbInfo, options, &chunk->batch, chunk->nbytes, batches);
+      if( !status.ok() ) {
+        error = status.ToString();
+      }
+    }
+    delete chunk;
+  }
+
+  Tcl_MutexLock(&load->mutex);
+  load->stop = 1;
+  Tcl_ConditionNotify(&load->cond);
+  Tcl_MutexUnlock(&load->mutex);
+  for(i = 0; i < ids.size(); i++) {
+    int result;
+
+    Tcl_JoinThread(ids[i], &result);
+  }
+  while( !inflight.empty() ) {
+    delete inflight.front();
+    inflight.pop_front();
+  }
+
+  if( error.empty() && load->framed && !ended ) {
+    error = "the dump is truncated";
+  }
+
+  if( error.empty() && !parsed.empty() ) {
+    std::vector<std::pair<leveldb::Slice, leveldb::Slice> > all;
+    leveldb::WriteBatch batch;
+    Tcl_WideInt nbytes = 0;
+    size_t k;
+
+    all.reserve((size_t) *records);
+    for(i = 0; i < parsed.size(); i++) {
+      for(k = 0; k < parsed[i]->records.size(); k += 2) {
+        all.push_back(std::make_pair(parsed[i]->records[k], parsed[i]->records[k + 1]));
+      }
+    }
+
+    std::stable_sort(all.begin(), all.end(), LevelLoadLess(dbInfo->shared->comparator));
+
+    for(k = 0; k < all.size() && error.empty(); k++) {
+      if( k + 1 < all.size() &&
+          dbInfo->shared->comparator->Compare(all[k].first, all[k + 1].first) == 0 ) {
+        continue;
+      }
+      batch.Put(all[k].first, all[k].second);
+      nbytes += all[k].first.size() + all[k].second.size();
+      if( k + 1 == all.size() || batch.ApproximateSize() >= load->batch_bytes ) {
+        status = LEVELDB_LoadWrite(dbInfo, options, &batch, nbytes, batches);
+        if( !status.ok() ) {
+          error = status.ToString();
+        }
+        batch.Clear();
+        nbytes = 0;
+      }
+    }
+  }
+  for(i = 0; i < parsed.size(); i++) {
+    delete parsed[i];
+  }
+
+  return error;
+}
+
+
+/*
+ * DB_HANDLE dump: a worker thread walks the range and encodes the
+ * records into blocks of about LEVELDB_DUMP_BLOCK_SIZE bytes, which the
+ * calling thread writes to the channel (channels belong to the thread
+ * that opened them). The worker waits when LEVELDB_DUMP_BLOCKS blocks
+ * are queued, so a slow channel bounds the memory used.
+ *
+ * Without -command the calling thread waits for the blocks. With
+ * -command the dump returns at once: the worker queues an event to the
+ * thread of the interpreter for every block, the blocks are written
+ * from the event loop, and the callback is called when the dump is
+ * done. The dump then holds a reference to the database handle and to
+ * the channel, and always uses its own snapshot.
+ */
+#define LEVELDB_DUMP_BLOCK_SIZE 1048576
+#define LEVELDB_DUMP_BLOCKS 4
+
+typedef struct LevelDump {
+  leveldb::DB *db;
+  leveldb::ReadOptions read_options;
+  int own_snapshot;               /* release read_options.snapshot */
+  LevelRange range;
+  int format;
+  Tcl_Channel chan;
+  Tcl_ThreadId thread;
+  Tcl_Mutex mutex;
+  Tcl_Condition cond;
+  std::deque<std::string *> blocks;
+  int done;
+  int stop;
+  Tcl_WideInt records;
+  Tcl_WideInt nbytes;             /* written to the channel */
+  std::chrono::steady_clock::time_point start;
+  std::string error;              /* of the worker */
+  std::string write_error;        /* of the channel */
+
+  /* -command */
+  LevelDBInfo *dbInfo;
+  Tcl_Interp *interp;
+  Tcl_Obj *callback;              /* NULL if the dump blocks */
+  Tcl_ThreadId owner;
+  int events;                     /* queued LevelDumpEvents */
+} LevelDump;
+
+typedef struct LevelDumpEvent {
+  Tcl_Event header;
+  LevelDump *dump;
+} LevelDumpEvent;
+
+static int LEVELDB_DumpEventProc(Tcl_Event *evPtr, int flags);
+
+
+/*
+ * Wake the thread of a -command dump. Called with dump->mutex held.
+ */
+static void LEVELDB_DumpAlert(LevelDump *dump)
+{
+  LevelDumpEvent *evPtr;
+
+  if( !dump->callback ) {
+    return;
+  }
+
+  evPtr = (LevelDumpEvent *) ckalloc(sizeof(LevelDumpEvent));
+  evPtr->header.proc = LEVELDB_DumpEventProc;
+  evPtr->dump = dump;
+  dump->events++;
+  Tcl_ThreadQueueEvent(dump->owner, (Tcl_Event *) evPtr, TCL_QUEUE_TAIL);
+  Tcl_ThreadAlert(dump->owner);
+}
+
+
+static void LEVELDB_DumpLength(char *p, uint32_t n)
+{
+  p[0] = (char) (n >> 24);
+  p[1] = (char) (n >> 16);
+  p[2] = (char) (n >> 8);
+  p[3] = (char) n;
+}
+
+
+static void LEVELDB_DumpBytes(std::string *out, const leveldb::Slice& s)
+{
+  char len[4];
+
+  LEVELDB_DumpLength(len, (uint32_t) s.size());
+  out->append(len, 4);
+  out->append(s.data(), s.size());
+}
+
+
+static void LEVELDB_DumpEscaped(std::string *out, const leveldb::Slice& s)
+{
+  const char *p = s.data();
+  const char *end = p + s.size();
+  const char *q;
+
+  for(q = p; q < end; q++) {
+    const char *esc;
+
+    switch( *q ) {
+      case '\t': esc = "\\t"; break;
+      case '\n': esc = "\\n"; break;
+      case '\r': esc = "\\r"; break;
+      case '\\': esc = "\\\\"; break;
+      default: continue;
+    }
+    out->append(p, q - p);
+    out->append(esc, 2);
+    p = q + 1;
+  }
+  out->append(p, end - p);
+}
+
+
+static std::string *LEVELDB_DumpNewBlock(LevelDump *dump)
+{
+  std::string *block = new std::string;
+
+  block->reserve(LEVELDB_DUMP_BLOCK_SIZE + 4096);
+  if( dump->format == LEVEL_LOAD_BINARY ) {
+    block->assign(8, '\0');       /* length and checksum */
+  }
+
+  return block;
+}
+
+
+/*
+ * Seal a binary block with its length and checksum and queue it for the
+ * calling thread. Returns 0, dropping the block, if the dump is stopped.
+ */
+static int LEVELDB_DumpQueue(LevelDump *dump, std::string *block)
+{
+  int queued = 0;
+
+  if( dump->format == LEVEL_LOAD_BINARY ) {
+    uint32_t len = (uint32_t) (block->size() - 8);
+
+    LEVELDB_DumpLength(&(*block)[0], len);
+    LEVELDB_DumpLength(&(*block)[4],
+        Tcl_ZlibCRC32(0, (const unsigned char *) block->data() + 8, len));
+  }
+
+  Tcl_MutexLock(&dump->mutex);
+  while( dump->blocks.size() >= LEVELDB_DUMP_BLOCKS && !dump->stop ) {
+    Tcl_ConditionWait(&dump->cond, &dump->mutex, NULL);
+  }
+  if( !dump->stop ) {
+    dump->blocks.push_back(block);
+    queued = 1;
+    Tcl_ConditionNotify(&dump->cond);
+    LEVELDB_DumpAlert(dump);
+  }
+  Tcl_MutexUnlock(&dump->mutex);
+
+  if( !queued ) {
+    delete block;
+  }
+
+  return queued;
+}
+
+
+static Tcl_ThreadCreateType LEVELDB_DumpThread(ClientData cd)
+{
+  LevelDump *dump = (LevelDump *) cd;
+  leveldb::Iterator *it = dump->db->NewIterator(dump->read_options);
+  std::string *block = LEVELDB_DumpNewBlock(dump);
+  size_t empty = block->size();
+  int queued = 1;
+
+  for(LEVELDB_RangeSeek(it, &dump->range); LEVELDB_RangeValid(it, &dump->range);
+      LEVELDB_RangeStep(it, &dump->range)) {
+    if( dump->format == LEVEL_LOAD_BINARY ) {
+      LEVELDB_DumpBytes(block, it->key());
+      LEVELDB_DumpBytes(block, it->value());
+    } else {
+      LEVELDB_DumpEscaped(block, it->key());
+      block->push_back('\t');
+      LEVELDB_DumpEscaped(block, it->value());
+      block->push_back('\n');
+    }
+    dump->records++;
+
+    if( block->size() >= LEVELDB_DUMP_BLOCK_SIZE ) {
+      queued = LEVELDB_DumpQueue(dump, block);
+      block = queued ? LEVELDB_DumpNewBlock(dump) : NULL;
+      if( !queued ) {
+        break;
+      }
+    }
+  }
+
+  if( !it->status().ok() ) {
+    dump->error = it->status().ToString();
+  }
+  delete it;
+
+  /*
+   * The empty block that ends a binary dump is only written after all
+   * records were read.
+   */
+  if( block ) {
+    if( block->size() > empty ) {
+      queued = LEVELDB_DumpQueue(dump, block);
+    } else {
+      delete block;
+    }
+  }
+  if( queued && dump->error.empty() && dump->format == LEVEL_LOAD_BINARY ) {
+    LEVELDB_DumpQueue(dump, LEVELDB_DumpNewBlock(dump));
+  }
+
+  Tcl_MutexLock(&dump->mutex);
+  dump->done = 1;
+  Tcl_ConditionNotify(&dump->cond);
+  LEVELDB_DumpAlert(dump);
+  Tcl_MutexUnlock(&dump->mutex);
+
+  TCL_THREAD_CREATE_RETURN;
+}
+
+
+/*
+ * Write the queued blocks to the channel. After a write error the
+ * worker is stopped and the remaining blocks are dropped. If wait is
+ * set, wait for blocks until the worker is done. Returns 1 once the
+ * worker is done and all blocks are taken.
+ */
+static int LEVELDB_DumpWrite(LevelDump *dump, int wait)
+{
+  std::string *block;
+
+  for(;;) {
+    Tcl_MutexLock(&dump->mutex);
+    while( wait && dump->blocks.empty() && !dump->done ) {
+      Tcl_ConditionWait(&dump->cond, &dump->mutex, NULL);
+    }
+    if( dump->blocks.empty() ) {
+      int done = dump->done;
+
+      Tcl_MutexUnlock(&dump->mutex);
+      return done;
+    }
+    block = dump->blocks.front();
+    dump->blocks.pop_front();
+    Tcl_ConditionNotify(&dump->cond);
+    Tcl_MutexUnlock(&dump->mutex);
+
+    if( dump->write_error.empty() ) {
+      if( Tcl_Write(dump->chan, block->data(), (Tcl_Size) block->size()) < 0 ) {
+        dump->write_error = Tcl_ErrnoMsg(Tcl_GetErrno());
+        Tcl_MutexLock(&dump->mutex);
+        dump->stop = 1;
+        Tcl_ConditionNotify(&dump->cond);
+        Tcl_MutexUnlock(&dump->mutex);
+      }
+      dump->nbytes += block->size();
+    }
+    delete block;
+  }
+}
+
+
+/*
+ * Join the worker and flush the channel. Returns the result dict, or
+ * NULL with the error in *error. The dump is freed.
+ */
+static Tcl_Obj *LEVELDB_DumpFinish(LevelDump *dump, std::string *error)
+{
+  Tcl_Obj *resultObj = NULL;
+  double seconds;
+  int result;
+
+  Tcl_JoinThread(dump->thread, &result);
+
+  if( dump->write_error.empty() && Tcl_Flush(dump->chan) != TCL_OK ) {
+    dump->write_error = Tcl_ErrnoMsg(Tcl_GetErrno());
+  }
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - dump->start).count();
+
+  if( dump->own_snapshot ) {
+    dump->db->ReleaseSnapshot(dump->read_options.snapshot);
+  }
+  Tcl_MutexFinalize(&dump->mutex);
+  Tcl_ConditionFinalize(&dump->cond);
+
+  *error = dump->write_error.empty() ? dump->error : dump->write_error;
+  if( error->empty() ) {
+    resultObj = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("records", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(dump->records));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("bytes", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(dump->nbytes));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("seconds", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewDoubleObj(seconds));
+  }
+  delete dump;
+
+  return resultObj;
+}
+
+
+/*
+ * Write the blocks of a -command dump from the event loop. The last
+ * event finishes the dump and calls the callback with "ok" and the
+ * result dict, or "error" and the message.
+ */
+static int LEVELDB_DumpEventProc(Tcl_Event *evPtr, int flags)
+{
+  LevelDump *dump = ((LevelDumpEvent *) evPtr)->dump;
+  Tcl_Interp *interp = dump->interp;
+  Tcl_Obj *callback = dump->callback;
+  LevelDBInfo *dbInfo = dump->dbInfo;
+  Tcl_Channel chan = dump->chan;
+  Tcl_Obj *resultObj;
+  Tcl_Obj *cmdObj;
+  std::string error;
+  int finished;
+  int result;
+
+  LEVELDB_DumpWrite(dump, 0);
+
+  Tcl_MutexLock(&dump->mutex);
+  dump->events--;
+  finished = dump->done && dump->blocks.empty() && dump->events == 0;
+  Tcl_MutexUnlock(&dump->mutex);
+  if( !finished ) {
+    return 1;
+  }
+
+  resultObj = LEVELDB_DumpFinish(dump, &error);
+  Tcl_UnregisterChannel(NULL, chan);
+
+  if( !Tcl_InterpDeleted(interp) ) {
+    cmdObj = Tcl_DuplicateObj(callback);
+    Tcl_IncrRefCount(cmdObj);
+    if( resultObj ) {
+      Tcl_ListObjAppendElement(NULL, cmdObj, Tcl_NewStringObj("ok", -1));
+      Tcl_ListObjAppendElement(NULL, cmdObj, resultObj);
+    } else {
+      Tcl_ListObjAppendElement(NULL, cmdObj, Tcl_NewStringObj("error", -1));
+      Tcl_ListObjAppendElement(NULL, cmdObj, Tcl_NewStringObj(error.c_str(), -1));
+    }
+
+    result = Tcl_EvalObjEx(interp, cmdObj, TCL_EVAL_GLOBAL);
+    if( result != TCL_OK ) {
+      Tcl_BackgroundException(interp, result);
+    }
+    Tcl_DecrRefCount(cmdObj);
+  } else if( resultObj ) {
+    Tcl_IncrRefCount(resultObj);
+    Tcl_DecrRefCount(resultObj);
+  }
+
+  Tcl_Release(interp);
+  Tcl_DecrRefCount(callback);
+  LEVELDB_ReleaseDB(dbInfo);
+
+  return 1;
+}
+
+
+/*
+ * DB_HANDLE checkpoint: the table files of a MANIFEST are immutable, so
+ * a checkpoint hard links them and copies only the MANIFEST, CURRENT and
+ * the live logs. An iterator pins the current version while this runs,
+ * so its tables are not deleted by a compaction; if a compaction
+ * finishes between reading the MANIFEST and linking its tables, a table
+ * can be gone, and the checkpoint starts over with the new MANIFEST.
+ */
+#define LEVELDB_CHECKPOINT_TRIES 5
+#define LEVELDB_CHECKPOINT_MARKER "CHECKPOINT"
+
+typedef struct LevelManifest {
+  std::set<uint64_t> tables;
+  uint64_t log_number;
+  uint64_t prev_log_number;
+} LevelManifest;
+
+
+static int LEVELDB_GetVarint(const char **pp, const char *end, uint64_t *value)
+{
+  const char *p = *pp;
+  int shift;
+
+  *value = 0;
+  for(shift = 0; shift <= 63 && p < end; shift += 7) {
+    unsigned char byte = (unsigned char) *p++;
+
+    *value |= (uint64_t) (byte & 0x7f) << shift;
+    if( !(byte & 0x80) ) {
+      *pp = p;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+static int LEVELDB_SkipBytes(const char **pp, const char *end)
+{
+  uint64_t len;
+
+  if( !LEVELDB_GetVarint(pp, end, &len) || (uint64_t) (end - *pp) < len ) {
+    return 0;
+  }
+  *pp += len;
+
+  return 1;
+}
+
+
+/*
+ * Apply one VersionEdit record. Deleted files come before new files in
+ * an edit, so a file moved to another level stays.
+ */
+static int LEVELDB_ManifestEdit(LevelManifest *manifest, const std::string& edit)
+{
+  const char *p = edit.data();
+  const char *end = p + edit.size();
+  uint64_t tag, level, number, size;
+
+  while( p < end ) {
+    if( !LEVELDB_GetVarint(&p, end, &tag) ) {
+      return 0;
+    }
+
+    switch( tag ) {
+      case 1:                     /* comparator */
+        if( !LEVELDB_SkipBytes(&p, end) ) return 0;
+        break;
+      case 2:                     /* log number */
+        if( !LEVELDB_GetVarint(&p, end, &manifest->log_number) ) return 0;
+        break;
+      case 3:                     /* next file number */
+      case 4:                     /* last sequence */
+        if( !LEVELDB_GetVarint(&p, end, &number) ) return 0;
+        break;
+      case 5:                     /* compaction pointer */
+        if( !LEVELDB_GetVarint(&p, end, &level) || !LEVELDB_SkipBytes(&p, end) ) return 0;
+        break;
+      case 6:                     /* deleted file */
+        if( !LEVELDB_GetVarint(&p, end, &level) ||
+            !LEVELDB_GetVarint(&p, end, &number) ) return 0;
+        manifest->tables.erase(number);
+        break;
+      case 7:                     /* new file */
+        if( !LEVELDB_GetVarint(&p, end, &level) ||
+            !LEVELDB_GetVarint(&p, end, &number) ||
+            !LEVELDB_GetVarint(&p, end, &size) ||
+            !LEVELDB_SkipBytes(&p, end) || !LEVELDB_SkipBytes(&p, end) ) return 0;
+        manifest->tables.insert(number);
+        break;
+      case 9:                     /* previous log number */
+        if( !LEVELDB_GetVarint(&p, end, &manifest->prev_log_number) ) return 0;
+        break;
+      default:
+        return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+/*
+ * Read the VersionEdits of a MANIFEST, a leveldb log: 32 KiB blocks of
+ * records with a 7 byte header (checksum, length, type), split into
+ * first, middle and last fragments when they cross a block. A torn
+ * record at the end is ignored, as leveldb does on recovery.
+ */
+static int LEVELDB_ParseManifest(const std::string& data, LevelManifest *manifest)
+{
+  const size_t block_size = 32768;
+  std::string record;
+  int fragmented = 0;
+  size_t pos = 0;
+
+  manifest->tables.clear();
+  manifest->log_number = 0;
+  manifest->prev_log_number = 0;
+
+  while( pos < data.size() ) {
+    size_t left = block_size - pos % block_size;
+    size_t len;
+    int type;
+
+    if( left < 7 ) {              /* block trailer */
+      pos += left;
+      continue;
+    }
+    if( data.size() - pos < 7 ) {
+      break;
+    }
+
+    len = (unsigned char) data[pos + 4] | ((unsigned char) data[pos + 5] << 8);
+    type = data[pos + 6];
+    if( len + 7 > left || len + 7 > data.size() - pos ) {
+      break;
+    }
+
+    switch( type ) {
+      case 1:                     /* full */
+        if( !LEVELDB_ManifestEdit(manifest, data.substr(pos + 7, len)) ) return 0;
+        break;
+      case 2:                     /* first */
+        record.assign(data, pos + 7, len);
+        fragmented = 1;
+        break;
+      case 3:                     /* middle */
+      case 4:                     /* last */
+        if( !fragmented ) {
+          return 0;
+        }
+        record.append(data, pos + 7, len);
+        if( type == 4 ) {
+          if( !LEVELDB_ManifestEdit(manifest, record) ) return 0;
+          fragmented = 0;
+        }
+        break;
+      default:
+        return 0;
+    }
+    pos += 7 + len;
+  }
+
+  return 1;
+}
+
+
+static Tcl_Obj *LEVELDB_NewPathObj(const std::string& path)
+{
+  Tcl_Obj *pathObj = Tcl_NewStringObj(path.data(), (Tcl_Size) path.size());
+
+  Tcl_IncrRefCount(pathObj);
+  return pathObj;
+}
+
+
+/*
+ * Size of the file, or -1 if it does not exist.
+ */
+static Tcl_WideInt LEVELDB_FileSize(const std::string& path)
+{
+  Tcl_Obj *pathObj = LEVELDB_NewPathObj(path);
+  Tcl_StatBuf *buf = Tcl_AllocStatBuf();
+  Tcl_WideInt size = -1;
+
+  if( Tcl_FSStat(pathObj, buf) == 0 ) {
+    size = (Tcl_WideInt) Tcl_GetSizeFromStat(buf);
+  }
+  ckfree(buf);
+  Tcl_DecrRefCount(pathObj);
+
+  return size;
+}
+
+
+/*
+ * Whether a and b are the same file, e.g. hard links of each other.
+ */
+static int LEVELDB_SameFile(const std::string& a, const std::string& b)
+{
+  Tcl_Obj *aObj = LEVELDB_NewPathObj(a);
+  Tcl_Obj *bObj = LEVELDB_NewPathObj(b);
+  Tcl_StatBuf *aBuf = Tcl_AllocStatBuf();
+  Tcl_StatBuf *bBuf = Tcl_AllocStatBuf();
+  int same = 0;
+
+  if( Tcl_FSStat(aObj, aBuf) == 0 && Tcl_FSStat(bObj, bBuf) == 0 ) {
+    same = Tcl_GetFSDeviceFromStat(aBuf) == Tcl_GetFSDeviceFromStat(bBuf) &&
+           Tcl_GetFSInodeFromStat(aBuf) == Tcl_GetFSInodeFromStat(bBuf);
+  }
+  ckfree(aBuf);
+  ckfree(bBuf);
+  Tcl_DecrRefCount(aObj);
+  Tcl_DecrRefCount(bObj);
+
+  return same;
+}
+
+
+static int LEVELDB_ReadFile(const std::string& path, std::string *data)
+{
+  Tcl_Obj *pathObj = LEVELDB_NewPathObj(path);
+  Tcl_Channel chan = Tcl_FSOpenFileChannel(NULL, pathObj, "r", 0);
+  char buf[16384];
+  Tcl_Size n;
+
+  Tcl_DecrRefCount(pathObj);
+  if( !chan ) {
+    return TCL_ERROR;
+  }
+
+  data->clear();
+  Tcl_SetChannelOption(NULL, chan, "-translation", "binary");
+  while( (n = Tcl_Read(chan, buf, sizeof(buf))) > 0 ) {
+    data->append(buf, n);
+  }
+  if( n < 0 ) {
+    Tcl_Close(NULL, chan);
+    return TCL_ERROR;
+  }
+
+  return Tcl_Close(NULL, chan);
+}
+
+
+static int LEVELDB_WriteFile(const std::string& path, const std::string& data)
+{
+  Tcl_Obj *pathObj = LEVELDB_NewPathObj(path);
+  Tcl_Channel chan = Tcl_FSOpenFileChannel(NULL, pathObj, "w", 0644);
+
+  Tcl_DecrRefCount(pathObj);
+  if( !chan ) {
+    return TCL_ERROR;
+  }
+
+  Tcl_SetChannelOption(NULL, chan, "-translation", "binary");
+  if( Tcl_Write(chan, data.data(), (Tcl_Size) data.size()) < 0 ) {
+    Tcl_Close(NULL, chan);
+    return TCL_ERROR;
+  }
+
+  return Tcl_Close(NULL, chan);
+}
+
+
+/*
+ * Hard link src to dst, replacing dst. A copy is made where links are
+ * not possible, for example across file systems; *copied is set then.
+ */
+static int LEVELDB_LinkFile(const std::string& src, const std::string& dst, int *copied)
+{
+  Tcl_Obj *srcObj = LEVELDB_NewPathObj(src);
+  Tcl_Obj *dstObj = LEVELDB_NewPathObj(dst);
+  int result = TCL_OK;
+
+  *copied = 0;
+  Tcl_FSDeleteFile(dstObj);
+  if( !Tcl_FSLink(dstObj, srcObj, TCL_CREATE_HARD_LINK) ) {
+    result = Tcl_FSCopyFile(srcObj, dstObj);
+    *copied = 1;
+  }
+  Tcl_DecrRefCount(srcObj);
+  Tcl_DecrRefCount(dstObj);
+
+  return result;
+}
+
+
+static int LEVELDB_CopyFile(const std::string& src, const std::string& dst)
+{
+  Tcl_Obj *srcObj = LEVELDB_NewPathObj(src);
+  Tcl_Obj *dstObj = LEVELDB_NewPathObj(dst);
+  int result;
+
+  result = Tcl_FSCopyFile(srcObj, dstObj);
+  Tcl_DecrRefCount(srcObj);
+  Tcl_DecrRefCount(dstObj);
+
+  return result;
+}
+
+
+static void LEVELDB_DeleteFile(const std::string& path)
+{
+  Tcl_Obj *pathObj = LEVELDB_NewPathObj(path);
+
+  Tcl_FSDeleteFile(pathObj);
+  Tcl_DecrRefCount(pathObj);
+}
+
+
+/*
+ * The names of the files in dir, or of all entries if all is set.
+ */
+static void LEVELDB_ListDir(const std::string& dir, std::vector<std::string> *names,
+                            int all)
+{
+  Tcl_Obj *dirObj = LEVELDB_NewPathObj(dir);
+  Tcl_Obj *listObj = Tcl_NewListObj(0, NULL);
+  Tcl_GlobTypeData types = { TCL_GLOB_TYPE_FILE, 0, NULL, NULL };
+  Tcl_Obj **elems;
+  Tcl_Size count, i;
+
+  Tcl_IncrRefCount(listObj);
+  names->clear();
+  if( Tcl_FSMatchInDirectory(NULL, listObj, dirObj, "*", all ? NULL : &types) == TCL_OK &&
+      Tcl_ListObjGetElements(NULL, listObj, &count, &elems) == TCL_OK ) {
+    for(i = 0; i < count; i++) {
+      std::string path = Tcl_GetString(elems[i]);
+
+      names->push_back(path.substr(path.rfind('/') + 1));
+    }
+  }
+  Tcl_DecrRefCount(listObj);
+  Tcl_DecrRefCount(dirObj);
+}
+
+
+/*
+ * Table, log and MANIFEST files, which a checkpoint directory holds.
+ */
+static int LEVELDB_IsDBFile(const std::string& name)
+{
+  size_t digits = 0;
+
+  if( name.compare(0, 9, "MANIFEST-") == 0 ) {
+    return 1;
+  }
+  while( digits < name.size() && isdigit((unsigned char) name[digits]) ) {
+    digits++;
+  }
+
+  return digits > 0 && (name.compare(digits, std::string::npos, ".ldb") == 0 ||
+                        name.compare(digits, std::string::npos, ".sst") == 0 ||
+                        name.compare(digits, std::string::npos, ".log") == 0);
+}
+
+
+static std::string LEVELDB_FileError(const char *what, const std::string& path)
+{
+  return std::string("couldn't ") + what + " \"" + path + "\": " +
+         Tcl_ErrnoMsg(Tcl_GetErrno());
+}
+
+
+/*
+ * Make dir a checkpoint of the database. Tables that dir already holds
+ * from an earlier checkpoint are kept if they are links of the live
+ * ones, so only new tables are linked; files of the earlier checkpoint
+ * that are no longer live are removed. dir has to be empty or hold a
+ * checkpoint of this database, recognized by the LEVELDB_CHECKPOINT_MARKER
+ * file that holds the path of the database, so that files of anything
+ * else are never reused or deleted.
+ * Returns an error message, empty on success.
+ */
+static std::string LEVELDB_Checkpoint(LevelDBInfo *dbInfo, const std::string& dir,
+                                      Tcl_WideInt *tables, Tcl_WideInt *linked,
+                                      Tcl_WideInt *copied, Tcl_WideInt *nbytes)
+{
+  const std::string& src = dbInfo->shared->path;
+  leveldb::ReadOptions read_options;
+  leveldb::Iterator *it;
+  LevelManifest manifest;
+  std::set<std::string> keep;
+  std::vector<std::string> names;
+  std::string current, data, error;
+  std::set<uint64_t>::iterator t;
+  int tries, done = 0;
+  size_t i;
+  char name[64];
+
+  LEVELDB_ListDir(dir, &names, 1);
+  if( !names.empty() ) {
+    if( LEVELDB_ReadFile(dir + "/" + LEVELDB_CHECKPOINT_MARKER, &data) != TCL_OK ||
+        data != src + "\n" ) {
+      return "\"" + dir + "\" is not empty and not a checkpoint of this database";
+    }
+  } else if( LEVELDB_WriteFile(dir + "/" + LEVELDB_CHECKPOINT_MARKER, src + "\n") != TCL_OK ) {
+    return LEVELDB_FileError("write", dir + "/" + LEVELDB_CHECKPOINT_MARKER);
+  }
+
+  read_options.fill_cache = false;
+  it = dbInfo->db->NewIterator(read_options);
+
+  for(tries = 0; !done && error.empty() && tries < LEVELDB_CHECKPOINT_TRIES; tries++) {
+    int missing = 0;
+
+    keep.clear();
+    *tables = *linked = *copied = *nbytes = 0;
+
+    if( LEVELDB_ReadFile(src + "/CURRENT", &current) != TCL_OK ) {
+      error = LEVELDB_FileError("read", src + "/CURRENT");
+      break;
+    }
+    while( !current.empty() && isspace((unsigned char) current[current.size() - 1]) ) {
+      current.resize(current.size() - 1);
+    }
+    if( current.compare(0, 9, "MANIFEST-") != 0 || current.find('/') != std::string::npos ) {
+      error = "bad CURRENT file";
+      break;
+    }
+
+    /* a new MANIFEST may have replaced it */
+    if( LEVELDB_ReadFile(src + "/" + current, &data) != TCL_OK ) {
+      continue;
+    }
+    if( !LEVELDB_ParseManifest(data, &manifest) ) {
+      error = "cannot parse " + current;
+      break;
+    }
+
+    for(t = manifest.tables.begin(); t != manifest.tables.end() && error.empty(); ++t) {
+      Tcl_WideInt size;
+      int copy;
+
+      snprintf(name, sizeof(name), "%06llu.ldb", (unsigned long long) *t);
+      size = LEVELDB_FileSize(src + "/" + name);
+      if( size < 0 ) {
+        snprintf(name, sizeof(name), "%06llu.sst", (unsigned long long) *t);
+        size = LEVELDB_FileSize(src + "/" + name);
+      }
+      if( size < 0 ) {
+        missing = 1;
+        break;
+      }
+
+      keep.insert(name);
+      (*tables)++;
+      if( LEVELDB_SameFile(src + "/" + name, dir + "/" + name) ) {
+        continue;
+      }
+
+      if( LEVELDB_LinkFile(src + "/" + name, dir + "/" + name, &copy) != TCL_OK ) {
+        error = LEVELDB_FileError("link", src + "/" + name);
+      } else if( copy ) {
+        (*copied)++;
+        *nbytes += size;
+      } else {
+        (*linked)++;
+      }
+    }
+    if( missing || !error.empty() ) {
+      continue;
+    }
+
+    /*
+     * Logs are still written to, so they are copied. The log of the
+     * MANIFEST is gone if the memtable was written to a table since.
+     */
+    missing = manifest.log_number > 0;
+    LEVELDB_ListDir(src, &names, 0);
+    for(i = 0; i < names.size() && error.empty(); i++) {
+      uint64_t number = strtoull(names[i].c_str(), NULL, 10);
+
+      if( !LEVELDB_IsDBFile(names[i]) ||
+          names[i].compare(names[i].size() - 4, 4, ".log") != 0 ||
+          (number < manifest.log_number && number != manifest.prev_log_number) ) {
+        continue;
+      }
+
+      if( LEVELDB_CopyFile(src + "/" + names[i], dir + "/" + names[i]) != TCL_OK ) {
+        error = LEVELDB_FileError("copy", src + "/" + names[i]);
+        break;
+      }
+      keep.insert(names[i]);
+      (*copied)++;
+      *nbytes += LEVELDB_FileSize(dir + "/" + names[i]);
+      if( number == manifest.log_number ) {
+        missing = 0;
+      }
+    }
+    if( missing || !error.empty() ) {
+      continue;
+    }
+
+    /*
+     * CURRENT is replaced last, so an earlier checkpoint in dir stays
+     * usable until the new one is complete.
+     */
+    if( LEVELDB_WriteFile(dir + "/" + current, data) != TCL_OK ) {
+      error = LEVELDB_FileError("write", dir + "/" + current);
+    } else if( LEVELDB_WriteFile(dir + "/CURRENT.tmp", current + "\n") != TCL_OK ) {
+      error = LEVELDB_FileError("write", dir + "/CURRENT.tmp");
+    } else {
+      Tcl_Obj *tmpObj = LEVELDB_NewPathObj(dir + "/CURRENT.tmp");
+      Tcl_Obj *currentObj = LEVELDB_NewPathObj(dir + "/CURRENT");
+
+      if( Tcl_FSRenameFile(tmpObj, currentObj) != TCL_OK ) {
+        error = LEVELDB_FileError("rename", dir + "/CURRENT.tmp");
+      }
+      Tcl_DecrRefCount(tmpObj);
+      Tcl_DecrRefCount(currentObj);
+    }
+    keep.insert(current);
+    *copied += 2;
+    *nbytes += data.size() + current.size() + 1;
+    done = 1;
+  }
+
+  delete it;
+
+  if( error.empty() && !done ) {
+    error = "the database kept changing, try again";
+  }
+
+  if( error.empty() ) {
+    LEVELDB_ListDir(dir, &names, 0);
+    for(i = 0; i < names.size(); i++) {
+      if( LEVELDB_IsDBFile(names[i]) && !keep.count(names[i]) ) {
+        LEVELDB_DeleteFile(dir + "/" + names[i]);
+      }
+    }
+  }
+
+  return error;
+}
+
+
+/*
+ * A bloom filter built only from the first prefix_len bytes of each key.
+ * Keys shorter than prefix_len are used whole. The prefix length is part
+ * of the policy name, so that leveldb ignores filters written with a
+ * different length instead of returning false negatives.
+ */
+class PrefixBloomFilterPolicy : public leveldb::FilterPolicy {
+ public:
+  PrefixBloomFilterPolicy(int bits_per_key, size_t prefix_len)
+      : bloom_(leveldb::NewBloomFilterPolicy(bits_per_key)),
+        prefix_len_(prefix_len) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "tcl-leveldb.PrefixBloomFilter.%lu",
+             (unsigned long) prefix_len);
+    name_ = buf;
+  }
+
+  ~PrefixBloomFilterPolicy() {
+    delete bloom_;
+  }
+
+  const char* Name() const {
+    return name_.c_str();
+  }
+
+  void CreateFilter(const leveldb::Slice* keys, int n, std::string* dst) const {
+    leveldb::Slice *prefixes = new leveldb::Slice[n];
+
+    for(int i = 0; i < n; i++) {
+      prefixes[i] = Prefix(keys[i]);
+    }
+
+    bloom_->CreateFilter(prefixes, n, dst);
+    delete [] prefixes;
+  }
+
+  bool KeyMayMatch(const leveldb::Slice& key, const leveldb::Slice& filter) const {
+    return bloom_->KeyMayMatch(Prefix(key), filter);
+  }
+
+ private:
+  leveldb::Slice Prefix(const leveldb::Slice& key) const {
+    if(key.size() <= prefix_len_) {
+      return key;
+    }
+
+    return leveldb::Slice(key.data(), prefix_len_);
+  }
+
+  const leveldb::FilterPolicy *bloom_;
+  size_t prefix_len_;
+  std::string name_;
+};
+
+
+/*
+ * Comparators for -comparator. leveldb stores the name of the comparator
+ * and refuses to open a database with a different one.
+ *
+ * The numeric comparators read a decimal number at the start of the key
+ * ("1697500000000", "-12:temp", "2.5e3") and order keys by it. Keys with
+ * equal numbers are ordered by the rest of the key, then bytewise. Keys
+ * that do not start with a number sort first, bytewise among themselves.
+ */
+class ReverseBytewiseComparator : public leveldb::Comparator {
+ public:
+  const char* Name() const {
+    return "tcl-leveldb.ReverseBytewiseComparator";
+  }
+
+  int Compare(const leveldb::Slice& a, const leveldb::Slice& b) const {
+    return b.compare(a);
+  }
+
+  /*
+   * A key k with limit < k <= start bytewise: start up to and including
+   * the first byte that differs from limit.
+   */
+  void FindShortestSeparator(std::string* start, const leveldb::Slice& limit) const {
+    size_t i = 0;
+
+    while( i < start->size() && i < limit.size() && (*start)[i] == limit[i] ) {
+      i++;
+    }
+
+    if( i < start->size() && i + 1 < start->size() &&
+        (i == limit.size() || (unsigned char) (*start)[i] > (unsigned char) limit[i]) ) {
+      start->resize(i + 1);
+    }
+  }
+
+  void FindShortSuccessor(std::string* key) const {
+    if( key->size() > 1 ) {
+      key->resize(1);
+    }
+  }
+};
+
+
+enum LevelNumberKind {
+  LEVEL_NUMBER_INT64,
+  LEVEL_NUMBER_UINT64,
+  LEVEL_NUMBER_FLOAT64,
+};
+
+class NumberComparator : public leveldb::Comparator {
+ public:
+  NumberComparator(int kind) : kind_(kind) {}
+
+  const char* Name() const {
+    switch( kind_ ) {
+      case LEVEL_NUMBER_INT64: return "tcl-leveldb.Int64Comparator";
+      case LEVEL_NUMBER_UINT64: return "tcl-leveldb.UInt64Comparator";
+      default: return "tcl-leveldb.Float64Comparator";
+    }
+  }
+
+  int Compare(const leveldb::Slice& a, const leveldb::Slice& b) const {
+    Number x, y;
+    int r;
+
+    Parse(a, &x);
+    Parse(b, &y);
+
+    if( x.valid != y.valid ) {
+      return x.valid ? 1 : -1;
+    }
+
+    if( x.valid ) {
+      r = kind_ == LEVEL_NUMBER_FLOAT64 ? CompareFloat(x, y) : CompareDigits(x, y);
+      if( r != 0 ) {
+        return r;
+      }
+
+      r = leveldb::Slice(a.data() + x.len, a.size() - x.len).compare(
+          leveldb::Slice(b.data() + y.len, b.size() - y.len));
+      if( r != 0 ) {
+        return r;
+      }
+    }
+
+    return a.compare(b);
+  }
+
+  /*
+   * Replace start by the number with the fewest digits strictly between
+   * the numbers of start and limit, if that is shorter.
+   */
+  void FindShortestSeparator(std::string* start, const leveldb::Slice& limit) const {
+    Number x, y;
+    double a, b, p;
+    char buf[64];
+
+    Parse(*start, &x);
+    Parse(limit, &y);
+    if( !x.valid || !y.valid ) {
+      return;
+    }
+
+    if( kind_ == LEVEL_NUMBER_FLOAT64 ) {
+      a = x.value;
+      b = y.value;
+    } else {
+      /* Only numbers that are exact as a double are shortened. */
+      if( x.digits > 15 || y.digits > 15 ) {
+        return;
+      }
+      a = strtod(std::string(start->data(), x.len).c_str(), NULL);
+      b = strtod(std::string(limit.data(), y.len).c_str(), NULL);
+    }
+
+    if( !(a < b) || a <= -1e15 || b >= 1e15 ) {
+      return;
+    }
+
+    for(p = 1e15; p >= 1; p /= 10) {
+      double n = (floor(a / p) + 1) * p;
+
+      if( n < b ) {
+        snprintf(buf, sizeof(buf), "%.0f", n);
+        if( strlen(buf) < start->size() ) {
+          start->assign(buf);
+        }
+        return;
+      }
+    }
+  }
+
+  void FindShortSuccessor(std::string* key) const {
+  }
+
+ private:
+  typedef struct Number {
+    bool valid;
+    bool negative;
+    size_t len;                   /* bytes of the key used by the number */
+    const char *digits_start;     /* integer digits without leading zeros */
+    size_t digits;
+    double value;
+  } Number;
+
+  void Parse(const leveldb::Slice& key, Number *n) const {
+    const char *s = key.data();
+    size_t size = key.size();
+    size_t i = 0;
+
+    n->valid = false;
+    n->negative = false;
+    n->len = 0;
+    n->digits = 0;
+    n->value = 0;
+
+    if( kind_ == LEVEL_NUMBER_FLOAT64 ) {
+      char buf[64];
+      char *end;
+
+      /* strtod needs a terminated string; numbers are short. */
+      while( i < size && i < sizeof(buf) - 1 &&
+             (isdigit((unsigned char) s[i]) || strchr("+-.eE", s[i])) ) {
+        buf[i] = s[i];
+        i++;
+      }
+      buf[i] = '\0';
+
+      if( i == 0 || !(isdigit((unsigned char) buf[0]) || buf[0] == '-' ||
+                      buf[0] == '+' || buf[0] == '.') ) {
+        return;
+      }
+
+      n->value = strtod(buf, &end);
+      if( end == buf ) {
+        return;
+      }
+
+      n->len = end - buf;
+      n->valid = true;
+      return;
+    }
+
+    if( kind_ == LEVEL_NUMBER_INT64 && i < size && s[i] == '-' ) {
+      n->negative = true;
+      i++;
+    }
+
+    if( i >= size || !isdigit((unsigned char) s[i]) ) {
+      n->negative = false;
+      return;
+    }
+
+    while( i < size && s[i] == '0' ) {
+      i++;
+    }
+    n->digits_start = s + i;
+    while( i < size && isdigit((unsigned char) s[i]) ) {
+      i++;
+      n->digits++;
+    }
+
+    if( n->digits == 0 ) {
+      n->negative = false;
+    }
+
+    n->len = i;
+    n->valid = true;
+  }
+
+  /*
+   * Integers are compared by their digits, so no length limit applies.
+   */
+  static int CompareDigits(const Number& x, const Number& y) {
+    int r;
+
+    if( x.negative != y.negative ) {
+      return x.negative ? -1 : 1;
+    }
+
+    if( x.digits != y.digits ) {
+      r = x.digits < y.digits ? -1 : 1;
+    } else {
+      r = memcmp(x.digits_start, y.digits_start, x.digits);
+      r = r < 0 ? -1 : (r > 0 ? 1 : 0);
+    }
+
+    return x.negative ? -r : r;
+  }
+
+  static int CompareFloat(const Number& x, const Number& y) {
+    if( x.value < y.value ) return -1;
+    if( x.value > y.value ) return 1;
+    return 0;
+  }
+
+  int kind_;
+};
+
+
+/*
+ * Natural order: runs of digits are compared as numbers, other bytes
+ * bytewise, so "file9" sorts before "file10". All digit runs sort
+ * between the bytes below '0' and above '9'.
+ */
+class NaturalComparator : public leveldb::Comparator {
+ public:
+  const char* Name() const {
+    return "tcl-leveldb.NaturalComparator";
+  }
+
+  int Compare(const leveldb::Slice& a, const leveldb::Slice& b) const {
+    size_t i = 0, j = 0;
+
+    while( i < a.size() && j < b.size() ) {
+      unsigned char c = a[i], d = b[j];
+
+      if( isdigit(c) && isdigit(d) ) {
+        size_t si, sj, ni, nj;
+        int r;
+
+        while( i < a.size() && a[i] == '0' ) i++;
+        while( j < b.size() && b[j] == '0' ) j++;
+        si = i;
+        sj = j;
+        while( i < a.size() && isdigit((unsigned char) a[i]) ) i++;
+        while( j < b.size() && isdigit((unsigned char) b[j]) ) j++;
+        ni = i - si;
+        nj = j - sj;
+
+        if( ni != nj ) {
+          return ni < nj ? -1 : 1;
+        }
+        r = memcmp(a.data() + si, b.data() + sj, ni);
+        if( r != 0 ) {
+          return r < 0 ? -1 : 1;
+        }
+        continue;
+      }
+
+      if( c != d ) {
+        return c < d ? -1 : 1;
+      }
+      i++;
+      j++;
+    }
+
+    if( i < a.size() || j < b.size() ) {
+      return i < a.size() ? 1 : -1;
+    }
+
+    return a.compare(b);
+  }
+
+  /*
+   * Shorten only where start and limit differ in bytes that are not
+   * digits, as the bytewise comparator does.
+   */
+  void FindShortestSeparator(std::string* start, const leveldb::Slice& limit) const {
+    size_t i = 0;
+    unsigned char c;
+
+    while( i < start->size() && i < limit.size() && (*start)[i] == limit[i] ) {
+      i++;
+    }
+
+    if( i >= start->size() || i >= limit.size() || i + 1 >= start->size() ) {
+      return;
+    }
+
+    c = (unsigned char) (*start)[i] + 1;
+    if( isdigit((unsigned char) (*start)[i]) || isdigit((unsigned char) limit[i]) ||
+        isdigit(c) || c >= (unsigned char) limit[i] ) {
+      return;
+    }
+
+    (*start)[i] = (char) c;
+    start->resize(i + 1);
+  }
+
+  void FindShortSuccessor(std::string* key) const {
+  }
+};
+
+
+static const char *LevelComparatorNames[] = {
+  "bytewise",
+  "reverse",
+  "int64",
+  "uint64",
+  "float64",
+  "natural",
+  0
+};
+
+static const leveldb::Comparator *LEVELDB_GetComparator(int index)
+{
+  static ReverseBytewiseComparator reverse;
+  static NumberComparator int64(LEVEL_NUMBER_INT64);
+  static NumberComparator uint64(LEVEL_NUMBER_UINT64);
+  static NumberComparator float64(LEVEL_NUMBER_FLOAT64);
+  static NaturalComparator natural;
+
+  switch( index ) {
+    case 1: return &reverse;
+    case 2: return &int64;
+    case 3: return &uint64;
+    case 4: return &float64;
+    case 5: return &natural;
+    default: return leveldb::BytewiseComparator();
+  }
+}
+
+
+/*
+ * "leveldb tuple": order-preserving keys in the format of the
+ * FoundationDB tuple layer. Packed tuples compare bytewise in the order
+ * of their elements: bytes (0x01) and strings (0x02, as UTF-8) with 0x00
+ * escaped as 0x00 0xff and a 0x00 terminator, nested tuples (0x05 ...
+ * 0x00), integers (0x0c-0x1c, big endian with the length in the code,
+ * negative numbers in ones' complement) and doubles (0x21, IEEE bits
+ * with the sign bit or all bits flipped).
+ *
+ * The type of an element is given by -types (string, bytes, int, double,
+ * tuple, {tuple TYPES} or auto) or, for auto, taken from the value: a
+ * byte array without string representation is bytes, an integer or a
+ * double is int or double if it is written the way Tcl writes that
+ * number, and anything else is a string. So "007", "0x10", " 5" and
+ * "1e5" stay strings, and unpack returns what was packed.
+ */
+enum LevelTupleType {
+  LEVEL_TUPLE_AUTO,
+  LEVEL_TUPLE_STRING,
+  LEVEL_TUPLE_BYTES,
+  LEVEL_TUPLE_INT,
+  LEVEL_TUPLE_DOUBLE,
+  LEVEL_TUPLE_TUPLE,
+};
+
+static const char *LevelTupleTypeNames[] = {
+  "auto",
+  "string",
+  "bytes",
+  "int",
+  "double",
+  "tuple",
+  0
+};
+
+#define LEVEL_TUPLE_CODE_BYTES  0x01
+#define LEVEL_TUPLE_CODE_STRING 0x02
+#define LEVEL_TUPLE_CODE_NESTED 0x05
+#define LEVEL_TUPLE_CODE_INT    0x14      /* zero; +-1..8 bytes around it */
+#define LEVEL_TUPLE_CODE_DOUBLE 0x21
+
+static Tcl_Encoding LEVELDB_Utf8Encoding(void)
+{
+  static Tcl_Encoding utf8 = NULL;
+
+  Tcl_MutexLock(&myMutex);
+  if( !utf8 ) {
+    utf8 = Tcl_GetEncoding(NULL, "utf-8");
+  }
+  Tcl_MutexUnlock(&myMutex);
+
+  return utf8;
+}
+
+
+static void LEVELDB_TupleAppendEscaped(std::string *out, const char *data, size_t len)
+{
+  size_t i;
+
+  for(i = 0; i < len; i++) {
+    out->push_back(data[i]);
+    if( data[i] == '\0' ) {
+      out->push_back('\xff');
+    }
+  }
+  out->push_back('\0');
+}
+
+
+static void LEVELDB_TuplePackInt(std::string *out, Tcl_WideInt value)
+{
+  uint64_t magnitude;
+  int n = 0;
+  int i;
+
+  if( value == 0 ) {
+    out->push_back((char) LEVEL_TUPLE_CODE_INT);
+    return;
+  }
+
+  magnitude = value < 0 ? ~((uint64_t) value) + 1 : (uint64_t) value;
+  while( n < 8 && (magnitude >> (8 * n)) != 0 ) {
+    n++;
+  }
+
+  if( value < 0 ) {
+    out->push_back((char) (LEVEL_TUPLE_CODE_INT - n));
+    magnitude = ~magnitude;
+  } else {
+    out->push_back((char) (LEVEL_TUPLE_CODE_INT + n));
+  }
+
+  for(i = n - 1; i >= 0; i--) {
+    out->push_back((char) ((magnitude >> (8 * i)) & 0xff));
+  }
+}
+
+
+static void LEVELDB_TuplePackDouble(std::string *out, double value)
+{
+  uint64_t bits;
+  int i;
+
+  memcpy(&bits, &value, sizeof(bits));
+  if( bits >> 63 ) {
+    bits = ~bits;
+  } else {
+    bits ^= (uint64_t) 1 << 63;
+  }
+
+  out->push_back((char) LEVEL_TUPLE_CODE_DOUBLE);
+  for(i = 7; i >= 0; i--) {
+    out->push_back((char) ((bits >> (8 * i)) & 0xff));
+  }
+}
+
+
+static int LEVELDB_TuplePack(Tcl_Interp *interp, std::string *out, Tcl_Obj *listObj,
+                             Tcl_Obj *typesObj, int nested);
+
+/*
+ * Whether elemObj is written as canonObj, the number it parses to.
+ * canonObj is freed.
+ */
+static int LEVELDB_TupleIsCanonical(Tcl_Obj *elemObj, Tcl_Obj *canonObj)
+{
+  int same;
+
+  Tcl_IncrRefCount(canonObj);
+  same = strcmp(Tcl_GetString(elemObj), Tcl_GetString(canonObj)) == 0;
+  Tcl_DecrRefCount(canonObj);
+
+  return same;
+}
+
+static int LEVELDB_TuplePackElement(Tcl_Interp *interp, std::string *out,
+                                    Tcl_Obj *elemObj, Tcl_Obj *typeObj)
+{
+  static const Tcl_ObjType *byteArrayType = NULL;
+  Tcl_Obj *nestedTypesObj = NULL;
+  Tcl_WideInt wide;
+  double number;
+  int type = LEVEL_TUPLE_AUTO;
+
+  if( typeObj ) {
+    Tcl_Size count;
+    Tcl_Obj **words;
+
+    if( Tcl_ListObjGetElements(interp, typeObj, &count, &words) != TCL_OK ) {
+      return TCL_ERROR;
+    }
+    if( count == 2 && strcmp(Tcl_GetString(words[0]), "tuple") == 0 ) {
+      type = LEVEL_TUPLE_TUPLE;
+      nestedTypesObj = words[1];
+    } else if( count != 1 ) {
+      Tcl_AppendResult(interp, "Error: bad tuple type ", Tcl_GetString(typeObj), (char*)0);
+      return TCL_ERROR;
+    } else if( Tcl_GetIndexFromObj(interp, words[0], LevelTupleTypeNames, "type", 0, &type) ) {
+      return TCL_ERROR;
+    }
+  }
+
+  if( type == LEVEL_TUPLE_AUTO ) {
+    if( !byteArrayType ) {
+      byteArrayType = Tcl_GetObjType("bytearray");
+    }
+
+    if( elemObj->typePtr == byteArrayType && elemObj->bytes == NULL ) {
+      type = LEVEL_TUPLE_BYTES;
+    } else if( Tcl_GetWideIntFromObj(NULL, elemObj, &wide) == TCL_OK &&
+               LEVELDB_TupleIsCanonical(elemObj, Tcl_NewWideIntObj(wide)) ) {
+      type = LEVEL_TUPLE_INT;
+    } else if( Tcl_GetDoubleFromObj(NULL, elemObj, &number) == TCL_OK &&
+               strpbrk(Tcl_GetString(elemObj), "0123456789") &&
+               LEVELDB_TupleIsCanonical(elemObj, Tcl_NewDoubleObj(number)) ) {
+      type = LEVEL_TUPLE_DOUBLE;
+    } else {
+      type = LEVEL_TUPLE_STRING;
+    }
+  }
+
+  switch( type ) {
+    case LEVEL_TUPLE_STRING: {
+      Tcl_Size len;
+      const char *str = Tcl_GetStringFromObj(elemObj, &len);
+      Tcl_Size i;
+
+      out->push_back((char) LEVEL_TUPLE_CODE_STRING);
+
+      /*
+       * Tcl strings are UTF-8 except for U+0000, which is stored as
+       * 0xc0 0x80; ASCII needs no conversion.
+       */
+      for(i = 0; i < len && !(str[i] & 0x80); i++) {
+      }
+      if( i == len ) {
+        LEVELDB_TupleAppendEscaped(out, str, len);
+      } else {
+        Tcl_DString ds;
+
+        Tcl_UtfToExternalDString(LEVELDB_Utf8Encoding(), str, len, &ds);
+        LEVELDB_TupleAppendEscaped(out, Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
+        Tcl_DStringFree(&ds);
+      }
+      break;
+    }
+
+    case LEVEL_TUPLE_BYTES: {
+      Tcl_Size len;
+      const char *bytes = (const char *) Tcl_GetByteArrayFromObj(elemObj, &len);
+
+      out->push_back((char) LEVEL_TUPLE_CODE_BYTES);
+      LEVELDB_TupleAppendEscaped(out, bytes, len);
+      break;
+    }
+
+    case LEVEL_TUPLE_INT:
+      if( Tcl_GetWideIntFromObj(interp, elemObj, &wide) != TCL_OK ) {
+        return TCL_ERROR;
+      }
+      LEVELDB_TuplePackInt(out, wide);
+      break;
+
+    case LEVEL_TUPLE_DOUBLE:
+      if( Tcl_GetDoubleFromObj(interp, elemObj, &number) != TCL_OK ) {
+        return TCL_ERROR;
+      }
+      LEVELDB_TuplePackDouble(out, number);
+      break;
+
+    case LEVEL_TUPLE_TUPLE:
+      out->push_back((char) LEVEL_TUPLE_CODE_NESTED);
+      if( LEVELDB_TuplePack(interp, out, elemObj, nestedTypesObj, 1) != TCL_OK ) {
+        return TCL_ERROR;
+      }
+      out->push_back('\0');
+      break;
+  }
+
+  return TCL_OK;
+}
+
+
+static int LEVELDB_TuplePack(Tcl_Interp *interp, std::string *out, Tcl_Obj *listObj,
+                             Tcl_Obj *typesObj, int nested)
+{
+  Tcl_Size count;
+  Tcl_Size type_count = 0;
+  Tcl_Obj **elems;
+  Tcl_Obj **types = NULL;
+  Tcl_Size i;
+
+  if( Tcl_ListObjGetElements(interp, listObj, &count, &elems) != TCL_OK ) {
+    return TCL_ERROR;
+  }
+
+  if( typesObj ) {
+    if( Tcl_ListObjGetElements(interp, typesObj, &type_count, &types) != TCL_OK ) {
+      return TCL_ERROR;
+    }
+    if( type_count != count ) {
+      Tcl_AppendResult(interp, "Error: -types needs one type for each element ", (char*)0);
+      return TCL_ERROR;
+    }
+  }
+
+  for(i = 0; i < count; i++) {
+    if( LEVELDB_TuplePackElement(interp, out, elems[i], types ? types[i] : NULL) != TCL_OK ) {
+      return TCL_ERROR;
+    }
+  }
+
+  return TCL_OK;
+}
+
+
+/*
+ * Decode the escaped bytes at *pos up to the 0x00 terminator.
+ */
+static bool LEVELDB_TupleUnescape(const std::string& in, size_t *pos, std::string *out)
+{
+  size_t i = *pos;
+
+  out->clear();
+  while( i < in.size() ) {
+    if( in[i] == '\0' ) {
+      if( i + 1 < in.size() && in[i + 1] == '\xff' ) {
+        out->push_back('\0');
+        i += 2;
+        continue;
+      }
+      *pos = i + 1;
+      return true;
+    }
+    out->push_back(in[i++]);
+  }
+
+  return false;
+}
+
+
+/*
+ * Decode a tuple, or a nested tuple up to its 0x00 terminator. Returns
+ * NULL for bytes that are not a packed tuple.
+ */
+static Tcl_Obj *LEVELDB_TupleUnpack(const std::string& in, size_t *pos, int nested)
+{
+  Tcl_Obj *listObj = Tcl_NewListObj(0, NULL);
+  std::string data;
+  bool ok = true;
+
+  while( ok && *pos < in.size() ) {
+    int code = (unsigned char) in[*pos];
+    Tcl_Obj *elemObj = NULL;
+
+    if( nested && code == 0 ) {
+      break;
+    }
+    (*pos)++;
+
+    if( code == LEVEL_TUPLE_CODE_BYTES || code == LEVEL_TUPLE_CODE_STRING ) {
+      if( !LEVELDB_TupleUnescape(in, pos, &data) ) {
+        ok = false;
+      } else if( code == LEVEL_TUPLE_CODE_BYTES ) {
+        elemObj = Tcl_NewByteArrayObj((const unsigned char *) data.data(), data.size());
+      } else {
+        Tcl_DString ds;
+
+        Tcl_ExternalToUtfDString(LEVELDB_Utf8Encoding(), data.data(), data.size(), &ds);
+        elemObj = Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
+        Tcl_DStringFree(&ds);
+      }
+    } else if( code == LEVEL_TUPLE_CODE_NESTED ) {
+      elemObj = LEVELDB_TupleUnpack(in, pos, 1);
+      if( elemObj ) {
+        (*pos)++;
+      } else {
+        ok = false;
+      }
+    } else if( code >= LEVEL_TUPLE_CODE_INT - 8 && code <= LEVEL_TUPLE_CODE_INT + 8 ) {
+      int n = code > LEVEL_TUPLE_CODE_INT ? code - LEVEL_TUPLE_CODE_INT : LEVEL_TUPLE_CODE_INT - code;
+      uint64_t magnitude = 0;
+      int i;
+
+      if( *pos + n > in.size() ) {
+        ok = false;
+        break;
+      }
+      for(i = 0; i < n; i++) {
+        magnitude = (magnitude << 8) | (unsigned char) in[*pos + i];
+      }
+      *pos += n;
+
+      /*
+       * Other tuple layers pack integers beyond 64 bits signed, which
+       * pack never writes; they are not taken as a wrapped value.
+       */
+      if( code < LEVEL_TUPLE_CODE_INT ) {
+        magnitude = ~magnitude;
+        if( n < 8 ) {
+          magnitude &= ((uint64_t) 1 << (8 * n)) - 1;
+        }
+        if( magnitude > (uint64_t) 1 << 63 ) {
+          ok = false;
+          break;
+        }
+        elemObj = Tcl_NewWideIntObj((Tcl_WideInt) (~magnitude + 1));
+      } else {
+        if( magnitude >= (uint64_t) 1 << 63 ) {
+          ok = false;
+          break;
+        }
+        elemObj = Tcl_NewWideIntObj((Tcl_WideInt) magnitude);
+      }
+    } else if( code == LEVEL_TUPLE_CODE_DOUBLE ) {
+      uint64_t bits = 0;
+      double value;
+      int i;
+
+      if( *pos + 8 > in.size() ) {
+        ok = false;
+        break;
+      }
+      for(i = 0; i < 8; i++) {
+        bits = (bits << 8) | (unsigned char) in[*pos + i];
+      }
+      *pos += 8;
+
+      if( bits >> 63 ) {
+        bits ^= (uint64_t) 1 << 63;
+      } else {
+        bits = ~bits;
+      }
+      memcpy(&value, &bits, sizeof(value));
+      elemObj = Tcl_NewDoubleObj(value);
+    } else {
+      ok = false;
+    }
+
+    if( elemObj ) {
+      Tcl_ListObjAppendElement(NULL, listObj, elemObj);
+    }
+  }
+
+  if( !ok || (nested && *pos >= in.size()) ) {
+    Tcl_DecrRefCount(listObj);
+    return NULL;
+  }
+
+  return listObj;
+}
+
+
+void LEVELDB_Thread_Exit(ClientData clientdata)
+{
+  ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
+      Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+
+  if(tsdPtr->leveldb_hashtblPtr) {
+    Tcl_DeleteHashTable(tsdPtr->leveldb_hashtblPtr);
+    ckfree(tsdPtr->leveldb_hashtblPtr);
+  }
+}
+
+
+static int LEVELDB_CACHE(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv){
+  int choice;
+  LevelCacheInfo *cacheInfo = (LevelCacheInfo *) cd;
+
+  static const char *CACHE_strs[] = {
+    "stats",
+    "close",
+    0
+  };
+
+  enum CACHE_enum {
+    CACHE_STATS,
+    CACHE_CLOSE,
+  };
+
+  if( objc < 2 ){
+    Tcl_WrongNumArgs(interp, 1, objv, "SUBCOMMAND ...");
+    return TCL_ERROR;
+  }
+
+  if( Tcl_GetIndexFromObj(interp, objv[1], CACHE_strs, "option", 0, &choice) ){
+    return TCL_ERROR;
+  }
+
+  switch( (enum CACHE_enum)choice ){
+
+    case CACHE_STATS: {
+      Tcl_Obj *pResultStr = NULL;
+
+      if( objc != 2 ){
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+
+      pResultStr = Tcl_NewListObj(0, NULL);
+      Tcl_ListObjAppendElement(interp, pResultStr, Tcl_NewStringObj("capacity", -1));
+      Tcl_ListObjAppendElement(interp, pResultStr,
+                               Tcl_NewWideIntObj(cacheInfo->capacity));
+      Tcl_ListObjAppendElement(interp, pResultStr, Tcl_NewStringObj("usage", -1));
+      Tcl_ListObjAppendElement(interp, pResultStr,
+                               Tcl_NewWideIntObj((Tcl_WideInt) cacheInfo->cache->TotalCharge()));
+
+      Tcl_SetObjResult(interp, pResultStr);
+
+      break;
+    }
+
+    case CACHE_CLOSE: {
+      if( objc != 2 ){
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+
+      Tcl_DeleteCommandFromToken(interp, cacheInfo->handle->token);
+      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+
+      break;
+    }
+  }
+
+  return TCL_OK;
+}
+
+
+static int LEVELDB_SST(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv){
+  int choice;
+  LevelSstInfo *sstInfo = (LevelSstInfo *) cd;
+
+  static const char *SST_strs[] = {
+    "close",
+    0
+  };
+
+  enum SST_enum {
+    SST_CLOSE,
+  };
+
+  if( objc < 2 ){
+    Tcl_WrongNumArgs(interp, 1, objv, "SUBCOMMAND ...");
+    return TCL_ERROR;
+  }
+
+  if( Tcl_GetIndexFromObj(interp, objv[1], SST_strs, "option", 0, &choice) ){
+    return TCL_ERROR;
+  }
+
+  switch( (enum SST_enum)choice ){
+
+    case SST_CLOSE: {
+      LevelDBInfo *dbInfo = NULL;
+      char *zArg;
+      int i = 0;
+
+      if( objc != 4 ){
+        Tcl_WrongNumArgs(interp, 2, objv, "-db DB_HANDLE ");
+        return TCL_ERROR;
+      }
+
+      for(i=2; i+1<objc; i+=2){
+        zArg = Tcl_GetStringFromObj(objv[i], 0);
+
+        if( strcmp(zArg, "-db")==0 ){
+            dbInfo = (LevelDBInfo *) LEVELDB_GetHandleFromObj(interp, objv[i+1], LEVEL_HANDLE_DBI);
+            if( !dbInfo ) {
+                return TCL_ERROR;
+            }
+        } else{
+           Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
+           return TCL_ERROR;
+        }
+      }
+
+      /*
+       * The snapshot is released through the database it was taken from.
+       */
+      if( dbInfo != sstInfo->dbInfo ) {
+        Tcl_AppendResult(interp, "Error: snapshot does not belong to this db", (char*)0);
+        return TCL_ERROR;
+      }
+
+      Tcl_DeleteCommandFromToken(interp, sstInfo->handle->token);
+      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+
+      break;
+    }
+  }
+
+  return TCL_OK;
+}
+
+
+static int LEVELDB_BAT(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv){
+  int choice;
+  LevelBatInfo *batInfo = (LevelBatInfo *) cd;
+  leveldb::WriteBatch* batch = batInfo->batch;
+
+  static const char *BAT_strs[] = {
+    "put",
+    "delete",
+    "clear",
+    "count",
+    "size",
+    "append",
+    "close",
+    0
+  };
+
+  enum BAT_enum {
+    BAT_PUT,
+    BAT_DELETE,
+    BAT_CLEAR,
+    BAT_COUNT,
+    BAT_SIZE,
+    BAT_APPEND,
+    BAT_CLOSE,
+  };
+
+  if( objc < 2 ){
+    Tcl_WrongNumArgs(interp, 1, objv, "SUBCOMMAND ...");
+    return TCL_ERROR;
+  }
+
+  if( Tcl_GetIndexFromObj(interp, objv[1], BAT_strs, "option", 0, &choice) ){
+    return TCL_ERROR;
+  }
+
+  LEVELDB_STAT_BEGIN(t0);
+
+  switch( (enum BAT_enum)choice ){
+
+    case BAT_PUT: {
+      const char *key = NULL;
+      const char *data = NULL;
+      Tcl_Size key_len = 0;
+      Tcl_Size data_len = 0;
+      leveldb::Slice key2;
+      leveldb::Slice value2;
+
+      if( objc != 4 ) {
+        Tcl_WrongNumArgs(interp, 2, objv, "key data ");
+        return TCL_ERROR;
+      }
+
+      key = LEVELDB_GetBytesFromObj(interp, objv[2], &key_len, batInfo->binary);
+      if( !key || key_len < 1 ){
+         Tcl_AppendResult(interp, "Error: key is an empty key ", (char*)0);
+         return TCL_ERROR;
+      }
+
+      data = LEVELDB_GetBytesFromObj(interp, objv[3], &data_len, batInfo->binary);
+      if( !data || data_len < 1 ){
+         Tcl_AppendResult(interp, "Error: data is an empty value ", (char*)0);
+         return TCL_ERROR;
+      }
+
+      key2 = leveldb::Slice(key, key_len);
+      value2 = leveldb::Slice(data, data_len);
+      batch->Put(key2, value2);
+      batInfo->count++;
+
+      if( LEVELDB_BatchAutoflush(interp, batInfo) != TCL_OK ) {
+        return TCL_ERROR;
+      }
+
+      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      LEVELDB_STAT_END(batInfo->stats, LEVEL_STAT_BATCH, t0, key_len + data_len);
+
+      break;
+    }
+
+    case BAT_DELETE: {
+      const char *key = NULL;
+      Tcl_Size key_len = 0;
+      leveldb::Slice key2;
+
+      if( objc  !=  3 ) {
+        Tcl_WrongNumArgs(interp, 2, objv, "key ");
+        return TCL_ERROR;
+      }
+
+      key = LEVELDB_GetBytesFromObj(interp, objv[2], &key_len, batInfo->binary);
+      if( !key || key_len < 1 ){
+         Tcl_AppendResult(interp, "Error: key is an empty key ", (char*)0);
+         return TCL_ERROR;
+      }
+
+      key2 = leveldb::Slice(key, key_len);
+      batch->Delete(key2);
+      batInfo->count++;
+
+      if( LEVELDB_BatchAutoflush(interp, batInfo) != TCL_OK ) {
+        return TCL_ERROR;
+      }
+
+      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      LEVELDB_STAT_END(batInfo->stats, LEVEL_STAT_BATCH, t0, key_len);
+
+      break;
+    }
+
+    case BAT_CLEAR: {
+      if( objc != 2 ){
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+
+      batch->Clear();
+      batInfo->count = 0;
+      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+
+      break;
+    }
+
+    case BAT_COUNT: {
+      if( objc != 2 ){
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+
+      Tcl_SetObjResult(interp, Tcl_NewIntObj( batInfo->count ));
+
+      break;
+    }
+
+    case BAT_SIZE: {
+      if( objc != 2 ){
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+
+      Tcl_SetObjResult(interp, Tcl_NewWideIntObj( (Tcl_WideInt) batch->ApproximateSize() ));
+
+      break;
+    }
+
+    case BAT_APPEND: {
+      LevelBatInfo *otherInfo;
+
+      if( objc != 3 ){
+        Tcl_WrongNumArgs(interp, 2, objv, "BAT_HANDLE ");
+        return TCL_ERROR;
+      }
+
+      otherInfo = (LevelBatInfo *) LEVELDB_GetHandleFromObj(interp, objv[2], LEVEL_HANDLE_BAT);
+      if( !otherInfo ) {
+        return TCL_ERROR;
+      }
+
+      if( otherInfo == batInfo ) {
+        Tcl_AppendResult(interp, "Error: cannot append a batch to itself", (char*)0);
+        return TCL_ERROR;
+      }
+
+      batch->Append(*otherInfo->batch);
+      batInfo->count += otherInfo->count;
+
+      if( LEVELDB_BatchAutoflush(interp, batInfo) != TCL_OK ) {
+        return TCL_ERROR;
+      }
+
+      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      LEVELDB_STAT_END(batInfo->stats, LEVEL_STAT_BATCH, t0,
+                       otherInfo->batch->ApproximateSize());
+
+      break;
+    }
+
+    case BAT_CLOSE: {
+      if( objc != 2 ){
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+
+      Tcl_DeleteCommandFromToken(interp, batInfo->handle->token);
+      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+
+      break;
+    }
+  }
+
+  return TCL_OK;
+}
+
+
+static int LEVELDB_ITR(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv){
+  int choice;
+  LevelItrInfo *itInfo = (LevelItrInfo *) cd;
+  leveldb::Iterator* it = itInfo->it;
+
+  static const char *ITR_strs[] = {
+    "seektofirst",
+    "seektolast",
+    "seek",
+    "valid",
+    "next",
+    "prev",
+    "key",
+    "value",
+    "close",
+    0
+  };
+
+  enum ITR_enum {
+    ITR_SEEKTOFIRST,
     ITR_SEEKTOLAST,
     ITR_SEEK,
     ITR_VALID,
@@ -350,396 +5049,1257 @@ static int LEVELDB_ITR(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*obj
     ITR_CLOSE,
   };
 
-  if( objc < 2 ){
-    Tcl_WrongNumArgs(interp, 1, objv, "SUBCOMMAND ...");
-    return TCL_ERROR;
-  }
+  if( objc < 2 ){
+    Tcl_WrongNumArgs(interp, 1, objv, "SUBCOMMAND ...");
+    return TCL_ERROR;
+  }
+
+  if( Tcl_GetIndexFromObj(interp, objv[1], ITR_strs, "option", 0, &choice) ){
+    return TCL_ERROR;
+  }
+
+  LEVELDB_STAT_BEGIN(t0);
+
+  switch( (enum ITR_enum)choice ){
+
+    case ITR_SEEKTOFIRST: {
+      if( objc != 2 ){
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+
+      it->SeekToFirst();
+      if(!it->status().ok()) {
+        Tcl_AppendResult(interp, "Error: seektofirst failed", (char*)0);
+        return TCL_ERROR;
+      }
+
+      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      LEVELDB_STAT_END(itInfo->dbInfo->stats, LEVEL_STAT_ITERATOR, t0, 0);
+
+      break;
+    }
+
+    case ITR_SEEKTOLAST: {
+      if( objc != 2 ){
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+
+      it->SeekToLast();
+      if(!it->status().ok()) {
+        Tcl_AppendResult(interp, "Error: seektolast failed", (char*)0);
+        return TCL_ERROR;
+      }
+
+      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      LEVELDB_STAT_END(itInfo->dbInfo->stats, LEVEL_STAT_ITERATOR, t0, 0);
+
+      break;
+    }
+
+    case ITR_SEEK: {
+      const char *key = NULL;
+      Tcl_Size len = 0;
+      leveldb::Slice slice;
+
+      if( objc != 3 ){
+        Tcl_WrongNumArgs(interp, 2, objv, "key ");
+        return TCL_ERROR;
+      }
+
+      key = LEVELDB_GetBytesFromObj(interp, objv[2], &len, itInfo->binary);
+      if(!key || len < 0) {
+        Tcl_AppendResult(interp, "Error: key is empty", (char*)0);
+        return TCL_ERROR;
+      }
+
+      slice = leveldb::Slice(key, len);
+      it->Seek(slice);
+      if(!it->status().ok()) {
+        Tcl_AppendResult(interp, "Error: seek failed", (char*)0);
+        return TCL_ERROR;
+      }
+
+      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      LEVELDB_STAT_END(itInfo->dbInfo->stats, LEVEL_STAT_ITERATOR, t0, len);
+
+      break;
+    }
+
+    case ITR_VALID: {
+      bool isValid;
+
+      if( objc != 2 ){
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+
+      isValid = it->Valid();
+      if(!it->status().ok()) {
+        Tcl_AppendResult(interp, "Error: valid failed", (char*)0);
+        return TCL_ERROR;
+      }
+
+      if( isValid ) {
+          Tcl_SetObjResult(interp, Tcl_NewBooleanObj( 1 ));
+      } else {
+          Tcl_SetObjResult(interp, Tcl_NewBooleanObj( 0 ));
+      }
+
+      break;
+    }
+
+    case ITR_NEXT: {
+      if( objc != 2 ){
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+
+      it->Next();
+      if(!it->status().ok()) {
+        Tcl_AppendResult(interp, "Error: next failed", (char*)0);
+        return TCL_ERROR;
+      }
+
+      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      LEVELDB_STAT_END(itInfo->dbInfo->stats, LEVEL_STAT_ITERATOR, t0, 0);
+
+      break;
+    }
+
+    case ITR_PREV: {
+      if( objc != 2 ){
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+
+      it->Prev();
+      if(!it->status().ok()) {
+        Tcl_AppendResult(interp, "Error: prev failed", (char*)0);
+        return TCL_ERROR;
+      }
+
+      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      LEVELDB_STAT_END(itInfo->dbInfo->stats, LEVEL_STAT_ITERATOR, t0, 0);
+
+      break;
+    }
+
+    case ITR_KEY: {
+      std::string key2;
+      Tcl_Obj *pResultStr = NULL;
+
+      if( objc != 2 ){
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+
+      key2 = it->key().ToString();
+      if(!it->status().ok()) {
+        Tcl_AppendResult(interp, "Error: key failed", (char*)0);
+        return TCL_ERROR;
+      }
+
+      pResultStr = LEVELDB_NewBytesObj(key2.c_str(), key2.length(), itInfo->binary);
+      Tcl_SetObjResult(interp, pResultStr);
+
+      break;
+    }
+
+    case ITR_VALUE: {
+      std::string value2;
+      Tcl_Obj *pResultStr = NULL;
+
+      if( objc != 2 ){
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+
+      value2 = it->value().ToString();
+      if(!it->status().ok()) {
+        Tcl_AppendResult(interp, "Error: value failed", (char*)0);
+        return TCL_ERROR;
+      }
+
+      pResultStr = LEVELDB_NewValueObj(&value2, itInfo->binary);
+      Tcl_SetObjResult(interp, pResultStr);
+
+      break;
+    }
+
+    case ITR_CLOSE: {
+      if( objc != 2 ){
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        return TCL_ERROR;
+      }
+
+      Tcl_DeleteCommandFromToken(interp, itInfo->handle->token);
+      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+
+      break;
+    }
+  }
+
+  return TCL_OK;
+}
+
+static int LEVELDB_DBI(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv){
+  int choice;
+  LevelDBInfo *dbInfo = (LevelDBInfo *) cd;
+  leveldb::DB* db;
+  int binary;
+
+  static const char *DBI_strs[] = {
+    "get",
+    "put",
+    "delete",
+    "write",
+    "batch",
+    "iterator",
+    "snapshot",
+    "getApproximateSizes",
+    "getProperty",
+    "mget",
+    "scan",
+    "foreach",
+    "mput",
+    "mdelete",
+    "compact",
+    "splits",
+    "stats",
+    "properties",
+    "load",
+    "dump",
+    "checkpoint",
+    "iostats",
+    "close",
+    0
+  };
+
+  enum DBI_enum {
+    DBI_GET,
+    DBI_PUT,
+    DBI_DELETE,
+    DBI_WRITE,
+    DBI_BATCH,
+    DBI_ITERATOR,
+    DBI_SNAPSHOT,
+    DBI_GETAPPROXIMATESIZES,
+    DBI_GETPROPERTY,
+    DBI_MGET,
+    DBI_SCAN,
+    DBI_FOREACH,
+    DBI_MPUT,
+    DBI_MDELETE,
+    DBI_COMPACT,
+    DBI_SPLITS,
+    DBI_STATS,
+    DBI_PROPERTIES,
+    DBI_LOAD,
+    DBI_DUMP,
+    DBI_CHECKPOINT,
+    DBI_IOSTATS,
+    DBI_CLOSE,
+  };
+
+  if( objc < 2 ){
+    Tcl_WrongNumArgs(interp, 1, objv, "SUBCOMMAND ...");
+    return TCL_ERROR;
+  }
+
+  if( Tcl_GetIndexFromObj(interp, objv[1], DBI_strs, "option", 0, &choice) ){
+    return TCL_ERROR;
+  }
+
+  LEVELDB_STAT_BEGIN(t0);
+  db = dbInfo->db;
+  binary = dbInfo->binary;
+
+  switch( (enum DBI_enum)choice ){
+
+    case DBI_GET: {
+      leveldb::ReadOptions read_options;
+      leveldb::Status status;
+      const char *key = NULL;
+      Tcl_Size key_len = 0;
+      leveldb::Slice key2;
+      std::string value2;
+      char *zArg;
+      int i = 0;
+      Tcl_Obj *pResultStr = NULL;
+      const leveldb::Snapshot* shot = NULL;
+      Tcl_Obj *sstObj = NULL;
+      Tcl_Obj *asyncObj = NULL;
+
+      if( objc < 3 || (objc&1)!=1) {
+        Tcl_WrongNumArgs(interp, 2, objv,
+          "key ?-fillCache BOOLEAN? ?-snapshot HANDLE? ?-encoding TYPE? ?-async CALLBACK? ");
+        return TCL_ERROR;
+      }
+
+      for(i=3; i+1<objc; i+=2){
+        zArg = Tcl_GetStringFromObj(objv[i], 0);
+
+        if( strcmp(zArg, "-fillCache")==0 ){
+            int b;
+            if( Tcl_GetBooleanFromObj(interp, objv[i+1], &b) ) return TCL_ERROR;
+            if( b ){
+              read_options.fill_cache = true;
+            }else{
+              read_options.fill_cache = false;
+            }
+        } else if( strcmp(zArg, "-snapshot")==0 ){
+            sstObj = objv[i+1];
+        } else if( strcmp(zArg, "-encoding")==0 ){
+            if( LEVELDB_GetEncodingFromObj(interp, objv[i+1], &binary) ) return TCL_ERROR;
+        } else if( strcmp(zArg, "-async")==0 ){
+            asyncObj = objv[i+1];
+        } else{
+           Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
+           return TCL_ERROR;
+        }
+      }
+
+      key = LEVELDB_GetBytesFromObj(interp, objv[2], &key_len, binary);
+      if( !key || key_len < 1 ){
+         Tcl_AppendResult(interp, "Error: key is an empty key ", (char*)0);
+         return TCL_ERROR;
+      }
+
+      /*
+       * A snapshot could be closed before the worker reads it, so
+       * -snapshot is not supported with -async.
+       */
+      if(asyncObj) {
+          LevelAsyncJob *job;
+
+          if(sstObj) {
+            Tcl_AppendResult(interp, "Error: -snapshot cannot be used with -async", (char*)0);
+            return TCL_ERROR;
+          }
+
+          job = new LevelAsyncJob;
+          job->op = LEVEL_ASYNC_GET;
+          job->read_options = read_options;
+          job->key.assign(key, key_len);
+          job->binary = binary;
+
+          return LEVELDB_AsyncSubmit(interp, dbInfo, job, asyncObj);
+      }
+
+      if(sstObj) {
+          shot = LEVELDB_GetSnapshotFromObj(interp, sstObj, dbInfo);
+          if( !shot ) {
+            return TCL_ERROR;
+          }
+
+          read_options.snapshot = shot;
+      }
+
+      key2 = leveldb::Slice(key, key_len);
+
+      status = db->Get(read_options, key2, &value2);
+      if(!status.ok()) {
+        Tcl_AppendResult(interp, "Error: get failed", (char*)0);
+        return TCL_ERROR;
+      }
+
+      LEVELDB_STAT_END(dbInfo->stats, LEVEL_STAT_GET, t0, key_len + value2.length());
+      pResultStr = LEVELDB_NewValueObj(&value2, binary);
+      Tcl_SetObjResult(interp, pResultStr);
+
+      break;
+    }
+
+    case DBI_PUT: {
+      leveldb::Status status;
+      leveldb::WriteOptions write_options;
+      leveldb::WriteBatch batch;
+      const char *key = NULL;
+      const char *data = NULL;
+      Tcl_Size key_len = 0;
+      Tcl_Size data_len = 0;
+      leveldb::Slice key2;
+      leveldb::Slice value2;
+      Tcl_Obj *asyncObj = NULL;
+      char *zArg;
+      int i = 0;
+
+      if( objc < 4 || (objc&1)!=0) {
+        Tcl_WrongNumArgs(interp, 2, objv,
+          "key data ?-sync BOOLEAN? ?-encoding TYPE? ?-async CALLBACK? ");
+        return TCL_ERROR;
+      }
+
+      for(i=4; i+1<objc; i+=2){
+        zArg = Tcl_GetStringFromObj(objv[i], 0);
+
+        if( strcmp(zArg, "-sync")==0 ){
+            int b;
+            if( Tcl_GetBooleanFromObj(interp, objv[i+1], &b) ) return TCL_ERROR;
+            if( b ){
+              write_options.sync = true;
+            }else{
+              write_options.sync = false;
+            }
+        } else if( strcmp(zArg, "-encoding")==0 ){
+            if( LEVELDB_GetEncodingFromObj(interp, objv[i+1], &binary) ) return TCL_ERROR;
+        } else if( strcmp(zArg, "-async")==0 ){
+            asyncObj = objv[i+1];
+        } else{
+           Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
+           return TCL_ERROR;
+        }
+      }
+
+      key = LEVELDB_GetBytesFromObj(interp, objv[2], &key_len, binary);
+      if( !key || key_len < 1 ){
+         Tcl_AppendResult(interp, "Error: key is an empty key ", (char*)0);
+         return TCL_ERROR;
+      }
+
+      data = LEVELDB_GetBytesFromObj(interp, objv[3], &data_len, binary);
+      if( !data || data_len < 1 ){
+         Tcl_AppendResult(interp, "Error: data is an empty value ", (char*)0);
+         return TCL_ERROR;
+      }
+
+      if(asyncObj) {
+          LevelAsyncJob *job = new LevelAsyncJob;
+
+          job->op = LEVEL_ASYNC_PUT;
+          job->write_options = write_options;
+          job->key.assign(key, key_len);
+          job->value.assign(data, data_len);
+          job->binary = binary;
+
+          return LEVELDB_AsyncSubmit(interp, dbInfo, job, asyncObj);
+      }
+
+      key2 = leveldb::Slice(key, key_len);
+      value2 = leveldb::Slice(data, data_len);
+      batch.Put(key2, value2);
+      status = LEVELDB_Write(dbInfo->shared, write_options, &batch);
+      if(!status.ok()) {
+        Tcl_AppendResult(interp, "Error: put failed", (char*)0);
+        return TCL_ERROR;
+      }
 
-  if( Tcl_GetIndexFromObj(interp, objv[1], ITR_strs, "option", 0, &choice) ){
-    return TCL_ERROR;
-  }
+      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      LEVELDB_STAT_END(dbInfo->stats, LEVEL_STAT_PUT, t0, key_len + data_len);
 
-  /*
-   * Get the leveldb::Iterator value
-   */
-  itrHandle = Tcl_GetStringFromObj(objv[0], 0);
-  hashEntryPtr = Tcl_FindHashEntry( tsdPtr->leveldb_hashtblPtr, itrHandle );
-  if( !hashEntryPtr ) {
-    if( interp ) {
-        Tcl_Obj *resultObj = Tcl_GetObjResult( interp );
+      break;
+    }
+
+    case DBI_DELETE: {
+      leveldb::Status status;
+      leveldb::WriteOptions write_options;
+      leveldb::WriteBatch batch;
+      const char *key = NULL;
+      Tcl_Size key_len = 0;
+      leveldb::Slice key2;
+      Tcl_Obj *asyncObj = NULL;
+      char *zArg;
+      int i = 0;
+
+      if( objc < 3 || (objc&1)!=1) {
+        Tcl_WrongNumArgs(interp, 2, objv,
+          "key ?-sync BOOLEAN? ?-encoding TYPE? ?-async CALLBACK? ");
+        return TCL_ERROR;
+      }
+
+      for(i=3; i+1<objc; i+=2){
+        zArg = Tcl_GetStringFromObj(objv[i], 0);
+
+        if( strcmp(zArg, "-sync")==0 ){
+            int b;
+            if( Tcl_GetBooleanFromObj(interp, objv[i+1], &b) ) return TCL_ERROR;
+            if( b ){
+              write_options.sync = true;
+            }else{
+              write_options.sync = false;
+            }
+        } else if( strcmp(zArg, "-encoding")==0 ){
+            if( LEVELDB_GetEncodingFromObj(interp, objv[i+1], &binary) ) return TCL_ERROR;
+        } else if( strcmp(zArg, "-async")==0 ){
+            asyncObj = objv[i+1];
+        } else{
+           Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
+           return TCL_ERROR;
+        }
+      }
+
+      key = LEVELDB_GetBytesFromObj(interp, objv[2], &key_len, binary);
+      if( !key || key_len < 1 ){
+         Tcl_AppendResult(interp, "Error: key is an empty key ", (char*)0);
+         return TCL_ERROR;
+      }
+
+      if(asyncObj) {
+          LevelAsyncJob *job = new LevelAsyncJob;
+
+          job->op = LEVEL_ASYNC_DELETE;
+          job->write_options = write_options;
+          job->key.assign(key, key_len);
+          job->binary = binary;
+
+          return LEVELDB_AsyncSubmit(interp, dbInfo, job, asyncObj);
+      }
+
+      key2 = leveldb::Slice(key, key_len);
+      batch.Delete(key2);
+
+      status = LEVELDB_Write(dbInfo->shared, write_options, &batch);
+      if(!status.ok()) {
+        Tcl_AppendResult(interp, "Error: delete failed", (char*)0);
+        return TCL_ERROR;
+      }
+
+      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      LEVELDB_STAT_END(dbInfo->stats, LEVEL_STAT_DELETE, t0, key_len);
 
-        Tcl_AppendStringsToObj( resultObj, "invalid iterator handle ", itrHandle, (char *)NULL );
+      break;
     }
 
-    return TCL_ERROR;
-  }
+    case DBI_WRITE: {
+      LevelBatInfo *batInfo;
+      leveldb::Status status;
+      leveldb::WriteOptions write_options;
+      Tcl_Obj *asyncObj = NULL;
+      char *zArg;
+      int i = 0;
 
-  it = (leveldb::Iterator *)(uintptr_t)Tcl_GetHashValue( hashEntryPtr );
+      if( objc < 3 || (objc&1)!=1 ) {
+        Tcl_WrongNumArgs(interp, 2, objv, "batch_handle ?-sync BOOLEAN? ?-async CALLBACK? ");
+        return TCL_ERROR;
+      }
 
-  switch( (enum ITR_enum)choice ){
+      for(i=3; i+1<objc; i+=2){
+        zArg = Tcl_GetStringFromObj(objv[i], 0);
 
-    case ITR_SEEKTOFIRST: {
-      if( objc != 2 ){
-        Tcl_WrongNumArgs(interp, 2, objv, 0);
+        if( strcmp(zArg, "-sync")==0 ){
+            int b;
+            if( Tcl_GetBooleanFromObj(interp, objv[i+1], &b) ) return TCL_ERROR;
+            if( b ){
+              write_options.sync = true;
+            }else{
+              write_options.sync = false;
+            }
+        } else if( strcmp(zArg, "-async")==0 ){
+            asyncObj = objv[i+1];
+        } else{
+           Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
+           return TCL_ERROR;
+        }
+      }
+
+      batInfo = (LevelBatInfo *) LEVELDB_GetHandleFromObj(interp, objv[2], LEVEL_HANDLE_BAT);
+      if( !batInfo ) {
         return TCL_ERROR;
       }
 
-      it->SeekToFirst();
-      if(!it->status().ok()) {
-        Tcl_AppendResult(interp, "Error: seektofirst failed", (char*)0);
+      /*
+       * The batch is copied, so it can be changed or closed at once.
+       */
+      if(asyncObj) {
+          LevelAsyncJob *job = new LevelAsyncJob;
+
+          job->op = LEVEL_ASYNC_WRITE;
+          job->write_options = write_options;
+          job->batch = *batInfo->batch;
+          job->binary = binary;
+
+          return LEVELDB_AsyncSubmit(interp, dbInfo, job, asyncObj);
+      }
+
+      status = LEVELDB_Write(dbInfo->shared, write_options, batInfo->batch);
+      if(!status.ok()) {
+        Tcl_AppendResult(interp, "Error: write failed", (char*)0);
         return TCL_ERROR;
       }
 
       Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      LEVELDB_STAT_END(dbInfo->stats, LEVEL_STAT_WRITE, t0,
+                       batInfo->batch->ApproximateSize());
 
       break;
     }
 
-    case ITR_SEEKTOLAST: {
-      if( objc != 2 ){
-        Tcl_WrongNumArgs(interp, 2, objv, 0);
+    case DBI_BATCH: {
+      LevelBatInfo *batInfo;
+      Tcl_Obj *pResultStr = NULL;
+      Tcl_WideInt autoflush = 0;
+      int sync = 0;
+      char *zArg;
+      int i = 0;
+
+      if( (objc&1)!=0 ) {
+        Tcl_WrongNumArgs(interp, 2, objv,
+          "?-encoding TYPE? ?-autoflush BYTES? ?-sync BOOLEAN? ");
         return TCL_ERROR;
       }
 
-      it->SeekToLast();
-      if(!it->status().ok()) {
-        Tcl_AppendResult(interp, "Error: seektolast failed", (char*)0);
+      for(i=2; i+1<objc; i+=2){
+        zArg = Tcl_GetStringFromObj(objv[i], 0);
+
+        if( strcmp(zArg, "-encoding")==0 ){
+            if( LEVELDB_GetEncodingFromObj(interp, objv[i+1], &binary) ) return TCL_ERROR;
+        } else if( strcmp(zArg, "-autoflush")==0 ){
+            if( Tcl_GetWideIntFromObj(interp, objv[i+1], &autoflush) ) return TCL_ERROR;
+        } else if( strcmp(zArg, "-sync")==0 ){
+            if( Tcl_GetBooleanFromObj(interp, objv[i+1], &sync) ) return TCL_ERROR;
+        } else{
+           Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
+           return TCL_ERROR;
+        }
+      }
+
+      batInfo = new LevelBatInfo;
+      batInfo->batch = new leveldb::WriteBatch();
+      batInfo->binary = binary;
+      batInfo->count = 0;
+      batInfo->stats = dbInfo->stats;
+      if( batInfo->stats ) {
+        batInfo->stats->refCount++;
+      }
+      batInfo->dbInfo = NULL;
+      batInfo->autoflush = 0;
+      batInfo->sync = sync;
+
+      /*
+       * With -autoflush the batch is bound to this database and written
+       * (and cleared) as soon as its size reaches BYTES.
+       */
+      if( autoflush > 0 ) {
+        batInfo->dbInfo = dbInfo;
+        batInfo->autoflush = (size_t) autoflush;
+        dbInfo->refCount++;
+      }
+      batInfo->handle = LEVELDB_NewHandle(interp, "levelbat", LEVEL_HANDLE_BAT,
+          batInfo, (Tcl_ObjCmdProc *) LEVELDB_BAT, LEVELDB_BAT_Delete, &pResultStr);
+
+      Tcl_SetObjResult(interp, pResultStr);
+
+      break;
+    }
+
+    case DBI_ITERATOR: {
+      leveldb::ReadOptions read_options;
+      Tcl_Obj *pResultStr = NULL;
+      const leveldb::Snapshot* shot = NULL;
+      Tcl_Obj *sstObj = NULL;
+      char *zArg;
+      int i = 0;
+
+      if( objc < 2 || (objc&1)!=0) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?-snapshot HANDLE? ?-encoding TYPE? ");
         return TCL_ERROR;
       }
 
-      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      for(i=2; i+1<objc; i+=2){
+        zArg = Tcl_GetStringFromObj(objv[i], 0);
+
+        if( strcmp(zArg, "-snapshot")==0 ){
+            sstObj = objv[i+1];
+        } else if( strcmp(zArg, "-encoding")==0 ){
+            if( LEVELDB_GetEncodingFromObj(interp, objv[i+1], &binary) ) return TCL_ERROR;
+        } else{
+           Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
+           return TCL_ERROR;
+        }
+      }
+
+      if(sstObj) {
+          shot = LEVELDB_GetSnapshotFromObj(interp, sstObj, dbInfo);
+          if( !shot ) {
+            return TCL_ERROR;
+          }
+
+          read_options.snapshot = shot;
+      }
+
+      LevelItrInfo *itInfo = new LevelItrInfo;
+      itInfo->it = db->NewIterator(read_options);
+      itInfo->binary = binary;
+      itInfo->dbInfo = dbInfo;
+      dbInfo->refCount++;
+      itInfo->handle = LEVELDB_NewHandle(interp, "levelitr", LEVEL_HANDLE_ITR,
+          itInfo, (Tcl_ObjCmdProc *) LEVELDB_ITR, LEVELDB_ITR_Delete, &pResultStr);
+
+      Tcl_SetObjResult(interp, pResultStr);
 
       break;
     }
 
-    case ITR_SEEK: {
-      const char *key = NULL;
-      Tcl_Size len = 0;
-      leveldb::Slice slice;
 
-      if( objc != 3 ){
-        Tcl_WrongNumArgs(interp, 2, objv, "key ");
+    case DBI_SNAPSHOT: {
+      LevelSstInfo *sstInfo;
+      Tcl_Obj *pResultStr = NULL;
+
+      if( objc != 2 ) {
+        Tcl_WrongNumArgs(interp, 2, objv, 0);
         return TCL_ERROR;
       }
 
-      key = Tcl_GetStringFromObj(objv[2], &len);
-      if(!key || len < 0) {
-        Tcl_AppendResult(interp, "Error: key is empty", (char*)0);
+      sstInfo = new LevelSstInfo;
+      sstInfo->shot = db->GetSnapshot();
+      sstInfo->dbInfo = dbInfo;
+      dbInfo->refCount++;
+      sstInfo->handle = LEVELDB_NewHandle(interp, "levelsst", LEVEL_HANDLE_SST,
+          sstInfo, (Tcl_ObjCmdProc *) LEVELDB_SST, LEVELDB_SST_Delete, &pResultStr);
+
+      Tcl_SetObjResult(interp, pResultStr);
+
+      break;
+    }
+
+
+    case DBI_GETAPPROXIMATESIZES: {
+      const char *start = NULL;
+      Tcl_Size start_len = 0;
+      const char *limit = NULL;
+      Tcl_Size limit_len = 0;
+      leveldb::Slice start2;
+      leveldb::Slice limit2;
+      uint64_t sizes;
+      Tcl_Obj *pResultStr = NULL;
+
+      if( objc != 3 && objc != 4 ){
+        Tcl_WrongNumArgs(interp, 2, objv, "start limit | rangeList ");
+        return TCL_ERROR;
+      }
+
+      /*
+       * A list of {start limit} pairs is measured with one call, and
+       * a list of sizes is returned.
+       */
+      if( objc == 3 ){
+        Tcl_Obj **rangeList;
+        Tcl_Size range_count = 0;
+        std::vector<leveldb::Range> ranges;
+        std::vector<uint64_t> range_sizes;
+        Tcl_Size k;
+
+        if( Tcl_ListObjGetElements(interp, objv[2], &range_count, &rangeList) != TCL_OK ){
+          return TCL_ERROR;
+        }
+
+        ranges.resize(range_count);
+        range_sizes.resize(range_count);
+        for(k = 0; k < range_count; k++) {
+          Tcl_Obj **pair;
+          Tcl_Size pair_count = 0;
+
+          if( Tcl_ListObjGetElements(interp, rangeList[k], &pair_count, &pair) != TCL_OK ){
+            return TCL_ERROR;
+          }
+
+          if( pair_count != 2 ){
+             Tcl_AppendResult(interp, "Error: range must be a {start limit} pair ", (char*)0);
+             return TCL_ERROR;
+          }
+
+          start = LEVELDB_GetBytesFromObj(interp, pair[0], &start_len, binary);
+          limit = LEVELDB_GetBytesFromObj(interp, pair[1], &limit_len, binary);
+          if( !start || !limit ){
+             return TCL_ERROR;
+          }
+
+          ranges[k] = leveldb::Range(leveldb::Slice(start, start_len),
+                                     leveldb::Slice(limit, limit_len));
+        }
+
+        if( range_count > 0 ){
+          db->GetApproximateSizes(&ranges[0], (int) range_count, &range_sizes[0]);
+        }
+
+        pResultStr = Tcl_NewListObj(0, NULL);
+        for(k = 0; k < range_count; k++) {
+          Tcl_ListObjAppendElement(interp, pResultStr,
+                                   Tcl_NewWideIntObj((Tcl_WideInt) range_sizes[k]));
+        }
+
+        Tcl_SetObjResult(interp, pResultStr);
+        break;
+      }
+
+      start = LEVELDB_GetBytesFromObj(interp, objv[2], &start_len, binary);
+      if( !start ){
+         return TCL_ERROR;
+      }
+      if( start_len < 1 ){
+         Tcl_AppendResult(interp, "Error: start is an empty string ", (char*)0);
+         return TCL_ERROR;
+      }
+
+      limit = LEVELDB_GetBytesFromObj(interp, objv[3], &limit_len, binary);
+      if( !limit ){
+         return TCL_ERROR;
+      }
+      if( limit_len < 1 ){
+         Tcl_AppendResult(interp, "Error: limit is an empty string ", (char*)0);
+         return TCL_ERROR;
+      }
+
+      start2 = leveldb::Slice(start, start_len);
+      limit2 = leveldb::Slice(limit, limit_len);
+
+      leveldb::Range ranges = leveldb::Range(start2, limit2);
+      db->GetApproximateSizes(&ranges, 1, &sizes);
+
+      pResultStr = Tcl_NewWideIntObj( (Tcl_WideInt) sizes);
+      Tcl_SetObjResult(interp, pResultStr);
+
+      break;
+    }
+
+    case DBI_GETPROPERTY: {
+      const char *key = NULL;
+      Tcl_Size key_len = 0;
+      leveldb::Slice property;
+      std::string value2;
+      bool result;
+      Tcl_Obj *pResultStr = NULL;
+
+      if( objc != 3 ){
+        Tcl_WrongNumArgs(interp, 2, objv, "property ");
         return TCL_ERROR;
       }
 
-      slice = leveldb::Slice(key, len);
-      it->Seek(slice);
-      if(!it->status().ok()) {
-        Tcl_AppendResult(interp, "Error: seek failed", (char*)0);
-        return TCL_ERROR;
+      key = Tcl_GetStringFromObj(objv[2], &key_len);
+      if( !key || key_len < 1 ){
+         Tcl_AppendResult(interp, "Error: property is an empty string ", (char*)0);
+         return TCL_ERROR;
       }
 
-      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      property = leveldb::Slice(key, key_len);
+      result = db->GetProperty(property, &value2);
+
+      if(!result) {
+         Tcl_AppendResult(interp, "Error: is not a valid property ", (char*)0);
+         return TCL_ERROR;
+      }
+
+      pResultStr = Tcl_NewStringObj(value2.c_str(), value2.length());
+      Tcl_SetObjResult(interp, pResultStr);
 
       break;
     }
 
-    case ITR_VALID: {
-      bool isValid;
-
-      if( objc != 2 ){
-        Tcl_WrongNumArgs(interp, 2, objv, 0);
-        return TCL_ERROR;
-      }
+    case DBI_MGET: {
+      leveldb::ReadOptions read_options;
+      leveldb::Status status;
+      Tcl_Obj **keyObjs = NULL;
+      Tcl_Size key_count = 0;
+      std::vector<leveldb::Slice> keys;
+      std::string value2;
+      char *zArg;
+      int i = 0;
+      Tcl_Obj *pResultStr = NULL;
+      const leveldb::Snapshot* shot = NULL;
+      const leveldb::Snapshot* implicit_shot = NULL;
+      Tcl_Obj *sstObj = NULL;
+      Tcl_WideInt nbytes = 0;
 
-      isValid = it->Valid();
-      if(!it->status().ok()) {
-        Tcl_AppendResult(interp, "Error: valid failed", (char*)0);
+      if( objc < 3 || (objc&1)!=1) {
+        Tcl_WrongNumArgs(interp, 2, objv, "keyList ?-fillCache BOOLEAN? ?-snapshot HANDLE? ?-encoding TYPE? ");
         return TCL_ERROR;
       }
 
-      if( isValid ) {
-          Tcl_SetObjResult(interp, Tcl_NewBooleanObj( 1 ));
-      } else {
-          Tcl_SetObjResult(interp, Tcl_NewBooleanObj( 0 ));
+      if( Tcl_ListObjGetElements(interp, objv[2], &key_count, &keyObjs) != TCL_OK ){
+         return TCL_ERROR;
       }
 
-      break;
-    }
+      for(i=3; i+1<objc; i+=2){
+        zArg = Tcl_GetStringFromObj(objv[i], 0);
 
-    case ITR_NEXT: {
-      if( objc != 2 ){
-        Tcl_WrongNumArgs(interp, 2, objv, 0);
-        return TCL_ERROR;
+        if( strcmp(zArg, "-fillCache")==0 ){
+            int b;
+            if( Tcl_GetBooleanFromObj(interp, objv[i+1], &b) ) return TCL_ERROR;
+            if( b ){
+              read_options.fill_cache = true;
+            }else{
+              read_options.fill_cache = false;
+            }
+        } else if( strcmp(zArg, "-snapshot")==0 ){
+            sstObj = objv[i+1];
+        } else if( strcmp(zArg, "-encoding")==0 ){
+            if( LEVELDB_GetEncodingFromObj(interp, objv[i+1], &binary) ) return TCL_ERROR;
+        } else{
+           Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
+           return TCL_ERROR;
+        }
       }
 
-      it->Next();
-      if(!it->status().ok()) {
-        Tcl_AppendResult(interp, "Error: next failed", (char*)0);
-        return TCL_ERROR;
+      if(sstObj) {
+          shot = LEVELDB_GetSnapshotFromObj(interp, sstObj, dbInfo);
+          if( !shot ) {
+            return TCL_ERROR;
+          }
+
       }
 
-      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      keys.reserve(key_count);
+      for(i = 0; i < key_count; i++) {
+        const char *key = NULL;
+        Tcl_Size key_len = 0;
 
-      break;
-    }
+        key = LEVELDB_GetBytesFromObj(interp, keyObjs[i], &key_len, binary);
+        if( !key || key_len < 1 ){
+           Tcl_AppendResult(interp, "Error: key is an empty key ", (char*)0);
+           return TCL_ERROR;
+        }
 
-    case ITR_PREV: {
-      if( objc != 2 ){
-        Tcl_WrongNumArgs(interp, 2, objv, 0);
-        return TCL_ERROR;
+        keys.push_back(leveldb::Slice(key, key_len));
       }
 
-      it->Prev();
-      if(!it->status().ok()) {
-        Tcl_AppendResult(interp, "Error: prev failed", (char*)0);
-        return TCL_ERROR;
-      }
+      /*
+       * Sorted and unique keys are looked up in key order, so that
+       * neighbouring keys hit the same blocks. All lookups use one
+       * snapshot, so the result is consistent even without -snapshot.
+       */
+      std::sort(keys.begin(), keys.end(), LevelKeyLess(dbInfo->shared->comparator));
+      keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
 
-      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      if(!shot) {
+          implicit_shot = db->GetSnapshot();
+          shot = implicit_shot;
+      }
+      read_options.snapshot = shot;
 
-      break;
-    }
+      pResultStr = Tcl_NewDictObj();
 
-    case ITR_KEY: {
-      std::string key2;
-      Tcl_Obj *pResultStr = NULL;
+      if(keys.size() < LEVELDB_MGET_SEEK_THRESHOLD) {
+          for(size_t n = 0; n < keys.size(); n++) {
+            status = db->Get(read_options, keys[n], &value2);
+            if(status.IsNotFound()) {
+              continue;
+            } else if(!status.ok()) {
+              break;
+            }
 
-      if( objc != 2 ){
-        Tcl_WrongNumArgs(interp, 2, objv, 0);
-        return TCL_ERROR;
-      }
+            nbytes += keys[n].size() + value2.length();
+            Tcl_DictObjPut(NULL, pResultStr,
+                           LEVELDB_NewBytesObj(keys[n].data(), keys[n].size(), binary),
+                           LEVELDB_NewValueObj(&value2, binary));
+          }
+      } else {
+          /*
+           * For many keys one iterator walks forward through the key
+           * space. A seek is skipped when the iterator already stands at
+           * or after the wanted key.
+           */
+          leveldb::Iterator* it = db->NewIterator(read_options);
+
+          for(size_t n = 0; n < keys.size(); n++) {
+            if(!it->Valid() || dbInfo->shared->comparator->Compare(it->key(), keys[n]) < 0) {
+              it->Seek(keys[n]);
+            }
 
-      key2 = it->key().ToString();
-      if(!it->status().ok()) {
-        Tcl_AppendResult(interp, "Error: key failed", (char*)0);
-        return TCL_ERROR;
-      }
+            if(!it->Valid()) {
+              break;
+            }
 
-      pResultStr = Tcl_NewStringObj(key2.c_str(), key2.length());
-      Tcl_SetObjResult(interp, pResultStr);
+            if(it->key() == keys[n]) {
+              leveldb::Slice value = it->value();
 
-      break;
-    }
+              Tcl_DictObjPut(NULL, pResultStr,
+                             LEVELDB_NewBytesObj(keys[n].data(), keys[n].size(), binary),
+                             LEVELDB_NewSliceValueObj(value, binary));
+              nbytes += keys[n].size() + value.size();
+            }
+          }
 
-    case ITR_VALUE: {
-      std::string value2;
-      Tcl_Obj *pResultStr = NULL;
+          status = it->status();
+          delete it;
+      }
 
-      if( objc != 2 ){
-        Tcl_WrongNumArgs(interp, 2, objv, 0);
-        return TCL_ERROR;
+      if(implicit_shot) {
+          db->ReleaseSnapshot(implicit_shot);
       }
 
-      value2 = it->value().ToString();
-      if(!it->status().ok()) {
-        Tcl_AppendResult(interp, "Error: value failed", (char*)0);
+      if(!status.ok() && !status.IsNotFound()) {
+        Tcl_DecrRefCount(pResultStr);
+        Tcl_AppendResult(interp, "Error: mget failed", (char*)0);
         return TCL_ERROR;
       }
 
-      pResultStr = Tcl_NewStringObj(value2.c_str(), value2.length());
       Tcl_SetObjResult(interp, pResultStr);
+      LEVELDB_STAT_END(dbInfo->stats, LEVEL_STAT_MGET, t0, nbytes);
 
       break;
     }
 
-    case ITR_CLOSE: {
-      if( objc != 2 ){
-        Tcl_WrongNumArgs(interp, 2, objv, 0);
+    case DBI_SCAN: {
+      leveldb::ReadOptions read_options;
+      leveldb::Status status;
+      LevelRange range;
+      int handled = 0;
+      Tcl_WideInt limit = -1;
+      Tcl_WideInt count = 0;
+      int keysonly = 0;
+      char *zArg;
+      int i = 0;
+      Tcl_Obj *pResultStr = NULL;
+      const leveldb::Snapshot* shot = NULL;
+      Tcl_Obj *sstObj = NULL;
+      Tcl_WideInt nbytes = 0;
+
+      /*
+       * By default a scan does not fill the block cache, so that one
+       * large scan does not push hot blocks out of it.
+       */
+      read_options.fill_cache = false;
+
+      if( (objc&1)!=0 ) {
+        Tcl_WrongNumArgs(interp, 2, objv,
+          "?-start key? ?-end key? ?-prefix prefix? ?-limit number? \
+           ?-reverse BOOLEAN? ?-keysonly BOOLEAN? ?-fillCache BOOLEAN? \
+           ?-snapshot HANDLE? ?-encoding TYPE? ");
         return TCL_ERROR;
       }
 
-      delete it;
+      for(i=2; i+1<objc; i+=2){
+        zArg = Tcl_GetStringFromObj(objv[i], 0);
 
-      Tcl_MutexLock(&myMutex);
-      if( hashEntryPtr )  Tcl_DeleteHashEntry(hashEntryPtr);
-      Tcl_MutexUnlock(&myMutex);
+        if( LEVELDB_RangeOption(interp, &range, zArg, objv[i+1], &handled) ){
+            return TCL_ERROR;
+        } else if( handled ){
+            continue;
+        } else if( strcmp(zArg, "-limit")==0 ){
+            if( Tcl_GetWideIntFromObj(interp, objv[i+1], &limit) ) return TCL_ERROR;
+        } else if( strcmp(zArg, "-keysonly")==0 ){
+            if( Tcl_GetBooleanFromObj(interp, objv[i+1], &keysonly) ) return TCL_ERROR;
+        } else if( strcmp(zArg, "-fillCache")==0 ){
+            int b;
+            if( Tcl_GetBooleanFromObj(interp, objv[i+1], &b) ) return TCL_ERROR;
+            if( b ){
+              read_options.fill_cache = true;
+            }else{
+              read_options.fill_cache = false;
+            }
+        } else if( strcmp(zArg, "-snapshot")==0 ){
+            sstObj = objv[i+1];
+        } else if( strcmp(zArg, "-encoding")==0 ){
+            if( LEVELDB_GetEncodingFromObj(interp, objv[i+1], &binary) ) return TCL_ERROR;
+        } else{
+           Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
+           return TCL_ERROR;
+        }
+      }
 
-      Tcl_DeleteCommand(interp, itrHandle);
-      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      if( LEVELDB_RangeSetup(interp, &range, binary, dbInfo->shared->comparator) ){
+          return TCL_ERROR;
+      }
 
-      break;
-    }
-  }
+      if(sstObj) {
+          shot = LEVELDB_GetSnapshotFromObj(interp, sstObj, dbInfo);
+          if( !shot ) {
+            return TCL_ERROR;
+          }
 
-  return TCL_OK;
-}
+          read_options.snapshot = shot;
+      }
 
-static int LEVELDB_DBI(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv){
-  int choice;
-  leveldb::DB* db;
-  Tcl_HashEntry *hashEntryPtr;
-  char *dbiHandle;
+      leveldb::Iterator* it = db->NewIterator(read_options);
+      pResultStr = Tcl_NewListObj(0, NULL);
 
-  ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
-      Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+      for(LEVELDB_RangeSeek(it, &range);
+          LEVELDB_RangeValid(it, &range) && (limit < 0 || count < limit);
+          LEVELDB_RangeStep(it, &range)) {
+        leveldb::Slice key = it->key();
 
-  if (tsdPtr->initialized == 0) {
-    tsdPtr->initialized = 1;
-    tsdPtr->leveldb_hashtblPtr = (Tcl_HashTable *) ckalloc(sizeof(Tcl_HashTable));
-    Tcl_InitHashTable(tsdPtr->leveldb_hashtblPtr, TCL_STRING_KEYS);
-  }
+        Tcl_ListObjAppendElement(NULL, pResultStr,
+                                 LEVELDB_NewBytesObj(key.data(), key.size(), binary));
+        nbytes += key.size();
+        if(!keysonly) {
+          leveldb::Slice value = it->value();
 
-  static const char *DBI_strs[] = {
-    "get",
-    "put",
-    "delete",
-    "write",
-    "batch",
-    "iterator",
-    "snapshot",
-    "getApproximateSizes",
-    "getProperty",
-    "close",
-    0
-  };
+          Tcl_ListObjAppendElement(NULL, pResultStr,
+                                   LEVELDB_NewSliceValueObj(value, binary));
+          nbytes += value.size();
+        }
 
-  enum DBI_enum {
-    DBI_GET,
-    DBI_PUT,
-    DBI_DELETE,
-    DBI_WRITE,
-    DBI_BATCH,
-    DBI_ITERATOR,
-    DBI_SNAPSHOT,
-    DBI_GETAPPROXIMATESIZES,
-    DBI_GETPROPERTY,
-    DBI_CLOSE,
-  };
+        count++;
+      }
 
-  if( objc < 2 ){
-    Tcl_WrongNumArgs(interp, 1, objv, "SUBCOMMAND ...");
-    return TCL_ERROR;
-  }
+      status = it->status();
+      delete it;
 
-  if( Tcl_GetIndexFromObj(interp, objv[1], DBI_strs, "option", 0, &choice) ){
-    return TCL_ERROR;
-  }
+      if(!status.ok()) {
+        Tcl_DecrRefCount(pResultStr);
+        Tcl_AppendResult(interp, "Error: scan failed", (char*)0);
+        return TCL_ERROR;
+      }
 
-  /*
-   * Get the leveldb::DB value
-   */
-  dbiHandle = Tcl_GetStringFromObj(objv[0], 0);
-  hashEntryPtr = Tcl_FindHashEntry( tsdPtr->leveldb_hashtblPtr, dbiHandle );
-  if( !hashEntryPtr ) {
-    if( interp ) {
-        Tcl_Obj *resultObj = Tcl_GetObjResult( interp );
+      Tcl_SetObjResult(interp, pResultStr);
+      LEVELDB_STAT_END(dbInfo->stats, LEVEL_STAT_SCAN, t0, nbytes);
 
-        Tcl_AppendStringsToObj( resultObj, "invalid db handle ", dbiHandle, (char *)NULL );
+      break;
     }
 
-    return TCL_ERROR;
-  }
-
-  db = (leveldb::DB *)(uintptr_t)Tcl_GetHashValue( hashEntryPtr );
-
-  switch( (enum DBI_enum)choice ){
-
-    case DBI_GET: {
+    case DBI_FOREACH: {
       leveldb::ReadOptions read_options;
       leveldb::Status status;
-      const char *key = NULL;
-      Tcl_Size key_len = 0;
-      leveldb::Slice key2;
-      std::string value2;
+      LevelRange range;
+      int handled = 0;
+      Tcl_Obj **varList = NULL;
+      Tcl_Obj *varObjs[2] = { NULL, NULL };
+      Tcl_Size var_count = 0;
+      Tcl_Obj *bodyObj = NULL;
       char *zArg;
       int i = 0;
-      Tcl_Obj *pResultStr = NULL;
+      int result = TCL_OK;
       const leveldb::Snapshot* shot = NULL;
-      Tcl_HashEntry *sstHashEntryPtr;
-      const char *sstHandle = NULL;
-      Tcl_Size sst_length = 0;
+      Tcl_Obj *sstObj = NULL;
 
-      if( objc < 3 || (objc&1)!=1) {
-        Tcl_WrongNumArgs(interp, 2, objv, "key ?-fillCache BOOLEAN? ?-snapshot HANDLE? ");
+      if( objc < 4 || (objc&1)!=0 ) {
+        Tcl_WrongNumArgs(interp, 2, objv,
+          "{keyVar ?valueVar?} ?-start key? ?-end key? ?-prefix prefix? \
+           ?-reverse BOOLEAN? ?-snapshot HANDLE? ?-encoding TYPE? body ");
         return TCL_ERROR;
       }
 
-      key = Tcl_GetStringFromObj(objv[2], &key_len);
-      if( !key || key_len < 1 ){
-         Tcl_AppendResult(interp, "Error: key is an empty key ", (char*)0);
+      if( Tcl_ListObjGetElements(interp, objv[2], &var_count, &varList) != TCL_OK ){
          return TCL_ERROR;
       }
 
-      for(i=3; i+1<objc; i+=2){
+      if( var_count < 1 || var_count > 2 ){
+         Tcl_AppendResult(interp, "must have one or two variable names", (char*)0);
+         return TCL_ERROR;
+      }
+
+      bodyObj = objv[objc-1];
+
+      for(i=3; i+1<objc-1; i+=2){
         zArg = Tcl_GetStringFromObj(objv[i], 0);
 
-        if( strcmp(zArg, "-fillCache")==0 ){
-            int b;
-            if( Tcl_GetBooleanFromObj(interp, objv[i+1], &b) ) return TCL_ERROR;
-            if( b ){
-              read_options.fill_cache = true;
-            }else{
-              read_options.fill_cache = false;
-            }
+        if( LEVELDB_RangeOption(interp, &range, zArg, objv[i+1], &handled) ){
+            return TCL_ERROR;
+        } else if( handled ){
+            continue;
         } else if( strcmp(zArg, "-snapshot")==0 ){
-            sstHandle = Tcl_GetStringFromObj(objv[i+1], &sst_length);
-
-            if( !sstHandle || sst_length < 1) {
-              return TCL_ERROR;
-            }
+            sstObj = objv[i+1];
+        } else if( strcmp(zArg, "-encoding")==0 ){
+            if( LEVELDB_GetEncodingFromObj(interp, objv[i+1], &binary) ) return TCL_ERROR;
         } else{
            Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
            return TCL_ERROR;
         }
       }
 
-      if(sstHandle) {
-          sstHashEntryPtr = Tcl_FindHashEntry( tsdPtr->leveldb_hashtblPtr, sstHandle );
-          if( !sstHashEntryPtr ) {
-            if( interp ) {
-                Tcl_Obj *resultObj = Tcl_GetObjResult( interp );
-
-                Tcl_AppendStringsToObj( resultObj, "invalid snapshot handle ", sstHandle, (char *)NULL );
-            }
+      if( LEVELDB_RangeSetup(interp, &range, binary, dbInfo->shared->comparator) ){
+          return TCL_ERROR;
+      }
 
+      if(sstObj) {
+          shot = LEVELDB_GetSnapshotFromObj(interp, sstObj, dbInfo);
+          if( !shot ) {
             return TCL_ERROR;
           }
 
-          shot = (leveldb::Snapshot *)(uintptr_t)Tcl_GetHashValue( sstHashEntryPtr );
           read_options.snapshot = shot;
       }
 
-      key2 = leveldb::Slice(key, key_len);
+      read_options.fill_cache = false;
+
+      /*
+       * The body may run any command, including "DB_HANDLE close", so the
+       * database is marked busy until the iterator is deleted. The extra
+       * reference keeps it alive if the command is renamed away.
+       */
+      leveldb::Iterator* it = db->NewIterator(read_options);
+      dbInfo->busy++;
+      dbInfo->refCount++;
+
+      /*
+       * The variable names are held on their own: the body may shimmer
+       * the list they came from, which would free its elements.
+       */
+      for(i = 0; i < var_count; i++) {
+        varObjs[i] = varList[i];
+        Tcl_IncrRefCount(varObjs[i]);
+      }
+
+      Tcl_IncrRefCount(bodyObj);
+      for(LEVELDB_RangeSeek(it, &range);
+          LEVELDB_RangeValid(it, &range);
+          LEVELDB_RangeStep(it, &range)) {
+        leveldb::Slice key = it->key();
+
+        if( !Tcl_ObjSetVar2(interp, varObjs[0], NULL,
+                            LEVELDB_NewBytesObj(key.data(), key.size(), binary),
+                            TCL_LEAVE_ERR_MSG) ) {
+          result = TCL_ERROR;
+          break;
+        }
+
+        if( var_count == 2 ) {
+          leveldb::Slice value = it->value();
+
+          if( !Tcl_ObjSetVar2(interp, varObjs[1], NULL,
+                              LEVELDB_NewSliceValueObj(value, binary),
+                              TCL_LEAVE_ERR_MSG) ) {
+            result = TCL_ERROR;
+            break;
+          }
+        }
+
+        result = Tcl_EvalObjEx(interp, bodyObj, 0);
+        if( result == TCL_CONTINUE ) {
+          result = TCL_OK;
+        } else if( result == TCL_BREAK ) {
+          result = TCL_OK;
+          break;
+        } else if( result == TCL_ERROR ) {
+          char msg[32 + TCL_INTEGER_SPACE];
+
+          sprintf(msg, "\n    (\"foreach\" body line %d)", Tcl_GetErrorLine(interp));
+          Tcl_AddObjErrorInfo(interp, msg, -1);
+          break;
+        } else if( result != TCL_OK ) {
+          break;
+        }
+      }
+      Tcl_DecrRefCount(bodyObj);
+
+      for(i = 0; i < var_count; i++) {
+        Tcl_DecrRefCount(varObjs[i]);
+      }
+
+      status = it->status();
+      delete it;
+      dbInfo->busy--;
+      LEVELDB_ReleaseDB(dbInfo);
+
+      if( result != TCL_OK ) {
+        return result;
+      }
 
-      status = db->Get(read_options, key2, &value2);
       if(!status.ok()) {
-        Tcl_AppendResult(interp, "Error: get failed", (char*)0);
+        Tcl_AppendResult(interp, "Error: foreach failed", (char*)0);
         return TCL_ERROR;
       }
 
-      pResultStr = Tcl_NewStringObj(value2.c_str(), value2.length());
-      Tcl_SetObjResult(interp, pResultStr);
+      Tcl_ResetResult(interp);
 
       break;
     }
 
-    case DBI_PUT: {
+    case DBI_MPUT: {
       leveldb::Status status;
       leveldb::WriteOptions write_options;
-      const char *key = NULL;
-      const char *data = NULL;
-      Tcl_Size key_len = 0;
-      Tcl_Size data_len = 0;
-      leveldb::Slice key2;
-      leveldb::Slice value2;
+      leveldb::WriteBatch batch;
       char *zArg;
       int i = 0;
 
-      if( objc < 4 || (objc&1)!=0) {
-        Tcl_WrongNumArgs(interp, 2, objv, "key data ?-sync BOOLEAN? ");
+      if( objc < 3 || (objc&1)!=1) {
+        Tcl_WrongNumArgs(interp, 2, objv, "dict ?-sync BOOLEAN? ?-encoding TYPE? ");
         return TCL_ERROR;
       }
 
-      key = Tcl_GetStringFromObj(objv[2], &key_len);
-      if( !key || key_len < 1 ){
-         Tcl_AppendResult(interp, "Error: key is an empty key ", (char*)0);
-         return TCL_ERROR;
-      }
-
-      data = Tcl_GetStringFromObj(objv[3], &data_len);
-      if( !data || data_len < 1 ){
-         Tcl_AppendResult(interp, "Error: data is an empty value ", (char*)0);
-         return TCL_ERROR;
-      }
-
-      for(i=4; i+1<objc; i+=2){
+      for(i=3; i+1<objc; i+=2){
         zArg = Tcl_GetStringFromObj(objv[i], 0);
 
         if( strcmp(zArg, "-sync")==0 ){
@@ -750,45 +6310,44 @@ static int LEVELDB_DBI(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*obj
             }else{
               write_options.sync = false;
             }
+        } else if( strcmp(zArg, "-encoding")==0 ){
+            if( LEVELDB_GetEncodingFromObj(interp, objv[i+1], &binary) ) return TCL_ERROR;
         } else{
            Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
            return TCL_ERROR;
         }
       }
 
-      key2 = leveldb::Slice(key, key_len);
-      value2 = leveldb::Slice(data, data_len);
-      status = db->Put(write_options, key2, value2);
+      if( LEVELDB_BatchPutPairs(interp, &batch, objv[2], binary) != TCL_OK ){
+         return TCL_ERROR;
+      }
+
+      status = LEVELDB_Write(dbInfo->shared, write_options, &batch);
       if(!status.ok()) {
-        Tcl_AppendResult(interp, "Error: put failed", (char*)0);
+        Tcl_AppendResult(interp, "Error: mput failed", (char*)0);
         return TCL_ERROR;
       }
 
       Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      LEVELDB_STAT_END(dbInfo->stats, LEVEL_STAT_MPUT, t0, batch.ApproximateSize());
 
       break;
     }
 
-    case DBI_DELETE: {
+    case DBI_MDELETE: {
       leveldb::Status status;
       leveldb::WriteOptions write_options;
-      const char *key = NULL;
-      Tcl_Size key_len = 0;
-      leveldb::Slice key2;
+      leveldb::WriteBatch batch;
+      Tcl_Obj **keyObjs = NULL;
+      Tcl_Size key_count = 0;
       char *zArg;
       int i = 0;
 
       if( objc < 3 || (objc&1)!=1) {
-        Tcl_WrongNumArgs(interp, 2, objv, "key ?-sync BOOLEAN? ");
+        Tcl_WrongNumArgs(interp, 2, objv, "keyList ?-sync BOOLEAN? ?-encoding TYPE? ");
         return TCL_ERROR;
       }
 
-      key = Tcl_GetStringFromObj(objv[2], &key_len);
-      if( !key || key_len < 1 ){
-         Tcl_AppendResult(interp, "Error: key is an empty key ", (char*)0);
-         return TCL_ERROR;
-      }
-
       for(i=3; i+1<objc; i+=2){
         zArg = Tcl_GetStringFromObj(objv[i], 0);
 
@@ -800,261 +6359,609 @@ static int LEVELDB_DBI(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*obj
             }else{
               write_options.sync = false;
             }
+        } else if( strcmp(zArg, "-encoding")==0 ){
+            if( LEVELDB_GetEncodingFromObj(interp, objv[i+1], &binary) ) return TCL_ERROR;
         } else{
            Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
            return TCL_ERROR;
         }
       }
 
-      key2 = leveldb::Slice(key, key_len);
+      if( Tcl_ListObjGetElements(interp, objv[2], &key_count, &keyObjs) != TCL_OK ){
+         return TCL_ERROR;
+      }
+
+      for(i = 0; i < key_count; i++) {
+        const char *key = NULL;
+        Tcl_Size key_len = 0;
+
+        key = LEVELDB_GetBytesFromObj(interp, keyObjs[i], &key_len, binary);
+        if( !key || key_len < 1 ){
+           Tcl_AppendResult(interp, "Error: key is an empty key ", (char*)0);
+           return TCL_ERROR;
+        }
+
+        batch.Delete(leveldb::Slice(key, key_len));
+      }
 
-      status = db->Delete(write_options, key2);
+      status = LEVELDB_Write(dbInfo->shared, write_options, &batch);
       if(!status.ok()) {
-        Tcl_AppendResult(interp, "Error: delete failed", (char*)0);
+        Tcl_AppendResult(interp, "Error: mdelete failed", (char*)0);
         return TCL_ERROR;
       }
 
       Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      LEVELDB_STAT_END(dbInfo->stats, LEVEL_STAT_MDELETE, t0, batch.ApproximateSize());
 
       break;
     }
 
-    case DBI_WRITE: {
-      leveldb::WriteBatch *batch;
-      leveldb::Status status;
-      Tcl_HashEntry *hashEntryPtr;
-      const char *batch_handle = NULL;
-      Tcl_Size length = 0;
+    case DBI_COMPACT: {
+      Tcl_Obj *startObj = NULL;
+      Tcl_Obj *endObj = NULL;
+      const char *start = NULL;
+      const char *end = NULL;
+      Tcl_Size start_len = 0;
+      Tcl_Size end_len = 0;
+      std::string start2;
+      std::string end2;
+      std::string files;
+      Tcl_Obj *asyncObj = NULL;
+      char *zArg;
+      int i = 0;
 
-      if( objc != 3 ) {
-        Tcl_WrongNumArgs(interp, 2, objv, "batch_handle ");
+      if( (objc&1)!=0 ) {
+        Tcl_WrongNumArgs(interp, 2, objv,
+          "?-start key? ?-end key? ?-encoding TYPE? ?-async CALLBACK? ");
         return TCL_ERROR;
       }
 
-      batch_handle = Tcl_GetStringFromObj(objv[2], &length);
-      hashEntryPtr = Tcl_FindHashEntry( tsdPtr->leveldb_hashtblPtr, batch_handle );
-      if( !hashEntryPtr ) {
-        if( interp ) {
-            Tcl_Obj *resultObj = Tcl_GetObjResult( interp );
+      for(i=2; i+1<objc; i+=2){
+        zArg = Tcl_GetStringFromObj(objv[i], 0);
 
-            Tcl_AppendStringsToObj( resultObj, "invalid batch handle ", batch_handle, (char *)NULL );
+        if( strcmp(zArg, "-start")==0 ){
+            startObj = objv[i+1];
+        } else if( strcmp(zArg, "-end")==0 ){
+            endObj = objv[i+1];
+        } else if( strcmp(zArg, "-encoding")==0 ){
+            if( LEVELDB_GetEncodingFromObj(interp, objv[i+1], &binary) ) return TCL_ERROR;
+        } else if( strcmp(zArg, "-async")==0 ){
+            asyncObj = objv[i+1];
+        } else{
+           Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
+           return TCL_ERROR;
         }
+      }
 
-        return TCL_ERROR;
+      /*
+       * The keys are converted once -encoding is known. Both ends of the
+       * range are inclusive, as for DB::CompactRange.
+       */
+      if( startObj ) {
+        start = LEVELDB_GetBytesFromObj(interp, startObj, &start_len, binary);
+        if( !start ) return TCL_ERROR;
+        start2.assign(start, start_len);
       }
 
-      batch = (leveldb::WriteBatch *)(uintptr_t)Tcl_GetHashValue( hashEntryPtr );
-      status = db->Write(leveldb::WriteOptions(), batch);
-      if(!status.ok()) {
-        Tcl_AppendResult(interp, "Error: write failed", (char*)0);
-        return TCL_ERROR;
+      if( endObj ) {
+        end = LEVELDB_GetBytesFromObj(interp, endObj, &end_len, binary);
+        if( !end ) return TCL_ERROR;
+        end2.assign(end, end_len);
       }
 
-      Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+      if(asyncObj) {
+          LevelAsyncJob *job = new LevelAsyncJob;
+
+          job->op = LEVEL_ASYNC_COMPACT;
+          job->key = start2;
+          job->end = end2;
+          job->has_key = start ? 1 : 0;
+          job->has_end = end ? 1 : 0;
+          job->binary = 0;
+
+          return LEVELDB_AsyncSubmit(interp, dbInfo, job, asyncObj);
+      }
+
+      files = LEVELDB_CompactRange(db, start ? &start2 : NULL, end ? &end2 : NULL);
+      Tcl_SetObjResult(interp, Tcl_NewStringObj(files.c_str(), -1));
 
       break;
     }
 
-    case DBI_BATCH: {
-      leveldb::WriteBatch *batch;
-      Tcl_HashEntry *newHashEntryPtr;
-      char handleName[16 + TCL_INTEGER_SPACE];
+    case DBI_SPLITS: {
+      LevelRange range;
+      std::vector<std::string> keys;
       Tcl_Obj *pResultStr = NULL;
-      int newvalue;
+      int parts = 0;
+      char *zArg;
+      int i = 0;
+      size_t k;
 
-      if( objc != 2 ) {
-        Tcl_WrongNumArgs(interp, 2, objv, 0);
+      if( objc < 3 || (objc&1)!=1 ) {
+        Tcl_WrongNumArgs(interp, 2, objv, "N ?-start key? ?-end key? ?-encoding TYPE? ");
+        return TCL_ERROR;
+      }
+
+      if( Tcl_GetIntFromObj(interp, objv[2], &parts) != TCL_OK ) {
+        return TCL_ERROR;
+      }
+
+      if( parts < 1 ) {
+        Tcl_AppendResult(interp, "Error: N must be a positive number ", (char*)0);
         return TCL_ERROR;
       }
 
-      batch = new leveldb::WriteBatch();
+      for(i=3; i+1<objc; i+=2){
+        zArg = Tcl_GetStringFromObj(objv[i], 0);
 
-      Tcl_MutexLock(&myMutex);
-      sprintf( handleName, "levelbat%d", tsdPtr->bat_count++ );
+        if( strcmp(zArg, "-start")==0 ){
+            range.startObj = objv[i+1];
+        } else if( strcmp(zArg, "-end")==0 ){
+            range.endObj = objv[i+1];
+        } else if( strcmp(zArg, "-encoding")==0 ){
+            if( LEVELDB_GetEncodingFromObj(interp, objv[i+1], &binary) ) return TCL_ERROR;
+        } else{
+           Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
+           return TCL_ERROR;
+        }
+      }
 
-      pResultStr = Tcl_NewStringObj( handleName, -1 );
+      if( LEVELDB_RangeSetup(interp, &range, binary, dbInfo->shared->comparator) != TCL_OK ) {
+        return TCL_ERROR;
+      }
 
-      newHashEntryPtr = Tcl_CreateHashEntry(tsdPtr->leveldb_hashtblPtr, handleName, &newvalue);
-      Tcl_SetHashValue(newHashEntryPtr, (ClientData)(uintptr_t) batch);
-      Tcl_MutexUnlock(&myMutex);
+      LEVELDB_SplitKeys(db, &range, parts, &keys);
 
-      Tcl_CreateObjCommand(interp, handleName, (Tcl_ObjCmdProc *) LEVELDB_BAT,
-          (ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
+      pResultStr = Tcl_NewListObj(0, NULL);
+      for(k = 0; k < keys.size(); k++) {
+        Tcl_ListObjAppendElement(interp, pResultStr,
+                                 LEVELDB_NewBytesObj(keys[k].data(), keys[k].size(), binary));
+      }
 
       Tcl_SetObjResult(interp, pResultStr);
 
       break;
     }
 
-    case DBI_ITERATOR: {
-      leveldb::ReadOptions read_options;
-      Tcl_HashEntry *newHashEntryPtr;
-      char handleName[16 + TCL_INTEGER_SPACE];
+    case DBI_STATS: {
+      int reset = 0;
+
+      if( objc != 2 && objc != 3 ){
+        Tcl_WrongNumArgs(interp, 2, objv, "?-reset? ");
+        return TCL_ERROR;
+      }
+
+      if( objc == 3 ) {
+        if( strcmp(Tcl_GetString(objv[2]), "-reset") ) {
+          Tcl_AppendResult(interp, "unknown option: ",
+                           Tcl_GetString(objv[2]), (char*)0);
+          return TCL_ERROR;
+        }
+        reset = 1;
+      }
+
+      if( !dbInfo->stats ) {
+        Tcl_AppendResult(interp, "Error: statistics are not compiled in", (char*)0);
+        return TCL_ERROR;
+      }
+
+      Tcl_SetObjResult(interp, LEVELDB_StatsObj(dbInfo->stats));
+      if( reset ) {
+        memset(dbInfo->stats->ops, 0, sizeof(dbInfo->stats->ops));
+      }
+
+      break;
+    }
+
+    case DBI_PROPERTIES: {
+      int binary = dbInfo->binary;
+
+      if( objc != 2 && objc != 4 ){
+        Tcl_WrongNumArgs(interp, 2, objv, "?-encoding TYPE? ");
+        return TCL_ERROR;
+      }
+
+      if( objc == 4 ) {
+        const char *zArg = Tcl_GetStringFromObj(objv[2], 0);
+
+        if( strcmp(zArg, "-encoding") ) {
+          Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
+          return TCL_ERROR;
+        }
+        if( LEVELDB_GetEncodingFromObj(interp, objv[3], &binary) ) return TCL_ERROR;
+      }
+
+      Tcl_SetObjResult(interp, LEVELDB_PropertiesObj(db, binary));
+
+      break;
+    }
+
+    case DBI_LOAD: {
+      LevelLoad load;
+      leveldb::WriteOptions write_options;
+      Tcl_Obj *fileObj = NULL;
       Tcl_Obj *pResultStr = NULL;
-      int newvalue;
-      const leveldb::Snapshot* shot = NULL;
-      Tcl_HashEntry *sstHashEntryPtr;
-      const char *sstHandle = NULL;
-      Tcl_Size sst_length = 0;
+      Tcl_WideInt batch_bytes = 4 * 1048576;
+      Tcl_WideInt records = 0;
+      Tcl_WideInt batches = 0;
+      std::string error;
+      std::chrono::steady_clock::time_point start;
+      double seconds;
+      int format = LEVEL_LOAD_TSV;
+      int threads = 1;
+      int sort = 0;
       char *zArg;
       int i = 0;
 
-      if( objc < 2 || (objc&1)!=0) {
-        Tcl_WrongNumArgs(interp, 2, objv, "?-snapshot HANDLE? ");
+      if( objc < 4 || (objc&1)!=0 ) {
+        Tcl_WrongNumArgs(interp, 2, objv,
+          "-file PATH ?-format tsv|binary? ?-batch_bytes N? ?-threads N? ?-sort BOOLEAN? ?-sync BOOLEAN? ");
         return TCL_ERROR;
       }
 
       for(i=2; i+1<objc; i+=2){
         zArg = Tcl_GetStringFromObj(objv[i], 0);
 
-        if( strcmp(zArg, "-snapshot")==0 ){
-            sstHandle = Tcl_GetStringFromObj(objv[i+1], &sst_length);
-
-            if( !sstHandle || sst_length < 1) {
+        if( strcmp(zArg, "-file")==0 ){
+            fileObj = objv[i+1];
+        } else if( strcmp(zArg, "-format")==0 ){
+            if( Tcl_GetIndexFromObj(interp, objv[i+1], LevelLoadFormats, "format", 0, &format) ){
               return TCL_ERROR;
             }
+        } else if( strcmp(zArg, "-batch_bytes")==0 ){
+            if(Tcl_GetWideIntFromObj(interp, objv[i+1], &batch_bytes) != TCL_OK) {
+                return TCL_ERROR;
+            }
+        } else if( strcmp(zArg, "-threads")==0 ){
+            if(Tcl_GetIntFromObj(interp, objv[i+1], &threads) != TCL_OK) {
+                return TCL_ERROR;
+            }
+        } else if( strcmp(zArg, "-sort")==0 ){
+            if( Tcl_GetBooleanFromObj(interp, objv[i+1], &sort) ) return TCL_ERROR;
+        } else if( strcmp(zArg, "-sync")==0 ){
+            int b;
+            if( Tcl_GetBooleanFromObj(interp, objv[i+1], &b) ) return TCL_ERROR;
+            if( b ){
+              write_options.sync = true;
+            }else{
+              write_options.sync = false;
+            }
         } else{
            Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
            return TCL_ERROR;
         }
       }
 
-      if(sstHandle) {
-          sstHashEntryPtr = Tcl_FindHashEntry( tsdPtr->leveldb_hashtblPtr, sstHandle );
-          if( !sstHashEntryPtr ) {
-            if( interp ) {
-                Tcl_Obj *resultObj = Tcl_GetObjResult( interp );
-
-                Tcl_AppendStringsToObj( resultObj, "invalid snapshot handle ", sstHandle, (char *)NULL );
-            }
+      if( !fileObj ) {
+        Tcl_AppendResult(interp, "Error: -file is required ", (char*)0);
+        return TCL_ERROR;
+      }
 
-            return TCL_ERROR;
-          }
+      if( batch_bytes <= 0 || threads <= 0 ) {
+        Tcl_AppendResult(interp, "Error: -batch_bytes and -threads must be positive numbers ", (char*)0);
+        return TCL_ERROR;
+      }
 
-          shot = (leveldb::Snapshot *)(uintptr_t)Tcl_GetHashValue( sstHashEntryPtr );
-          read_options.snapshot = shot;
+      /*
+       * Through the Tcl filesystem, so -file can be in a VFS (e.g. a
+       * mounted zip or starkit).
+       */
+      load.chan = Tcl_FSOpenFileChannel(interp, fileObj, "r", 0);
+      if( !load.chan ) {
+        return TCL_ERROR;
+      }
+      if( Tcl_SetChannelOption(interp, load.chan, "-translation", "binary") != TCL_OK ) {
+        Tcl_Close(NULL, load.chan);
+        return TCL_ERROR;
       }
 
-      leveldb::Iterator* it = db->NewIterator(read_options);
+      load.format = format;
+      load.framed = 0;
+      load.sort = sort;
+      load.batch_bytes = (size_t) batch_bytes;
+      load.offset = 0;
+      load.eof = 0;
 
-      Tcl_MutexLock(&myMutex);
-      sprintf( handleName, "levelitr%d", tsdPtr->itr_count++ );
+      /*
+       * Bytes read to look for the dump header are handed to the first
+       * chunk, so the file need not be seekable.
+       */
+      if( format == LEVEL_LOAD_BINARY ) {
+        char magic[sizeof(LevelDumpMagic)];
+        Tcl_Size n = Tcl_Read(load.chan, magic, sizeof(magic));
+
+        if( n < 0 ) {
+          Tcl_AppendResult(interp, "Error: load failed: ",
+                           Tcl_ErrnoMsg(Tcl_GetErrno()), (char*)0);
+          Tcl_Close(NULL, load.chan);
+          return TCL_ERROR;
+        }
+        if( n == sizeof(magic) && memcmp(magic, LevelDumpMagic, n) == 0 ) {
+          load.framed = 1;
+          load.offset = n;
+        } else {
+          load.carry.assign(magic, n);
+        }
+      }
+      load.mutex = NULL;
+      load.cond = NULL;
+      load.stop = 0;
 
-      pResultStr = Tcl_NewStringObj( handleName, -1 );
+      start = std::chrono::steady_clock::now();
+      error = LEVELDB_Load(dbInfo, &load, threads, write_options, &records, &batches);
+      seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-      newHashEntryPtr = Tcl_CreateHashEntry(tsdPtr->leveldb_hashtblPtr, handleName, &newvalue);
-      Tcl_SetHashValue(newHashEntryPtr, (ClientData)(uintptr_t) it);
-      Tcl_MutexUnlock(&myMutex);
+      Tcl_Close(NULL, load.chan);
+      Tcl_MutexFinalize(&load.mutex);
+      Tcl_ConditionFinalize(&load.cond);
 
-      Tcl_CreateObjCommand(interp, handleName, (Tcl_ObjCmdProc *) LEVELDB_ITR,
-          (ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
+      if( !error.empty() ) {
+        Tcl_AppendResult(interp, "Error: load failed: ", error.c_str(), (char*)0);
+        return TCL_ERROR;
+      }
 
+      pResultStr = Tcl_NewListObj(0, NULL);
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewStringObj("records", -1));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewWideIntObj(records));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewStringObj("batches", -1));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewWideIntObj(batches));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewStringObj("bytes", -1));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewWideIntObj(load.offset));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewStringObj("seconds", -1));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewDoubleObj(seconds));
       Tcl_SetObjResult(interp, pResultStr);
 
       break;
     }
 
-
-    case DBI_SNAPSHOT: {
-      Tcl_HashEntry *newHashEntryPtr;
-      char handleName[16 + TCL_INTEGER_SPACE];
+    case DBI_DUMP: {
+      LevelDump *dump;
+      LevelRange range;
+      Tcl_Channel chan;
+      Tcl_Obj *sstObj = NULL;
+      Tcl_Obj *callback = NULL;
       Tcl_Obj *pResultStr = NULL;
-      int newvalue;
-      const leveldb::Snapshot* shot;
+      const leveldb::Snapshot *shot = NULL;
+      std::string error;
+      int format = LEVEL_LOAD_BINARY;
+      int handled = 0;
+      int mode;
+      char *zArg;
+      int i = 0;
 
-      if( objc != 2 ) {
-        Tcl_WrongNumArgs(interp, 2, objv, 0);
+      if( objc < 3 || (objc&1)!=1 ) {
+        Tcl_WrongNumArgs(interp, 2, objv,
+          "CHANNEL ?-format binary|tsv? ?-start key? ?-end key? ?-prefix prefix? \
+           ?-reverse BOOLEAN? ?-snapshot HANDLE? ?-encoding TYPE? ?-command CALLBACK? ");
+        return TCL_ERROR;
+      }
+
+      chan = Tcl_GetChannel(interp, Tcl_GetString(objv[2]), &mode);
+      if( !chan ) {
         return TCL_ERROR;
       }
+      if( !(mode & TCL_WRITABLE) ) {
+        Tcl_AppendResult(interp, "channel \"", Tcl_GetString(objv[2]),
+                         "\" wasn't opened for writing", (char*)0);
+        return TCL_ERROR;
+      }
+
+      for(i=3; i+1<objc; i+=2){
+        zArg = Tcl_GetStringFromObj(objv[i], 0);
+
+        if( LEVELDB_RangeOption(interp, &range, zArg, objv[i+1], &handled) ){
+            return TCL_ERROR;
+        } else if( handled ){
+            continue;
+        } else if( strcmp(zArg, "-format")==0 ){
+            if( Tcl_GetIndexFromObj(interp, objv[i+1], LevelLoadFormats, "format", 0, &format) ){
+              return TCL_ERROR;
+            }
+        } else if( strcmp(zArg, "-snapshot")==0 ){
+            sstObj = objv[i+1];
+        } else if( strcmp(zArg, "-encoding")==0 ){
+            if( LEVELDB_GetEncodingFromObj(interp, objv[i+1], &binary) ) return TCL_ERROR;
+        } else if( strcmp(zArg, "-command")==0 ){
+            callback = objv[i+1];
+        } else{
+           Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
+           return TCL_ERROR;
+        }
+      }
+
+      if( LEVELDB_RangeSetup(interp, &range, binary, dbInfo->shared->comparator) ){
+          return TCL_ERROR;
+      }
 
-      shot = db->GetSnapshot();
+      /*
+       * Without -snapshot the dump takes its own, so it is consistent
+       * while other threads keep writing. A -command dump outlives the
+       * command, so it cannot borrow a snapshot handle.
+       */
+      if(sstObj) {
+          if(callback) {
+            Tcl_AppendResult(interp, "Error: -snapshot cannot be used with -command", (char*)0);
+            return TCL_ERROR;
+          }
+          shot = LEVELDB_GetSnapshotFromObj(interp, sstObj, dbInfo);
+          if( !shot ) {
+            return TCL_ERROR;
+          }
+      }
 
-      Tcl_MutexLock(&myMutex);
-      sprintf( handleName, "levelsst%d", tsdPtr->sst_count++ );
+      dump = new LevelDump;
+      dump->db = db;
+      dump->own_snapshot = shot == NULL;
+      dump->read_options.snapshot = shot ? shot : db->GetSnapshot();
+      dump->read_options.fill_cache = false;
+      dump->range = range;
+      dump->format = format;
+      dump->chan = chan;
+      dump->mutex = NULL;
+      dump->cond = NULL;
+      dump->done = 0;
+      dump->stop = 0;
+      dump->records = 0;
+      dump->nbytes = 0;
+      dump->start = std::chrono::steady_clock::now();
+      dump->dbInfo = NULL;
+      dump->interp = NULL;
+      dump->callback = NULL;
+      dump->events = 0;
+
+      if( format == LEVEL_LOAD_BINARY ) {
+        if( Tcl_Write(chan, LevelDumpMagic, sizeof(LevelDumpMagic)) < 0 ) {
+          error = Tcl_PosixError(interp);
+        }
+        dump->nbytes = sizeof(LevelDumpMagic);
+      }
 
-      pResultStr = Tcl_NewStringObj( handleName, -1 );
+      if( error.empty() && callback ) {
+        dump->dbInfo = dbInfo;
+        dbInfo->refCount++;
+        dump->interp = interp;
+        Tcl_Preserve(interp);
+        dump->callback = callback;
+        Tcl_IncrRefCount(callback);
+        dump->owner = Tcl_GetCurrentThread();
+        Tcl_RegisterChannel(NULL, chan);
+      }
 
-      newHashEntryPtr = Tcl_CreateHashEntry(tsdPtr->leveldb_hashtblPtr, handleName, &newvalue);
-      Tcl_SetHashValue(newHashEntryPtr, (ClientData)(uintptr_t) shot);
-      Tcl_MutexUnlock(&myMutex);
+      if( error.empty() &&
+          Tcl_CreateThread(&dump->thread, LEVELDB_DumpThread, dump,
+                           TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK ) {
+        error = "cannot create thread";
+        if( callback ) {
+          Tcl_UnregisterChannel(NULL, chan);
+          Tcl_DecrRefCount(callback);
+          Tcl_Release(interp);
+          LEVELDB_ReleaseDB(dbInfo);
+        }
+      }
 
-      Tcl_CreateObjCommand(interp, handleName, (Tcl_ObjCmdProc *) LEVELDB_SST,
-          (ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
+      if( !error.empty() ) {
+        if( dump->own_snapshot ) {
+          db->ReleaseSnapshot(dump->read_options.snapshot);
+        }
+        delete dump;
 
-      Tcl_SetObjResult(interp, pResultStr);
+        Tcl_ResetResult(interp);
+        Tcl_AppendResult(interp, "Error: dump failed: ", error.c_str(), (char*)0);
+        return TCL_ERROR;
+      }
 
-      break;
-    }
+      if( callback ) {
+        Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
+        break;
+      }
 
+      LEVELDB_DumpWrite(dump, 1);
+      pResultStr = LEVELDB_DumpFinish(dump, &error);
+      if( !pResultStr ) {
+        Tcl_AppendResult(interp, "Error: dump failed: ", error.c_str(), (char*)0);
+        return TCL_ERROR;
+      }
+      Tcl_SetObjResult(interp, pResultStr);
 
-    case DBI_GETAPPROXIMATESIZES: {
-      const char *start = NULL;
-      Tcl_Size start_len = 0;
-      const char *limit = NULL;
-      Tcl_Size limit_len = 0;
-      leveldb::Slice start2;
-      leveldb::Slice limit2;
-      uint64_t sizes;
+      break;
+    }
+
+    case DBI_CHECKPOINT: {
+      Tcl_Obj *dirObj;
       Tcl_Obj *pResultStr = NULL;
+      Tcl_Obj *normObj;
+      Tcl_StatBuf *statBuf;
+      int exists;
+      Tcl_WideInt tables = 0;
+      Tcl_WideInt linked = 0;
+      Tcl_WideInt copied = 0;
+      Tcl_WideInt nbytes = 0;
+      std::string dir;
+      std::string error;
+      std::chrono::steady_clock::time_point start;
+      double seconds;
 
-      if( objc != 4 ){
-        Tcl_WrongNumArgs(interp, 2, objv, "start limit ");
+      if( objc != 3 ){
+        Tcl_WrongNumArgs(interp, 2, objv, "DIR");
         return TCL_ERROR;
       }
 
-      start = Tcl_GetStringFromObj(objv[2], &start_len);
-      if( !start || start_len < 1 ){
-         Tcl_AppendResult(interp, "Error: start is an empty string ", (char*)0);
-         return TCL_ERROR;
+      if( dbInfo->shared->inmemory ) {
+        Tcl_AppendResult(interp, "Error: cannot checkpoint an in-memory database", (char*)0);
+        return TCL_ERROR;
       }
 
-      limit = Tcl_GetStringFromObj(objv[3], &limit_len);
-      if( !limit || limit_len < 1 ){
-         Tcl_AppendResult(interp, "Error: limit is an empty string ", (char*)0);
-         return TCL_ERROR;
+      dirObj = objv[2];
+      statBuf = Tcl_AllocStatBuf();
+      exists = Tcl_FSStat(dirObj, statBuf) == 0;
+      ckfree(statBuf);
+      if( !exists && Tcl_FSCreateDirectory(dirObj) != TCL_OK ) {
+        Tcl_AppendResult(interp, "Error: couldn't create \"", Tcl_GetString(dirObj),
+                         "\": ", Tcl_PosixError(interp), (char*)0);
+        return TCL_ERROR;
       }
 
-      start2 = leveldb::Slice(start, start_len);
-      limit2 = leveldb::Slice(limit, limit_len);
+      normObj = Tcl_FSGetNormalizedPath(interp, dirObj);
+      if( !normObj ) {
+        return TCL_ERROR;
+      }
+      dir = Tcl_GetString(normObj);
+      if( dir == dbInfo->shared->path ) {
+        Tcl_AppendResult(interp, "Error: cannot checkpoint a database into itself", (char*)0);
+        return TCL_ERROR;
+      }
 
-      leveldb::Range ranges = leveldb::Range(start2, limit2);
-      db->GetApproximateSizes(&ranges, 1, &sizes);
+      start = std::chrono::steady_clock::now();
+      error = LEVELDB_Checkpoint(dbInfo, dir, &tables, &linked, &copied, &nbytes);
+      seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-      pResultStr = Tcl_NewWideIntObj( (Tcl_WideInt) sizes);
+      if( !error.empty() ) {
+        Tcl_AppendResult(interp, "Error: checkpoint failed: ", error.c_str(), (char*)0);
+        return TCL_ERROR;
+      }
+
+      pResultStr = Tcl_NewListObj(0, NULL);
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewStringObj("tables", -1));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewWideIntObj(tables));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewStringObj("linked", -1));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewWideIntObj(linked));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewStringObj("copied", -1));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewWideIntObj(copied));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewStringObj("bytes", -1));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewWideIntObj(nbytes));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewStringObj("seconds", -1));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewDoubleObj(seconds));
       Tcl_SetObjResult(interp, pResultStr);
 
       break;
     }
 
-    case DBI_GETPROPERTY: {
-      const char *key = NULL;
-      Tcl_Size key_len = 0;
-      leveldb::Slice property;
-      std::string value2;
-      bool result;
-      Tcl_Obj *pResultStr = NULL;
+    case DBI_IOSTATS: {
+      int reset = 0;
+      LevelIOStats stats[LEVEL_IO_CLASSES];
 
-      if( objc != 3 ){
-        Tcl_WrongNumArgs(interp, 2, objv, "property ");
+      if( objc != 2 && objc != 3 ){
+        Tcl_WrongNumArgs(interp, 2, objv, "?-reset? ");
         return TCL_ERROR;
       }
 
-      key = Tcl_GetStringFromObj(objv[2], &key_len);
-      if( !key || key_len < 1 ){
-         Tcl_AppendResult(interp, "Error: property is an empty string ", (char*)0);
-         return TCL_ERROR;
+      if( objc == 3 ) {
+        if( strcmp(Tcl_GetString(objv[2]), "-reset") ) {
+          Tcl_AppendResult(interp, "unknown option: ",
+                           Tcl_GetString(objv[2]), (char*)0);
+          return TCL_ERROR;
+        }
+        reset = 1;
       }
 
-      property = leveldb::Slice(key, key_len);
-      result = db->GetProperty(property, &value2);
-
-      if(!result) {
-         Tcl_AppendResult(interp, "Error: is not a valid property ", (char*)0);
-         return TCL_ERROR;
+      if( !dbInfo->shared->io_env ) {
+        Tcl_AppendResult(interp, "Error: the database was not opened with -io_stats",
+                         (char*)0);
+        return TCL_ERROR;
       }
 
-      pResultStr = Tcl_NewStringObj(value2.c_str(), value2.length());
-      Tcl_SetObjResult(interp, pResultStr);
+      dbInfo->shared->io_env->Get(stats, reset);
+      Tcl_SetObjResult(interp, LEVELDB_IOStatsObj(stats));
 
       break;
     }
@@ -1065,13 +6972,12 @@ static int LEVELDB_DBI(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*obj
         return TCL_ERROR;
       }
 
-      delete db;
-
-      Tcl_MutexLock(&myMutex);
-      if( hashEntryPtr )  Tcl_DeleteHashEntry(hashEntryPtr);
-      Tcl_MutexUnlock(&myMutex);
+      if( dbInfo->busy > 0 ){
+        Tcl_AppendResult(interp, "Error: database is in use by foreach", (char*)0);
+        return TCL_ERROR;
+      }
 
-      Tcl_DeleteCommand(interp, dbiHandle);
+      Tcl_DeleteCommandFromToken(interp, dbInfo->handle->token);
       Tcl_SetObjResult(interp, Tcl_NewIntObj( 0 ));
 
       break;
@@ -1085,20 +6991,14 @@ static int LEVELDB_DBI(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*obj
 static int LEVELDB_MAIN(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*objv){
   int choice;
 
-  ThreadSpecificData *tsdPtr = (ThreadSpecificData *)
-      Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
-
-  if (tsdPtr->initialized == 0) {
-    tsdPtr->initialized = 1;
-    tsdPtr->leveldb_hashtblPtr = (Tcl_HashTable *) ckalloc(sizeof(Tcl_HashTable));
-    Tcl_InitHashTable(tsdPtr->leveldb_hashtblPtr, TCL_STRING_KEYS);
-  }
-
   static const char *DB_strs[] = {
     "open",
     "repair",
     "destroy",
     "version",
+    "cache",
+    "bench",
+    "tuple",
     0
   };
 
@@ -1107,6 +7007,9 @@ static int LEVELDB_MAIN(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*ob
     DB_REPAIR,
     DB_DESTROY,
     DB_VERSION,
+    DB_CACHE,
+    DB_BENCH,
+    DB_TUPLE,
   };
 
   if( objc < 2 ){
@@ -1125,19 +7028,37 @@ static int LEVELDB_MAIN(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*ob
       leveldb::DB* db;
       leveldb::Options options;
       leveldb::Status status;
-      Tcl_HashEntry *newHashEntryPtr;
+      LevelDBInfo *dbInfo;
+      LevelSharedDB *shared = NULL;
+      const leveldb::FilterPolicy *filter_policy = NULL;
+      std::map<std::string, LevelSharedDB *>::iterator entry;
+      std::string canonical;
+      Tcl_Obj *pathObj = NULL;
       const char *path = NULL;
       Tcl_Size len;
-      char handleName[16 + TCL_INTEGER_SPACE];
       Tcl_Obj *pResultStr = NULL;
-      int newvalue;
       int i = 0;
+      int bloom_bits_per_key = 0;
+      int bloom_prefix_len = 0;
+      LevelCacheInfo *cacheInfo = NULL;
+      int group_commit_us = 0;
+      int binary = 0;
+      int inmemory = 0;
+      int io_stats = 0;
+      LevelIOEnv *io_env = NULL;
+#ifndef LEVELDB_NO_MEMENV
+      leveldb::Env *newEnv = NULL;
+#endif
 
       if( objc < 4 || (objc&1)!=0 ){
           Tcl_WrongNumArgs(interp, 2, objv,
           "-path path ?-create_if_missing BOOLEAN? ?-error_if_exists BOOLEAN? \
            ?-paranoid_checks BOOLEAN? ?-write_buffer_size size? \
-           ?-max_open_files number? ?-block_size size? ?-compression type? "
+           ?-max_open_files number? ?-block_size size? ?-compression type? \
+           ?-bloom_bits_per_key number? ?-bloom_prefix_len length? \
+           ?-block_cache CACHE_HANDLE? ?-group_commit_window_us N? \
+           ?-comparator TYPE? ?-encoding TYPE? ?-inmemory BOOLEAN? \
+           ?-io_stats BOOLEAN? "
           );
 
         return TCL_ERROR;
@@ -1147,7 +7068,8 @@ static int LEVELDB_MAIN(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*ob
         zArg = Tcl_GetStringFromObj(objv[i], 0);
 
         if( strcmp(zArg, "-path")==0 ){
-            path = Tcl_GetStringFromObj(objv[i+1], &len);
+            pathObj = objv[i+1];
+            path = Tcl_GetStringFromObj(pathObj, &len);
             if(!path || len < 1) {
                 return TCL_ERROR;
             }
@@ -1223,6 +7145,43 @@ static int LEVELDB_MAIN(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*ob
             } else {
                 return TCL_ERROR;
             }
+        } else if( strcmp(zArg, "-bloom_bits_per_key")==0 ){
+            if(Tcl_GetIntFromObj(interp, objv[i+1], &bloom_bits_per_key) != TCL_OK) {
+                return TCL_ERROR;
+            }
+        } else if( strcmp(zArg, "-bloom_prefix_len")==0 ){
+            if(Tcl_GetIntFromObj(interp, objv[i+1], &bloom_prefix_len) != TCL_OK) {
+                return TCL_ERROR;
+            }
+        } else if( strcmp(zArg, "-block_cache")==0 ){
+            cacheInfo = (LevelCacheInfo *) LEVELDB_GetHandleFromObj(interp, objv[i+1], LEVEL_HANDLE_CACHE);
+            if( !cacheInfo ) {
+                return TCL_ERROR;
+            }
+        } else if( strcmp(zArg, "-group_commit_window_us")==0 ){
+            if(Tcl_GetIntFromObj(interp, objv[i+1], &group_commit_us) != TCL_OK) {
+                return TCL_ERROR;
+            }
+
+            if(group_commit_us < 0) {
+                Tcl_AppendResult(interp, "Error: window must not be negative ", (char*)0);
+                return TCL_ERROR;
+            }
+        } else if( strcmp(zArg, "-comparator")==0 ){
+            int index;
+
+            if( Tcl_GetIndexFromObj(interp, objv[i+1], LevelComparatorNames,
+                                    "comparator", 0, &index) ) {
+                return TCL_ERROR;
+            }
+
+            options.comparator = LEVELDB_GetComparator(index);
+        } else if( strcmp(zArg, "-encoding")==0 ){
+            if( LEVELDB_GetEncodingFromObj(interp, objv[i+1], &binary) ) return TCL_ERROR;
+        } else if( strcmp(zArg, "-inmemory")==0 ){
+            if( Tcl_GetBooleanFromObj(interp, objv[i+1], &inmemory) ) return TCL_ERROR;
+        } else if( strcmp(zArg, "-io_stats")==0 ){
+            if( Tcl_GetBooleanFromObj(interp, objv[i+1], &io_stats) ) return TCL_ERROR;
         } else{
            Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
            return TCL_ERROR;
@@ -1238,29 +7197,144 @@ static int LEVELDB_MAIN(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*ob
           return TCL_ERROR;
       }
 
-      status = leveldb::DB::Open(options, path, &db);
+      /*
+       * Attach to the database if it is already open in this process.
+       * Then the options of the first open are in effect, except for
+       * -encoding which belongs to the handle. The -comparator has to
+       * be the same.
+       */
+      if(inmemory) {
+#ifdef LEVELDB_NO_MEMENV
+          Tcl_AppendResult(interp, "Error: in-memory databases are not compiled in", (char*)0);
+          return TCL_ERROR;
+#endif
+          canonical = LEVELDB_MEMENV_PREFIX;
+          canonical += path;
+      } else {
+          pathObj = Tcl_FSGetNormalizedPath(interp, pathObj);
+          if(!pathObj) {
+              return TCL_ERROR;
+          }
+          canonical = Tcl_GetString(pathObj);
+      }
+
+      Tcl_MutexLock(&registryMutex);
+      entry = levelSharedDBs.find(canonical);
+      if(entry != levelSharedDBs.end()) {
+          if(options.error_if_exists) {
+              Tcl_MutexUnlock(&registryMutex);
 
-      if(!status.ok()) {
-          if( interp ) {
-            Tcl_Obj *resultObj = Tcl_GetObjResult( interp );
-            Tcl_AppendStringsToObj( resultObj, "ERROR: open failed", (char *)NULL );
+              Tcl_AppendResult(interp, "ERROR: open failed", (char*)0);
+              return TCL_ERROR;
           }
 
-          return TCL_ERROR;
-      }
+          shared = entry->second;
+          if(shared->comparator != options.comparator) {
+              Tcl_MutexUnlock(&registryMutex);
+
+              Tcl_AppendResult(interp, "ERROR: open failed: ", options.comparator->Name(),
+                               " does not match existing comparator ",
+                               shared->comparator->Name(), (char*)0);
+              return TCL_ERROR;
+          }
+          shared->refCount++;
+      } else {
+          /*
+           * A prefix length without bits per key uses the leveldb
+           * suggested value of 10 bits per key.
+           */
+          if(bloom_prefix_len > 0) {
+              if(bloom_bits_per_key <= 0) {
+                  bloom_bits_per_key = 10;
+              }
+
+              filter_policy = new PrefixBloomFilterPolicy(bloom_bits_per_key,
+                                                          bloom_prefix_len);
+          } else if(bloom_bits_per_key > 0) {
+              filter_policy = leveldb::NewBloomFilterPolicy(bloom_bits_per_key);
+          }
+          options.filter_policy = filter_policy;
 
-      Tcl_MutexLock(&myMutex);
-      sprintf( handleName, "leveldbi%d", tsdPtr->dbi_count++ );
+          if(cacheInfo) {
+              options.block_cache = cacheInfo->cache;
+          }
+
+#ifndef LEVELDB_NO_MEMENV
+          if(inmemory) {
+              if(levelMemEnvs.find(path) == levelMemEnvs.end()) {
+                  newEnv = leveldb::NewMemEnv(leveldb::Env::Default());
+                  levelMemEnvs[path] = newEnv;
+              }
+              options.env = levelMemEnvs[path];
+          }
+#endif
+
+          if(io_stats) {
+              io_env = new LevelIOEnv(options.env);
+              options.env = io_env;
+          }
+
+          status = leveldb::DB::Open(options, path, &db);
+
+          if(!status.ok()) {
+              delete io_env;
+#ifndef LEVELDB_NO_MEMENV
+              if(newEnv) {
+                  levelMemEnvs.erase(path);
+                  delete newEnv;
+              }
+#endif
+              Tcl_MutexUnlock(&registryMutex);
+              delete filter_policy;
+
+              if( interp ) {
+                Tcl_Obj *resultObj = Tcl_GetObjResult( interp );
+                Tcl_AppendStringsToObj( resultObj, "ERROR: open failed", (char *)NULL );
+                if( status.IsInvalidArgument() ) {
+                  Tcl_AppendStringsToObj( resultObj, ": ", status.ToString().c_str(),
+                                          (char *)NULL );
+                }
+              }
+
+              return TCL_ERROR;
+          }
 
-      pResultStr = Tcl_NewStringObj( handleName, -1 );
+          shared = new LevelSharedDB;
+          shared->path = canonical;
+          shared->db = db;
+          shared->filter_policy = filter_policy;
+          shared->comparator = options.comparator;
+          shared->cache_info = NULL;
+          shared->inmemory = inmemory;
+          shared->io_env = io_env;
+          shared->refCount = 1;
+          shared->group_commit_us = group_commit_us;
+          shared->commitMutex = NULL;
+          shared->commitCond = NULL;
+          shared->windowCond = NULL;
+          shared->leader = 0;
+
+          Tcl_MutexLock(&myMutex);
+          if(cacheInfo) {
+              cacheInfo->refCount++;
+              shared->cache_info = cacheInfo;
+          }
+          Tcl_MutexUnlock(&myMutex);
 
-      newHashEntryPtr = Tcl_CreateHashEntry(tsdPtr->leveldb_hashtblPtr, handleName, &newvalue);
-      Tcl_SetHashValue(newHashEntryPtr, (ClientData)(uintptr_t) db);
-      Tcl_MutexUnlock(&myMutex);
+          levelSharedDBs[canonical] = shared;
+      }
+      Tcl_MutexUnlock(&registryMutex);
 
+      dbInfo = new LevelDBInfo;
+      dbInfo->db = shared->db;
+      dbInfo->shared = shared;
+      dbInfo->stats = LEVELDB_NewStats();
+      dbInfo->refCount = 1;
+      dbInfo->busy = 0;
+      dbInfo->binary = binary;
 
-      Tcl_CreateObjCommand(interp, handleName, (Tcl_ObjCmdProc *) LEVELDB_DBI,
-          (ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
+      dbInfo->handle = LEVELDB_NewHandle(interp, "leveldbi", LEVEL_HANDLE_DBI,
+          dbInfo, (Tcl_ObjCmdProc *) LEVELDB_DBI, LEVELDB_DBI_Delete, &pResultStr);
 
       Tcl_SetObjResult(interp, pResultStr);
 
@@ -1311,12 +7385,23 @@ static int LEVELDB_MAIN(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*ob
       const char *name;
       Tcl_Size name_len = 0;
       std::string name2;
+      int inmemory = 0;
 
-      if( objc != 3){
-        Tcl_WrongNumArgs(interp, 2, objv, "name ");
+      if( objc != 3 && objc != 5 ){
+        Tcl_WrongNumArgs(interp, 2, objv, "name ?-inmemory BOOLEAN? ");
         return TCL_ERROR;
       }
 
+      if( objc == 5 ) {
+        char *zArg = Tcl_GetStringFromObj(objv[3], 0);
+
+        if( strcmp(zArg, "-inmemory")!=0 ){
+           Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
+           return TCL_ERROR;
+        }
+        if( Tcl_GetBooleanFromObj(interp, objv[4], &inmemory) ) return TCL_ERROR;
+      }
+
       name = Tcl_GetStringFromObj(objv[2], &name_len);
       if(!name || name_len < 1) {
           return TCL_ERROR;
@@ -1324,7 +7409,34 @@ static int LEVELDB_MAIN(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*ob
 
       name2 = name;
 
-      status = leveldb::DestroyDB(name2, options);
+      if(inmemory) {
+#ifdef LEVELDB_NO_MEMENV
+          Tcl_AppendResult(interp, "Error: in-memory databases are not compiled in", (char*)0);
+          return TCL_ERROR;
+#else
+          std::map<std::string, leveldb::Env *>::iterator env;
+
+          /*
+           * A memory Env does not lock its files, so an open database is
+           * found in the registry instead.
+           */
+          Tcl_MutexLock(&registryMutex);
+          env = levelMemEnvs.find(name2);
+          if(levelSharedDBs.count(LEVELDB_MEMENV_PREFIX + name2)) {
+              status = leveldb::Status::IOError(name2, "database is open");
+          } else if(env != levelMemEnvs.end()) {
+              options.env = env->second;
+              status = leveldb::DestroyDB(name2, options);
+              if(status.ok()) {
+                  delete env->second;
+                  levelMemEnvs.erase(env);
+              }
+          }
+          Tcl_MutexUnlock(&registryMutex);
+#endif
+      } else {
+          status = leveldb::DestroyDB(name2, options);
+      }
       if(!status.ok()) {
           if( interp ) {
             Tcl_Obj *resultObj = Tcl_GetObjResult( interp );
@@ -1359,6 +7471,301 @@ static int LEVELDB_MAIN(void *cd, Tcl_Interp *interp, int objc,Tcl_Obj *const*ob
 
       break;
     }
+
+    case DB_CACHE: {
+      char *zArg;
+      LevelCacheInfo *cacheInfo;
+      Tcl_Obj *pResultStr = NULL;
+      Tcl_WideInt capacity = 0;
+      int i = 0;
+
+      if( objc != 5 ){
+        Tcl_WrongNumArgs(interp, 2, objv, "create -capacity bytes ");
+        return TCL_ERROR;
+      }
+
+      zArg = Tcl_GetStringFromObj(objv[2], 0);
+      if( strcmp(zArg, "create")!=0 ){
+         Tcl_AppendResult(interp, "unknown cache subcommand: ", zArg, (char*)0);
+         return TCL_ERROR;
+      }
+
+      for(i=3; i+1<objc; i+=2){
+        zArg = Tcl_GetStringFromObj(objv[i], 0);
+
+        if( strcmp(zArg, "-capacity")==0 ){
+            if(Tcl_GetWideIntFromObj(interp, objv[i+1], &capacity) != TCL_OK) {
+                return TCL_ERROR;
+            }
+        } else{
+           Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
+           return TCL_ERROR;
+        }
+      }
+
+      if( capacity <= 0 ){
+         Tcl_AppendResult(interp, "Error: capacity must be a positive number ", (char*)0);
+         return TCL_ERROR;
+      }
+
+      cacheInfo = new LevelCacheInfo;
+      cacheInfo->cache = leveldb::NewLRUCache((size_t) capacity);
+      cacheInfo->capacity = capacity;
+      cacheInfo->refCount = 1;
+      cacheInfo->handle = LEVELDB_NewHandle(interp, "levelcache", LEVEL_HANDLE_CACHE,
+          cacheInfo, (Tcl_ObjCmdProc *) LEVELDB_CACHE, LEVELDB_CACHE_Delete, &pResultStr);
+
+      Tcl_SetObjResult(interp, pResultStr);
+
+      break;
+    }
+
+    case DB_BENCH: {
+      char *zArg;
+      LevelDBInfo *dbInfo;
+      std::vector<LevelBench *> benches;
+      std::vector<Tcl_ThreadId> ids;
+      std::string values;
+      LevelOpStats total;
+      Tcl_Obj *pResultStr = NULL;
+      Tcl_WideInt num = 100000;
+      Tcl_WideInt ops = 0;
+      Tcl_WideInt found = 0;
+      int value_size = 100;
+      int batch = 1;
+      int threads = 1;
+      int test;
+      int i = 0;
+      int b;
+      double seconds;
+      std::string error;
+      std::chrono::steady_clock::time_point t0;
+      uint64_t seed = 301;
+
+      if( objc < 4 || (objc & 1) != 0 ){
+        Tcl_WrongNumArgs(interp, 2, objv,
+          "DB_HANDLE TEST ?-num N? ?-value_size N? ?-batch N? ?-threads N? ");
+        return TCL_ERROR;
+      }
+
+      dbInfo = (LevelDBInfo *) LEVELDB_GetHandleFromObj(interp, objv[2], LEVEL_HANDLE_DBI);
+      if( !dbInfo ) {
+        return TCL_ERROR;
+      }
+
+      if( Tcl_GetIndexFromObj(interp, objv[3], LevelBenchNames, "test", 0, &test) ){
+        return TCL_ERROR;
+      }
+
+      for(i=4; i+1<objc; i+=2){
+        zArg = Tcl_GetStringFromObj(objv[i], 0);
+
+        if( strcmp(zArg, "-num")==0 ){
+            if(Tcl_GetWideIntFromObj(interp, objv[i+1], &num) != TCL_OK) {
+                return TCL_ERROR;
+            }
+        } else if( strcmp(zArg, "-value_size")==0 ){
+            if(Tcl_GetIntFromObj(interp, objv[i+1], &value_size) != TCL_OK) {
+                return TCL_ERROR;
+            }
+        } else if( strcmp(zArg, "-batch")==0 ){
+            if(Tcl_GetIntFromObj(interp, objv[i+1], &batch) != TCL_OK) {
+                return TCL_ERROR;
+            }
+        } else if( strcmp(zArg, "-threads")==0 ){
+            if(Tcl_GetIntFromObj(interp, objv[i+1], &threads) != TCL_OK) {
+                return TCL_ERROR;
+            }
+        } else{
+           Tcl_AppendResult(interp, "unknown option: ", zArg, (char*)0);
+           return TCL_ERROR;
+        }
+      }
+
+      if( num <= 0 || value_size < 0 || batch <= 0 || threads <= 0 ){
+         Tcl_AppendResult(interp, "Error: -num, -batch and -threads must be positive numbers ", (char*)0);
+         return TCL_ERROR;
+      }
+
+      /*
+       * Values are taken from a buffer of random printable bytes, so
+       * that they do not compress to nothing.
+       */
+      values.resize(std::max((size_t) 1048576, (size_t) value_size * 2));
+      for(size_t j = 0; j < values.size(); j++) {
+        values[j] = (char) (' ' + LEVELDB_BenchRandom(&seed) % 95);
+      }
+
+      for(i = 0; i < threads; i++) {
+        LevelBench *bench = new LevelBench;
+
+        bench->db = dbInfo->db;
+        bench->test = test;
+        bench->num = num;
+        bench->value_size = value_size;
+        bench->batch = batch;
+        bench->seed = 1000 + i;
+        bench->values = &values;
+        bench->ops = 0;
+        bench->found = 0;
+        memset(&bench->stats, 0, sizeof(bench->stats));
+        benches.push_back(bench);
+      }
+
+      t0 = std::chrono::steady_clock::now();
+      if( threads == 1 ) {
+        LEVELDB_BenchRun(benches[0]);
+      } else {
+        for(i = 0; i < threads; i++) {
+          Tcl_ThreadId id;
+
+          if( Tcl_CreateThread(&id, LEVELDB_BenchThread, benches[i],
+                               TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK ) {
+            benches[i]->error = "cannot create thread";
+            continue;
+          }
+          ids.push_back(id);
+        }
+        for(i = 0; i < (int) ids.size(); i++) {
+          int result;
+
+          Tcl_JoinThread(ids[i], &result);
+        }
+      }
+      seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+      memset(&total, 0, sizeof(total));
+      for(i = 0; i < threads; i++) {
+        LevelBench *bench = benches[i];
+
+        ops += bench->ops;
+        found += bench->found;
+        total.count += bench->stats.count;
+        total.bytes += bench->stats.bytes;
+        total.max_ns = std::max(total.max_ns, bench->stats.max_ns);
+        for(b = 0; b < LEVELDB_STAT_BUCKETS; b++) {
+          total.buckets[b] += bench->stats.buckets[b];
+        }
+        if( error.empty() ) {
+          error = bench->error;
+        }
+        delete bench;
+      }
+
+      if( !error.empty() ) {
+        Tcl_AppendResult(interp, "ERROR: ", error.c_str(), (char*)0);
+        return TCL_ERROR;
+      }
+
+      if( seconds <= 0 ) {
+        seconds = 1e-9;
+      }
+
+      pResultStr = Tcl_NewListObj(0, NULL);
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewStringObj("ops", -1));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewWideIntObj(ops));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewStringObj("found", -1));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewWideIntObj(found));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewStringObj("seconds", -1));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewDoubleObj(seconds));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewStringObj("ops_per_sec", -1));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewDoubleObj(ops / seconds));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewStringObj("mb_per_sec", -1));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewDoubleObj(total.bytes / 1048576.0 / seconds));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewStringObj("p50", -1));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewDoubleObj(LEVELDB_StatPercentile(&total, 0.5)));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewStringObj("p99", -1));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewDoubleObj(LEVELDB_StatPercentile(&total, 0.99)));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewStringObj("p999", -1));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewDoubleObj(LEVELDB_StatPercentile(&total, 0.999)));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewStringObj("max", -1));
+      Tcl_ListObjAppendElement(NULL, pResultStr, Tcl_NewDoubleObj(total.max_ns / 1000.0));
+
+      Tcl_SetObjResult(interp, pResultStr);
+
+      break;
+    }
+
+    case DB_TUPLE: {
+      char *zArg;
+      std::string packed;
+      Tcl_Obj *typesObj = NULL;
+      Tcl_Obj *pResultStr = NULL;
+      int i = 0;
+
+      if( objc < 4 ){
+        Tcl_WrongNumArgs(interp, 2, objv, "pack|range list ?-types TYPES? | unpack bytes ");
+        return TCL_ERROR;
+      }
+
+      zArg = Tcl_GetStringFromObj(objv[2], 0);
+      if( strcmp(zArg, "unpack")==0 ){
+        Tcl_Size len;
+        const char *bytes;
+        size_t pos = 0;
+
+        if( objc != 4 ){
+          Tcl_WrongNumArgs(interp, 3, objv, "bytes ");
+          return TCL_ERROR;
+        }
+
+        bytes = (const char *) Tcl_GetByteArrayFromObj(objv[3], &len);
+        packed.assign(bytes, len);
+        pResultStr = LEVELDB_TupleUnpack(packed, &pos, 0);
+        if( !pResultStr ) {
+          Tcl_AppendResult(interp, "Error: invalid tuple encoding ", (char*)0);
+          return TCL_ERROR;
+        }
+
+        Tcl_SetObjResult(interp, pResultStr);
+        break;
+      }
+
+      if( strcmp(zArg, "pack")!=0 && strcmp(zArg, "range")!=0 ){
+         Tcl_AppendResult(interp, "unknown tuple subcommand: ", zArg, (char*)0);
+         return TCL_ERROR;
+      }
+
+      if( (objc&1)!=0 ){
+        Tcl_WrongNumArgs(interp, 3, objv, "list ?-types TYPES? ");
+        return TCL_ERROR;
+      }
+
+      for(i=4; i+1<objc; i+=2){
+        char *zOpt = Tcl_GetStringFromObj(objv[i], 0);
+
+        if( strcmp(zOpt, "-types")==0 ){
+            typesObj = objv[i+1];
+        } else{
+           Tcl_AppendResult(interp, "unknown option: ", zOpt, (char*)0);
+           return TCL_ERROR;
+        }
+      }
+
+      if( LEVELDB_TuplePack(interp, &packed, objv[3], typesObj, 0) != TCL_OK ) {
+        return TCL_ERROR;
+      }
+
+      if( zArg[0] == 'p' ) {
+        pResultStr = Tcl_NewByteArrayObj((const unsigned char *) packed.data(), packed.size());
+      } else {
+        /*
+         * Every tuple with this prefix sorts between these keys: an
+         * element never starts with 0x00 or 0xff.
+         */
+        pResultStr = Tcl_NewListObj(0, NULL);
+        packed.push_back('\0');
+        Tcl_ListObjAppendElement(NULL, pResultStr,
+            Tcl_NewByteArrayObj((const unsigned char *) packed.data(), packed.size()));
+        packed[packed.size() - 1] = '\xff';
+        Tcl_ListObjAppendElement(NULL, pResultStr,
+            Tcl_NewByteArrayObj((const unsigned char *) packed.data(), packed.size()));
+      }
+
+      Tcl_SetObjResult(interp, pResultStr);
+
+      break;
+    }
   }
 
   return TCL_OK;
@@ -1408,6 +7815,7 @@ Leveldb_Init(Tcl_Interp *interp)
         tsdPtr->itr_count = 0;
         tsdPtr->bat_count = 0;
         tsdPtr->sst_count = 0;
+        tsdPtr->cache_count = 0;
     }
     Tcl_MutexUnlock(&myMutex);
 